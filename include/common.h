@@ -47,10 +47,13 @@ extern "C" {
 // Zoom method
 #define ZOOM_METHOD_COPY 0
 #define ZOOM_METHOD_BLINE 1
+#define ZOOM_METHOD_AREA 2
+#define ZOOM_METHOD_LANCZOS 3
 
 // Padding method
 #define PAD_METHOD_ZERO 0
 #define PAD_METHOD_BORDER 1
+#define PAD_METHOD_REFLECT 2
 
 #define syslog_info(fmt, arg...)                       \
     do {                                               \
@@ -139,6 +142,26 @@ void time_spend(char* prompt);
 // Space resize
 void space_resize(int h, int w, int maxhw, int times, int* nh, int* nw);
 
+// Parallel, split [0, n) into bands, func(arg, start, stop) for every band
+typedef void (*parallel_func_t)(void* arg, int start, int stop);
+int parallel_threads(); // env NIMAGE_THREADS could limit threads
+int parallel_for(int n, int grain, parallel_func_t func, void* arg);
+
+// Pool, size bucketed and thread local cache for big temporary buffers
+typedef struct {
+    uint64_t hits, misses;
+    size_t used, peak, cached; // bytes
+} POOL_STATS;
+
+void* pool_malloc(size_t size); // 64 bytes aligned, NOT cleared
+void* pool_calloc(size_t size);
+void pool_free(void* p);
+int pool_scope_begin(); // pool_scope_end frees blocks allocated after begin on this thread
+void pool_scope_end();
+void pool_trim(); // env NIMAGE_POOL_MB limit cache of every thread, 0 disable
+void pool_stats(POOL_STATS* stats);
+void pool_stats_reset();
+
 // if lock success, return 1, else return 0
 int file_locked(char* endpoint);
 void file_unlock(char* endpoint);
@@ -146,13 +169,30 @@ void file_unlock(char* endpoint);
 int file_exist(char* filename);
 int file_size(char* filename);
 char* file_load(char* filename, int* size);
+char* file_map(char* filename, size_t* size); // mmap, pages are copy on write
+void file_unmap(char* buf, size_t size);
 int file_save(char* filename, char* buf, int size);
 int file_chown(char* dfile, char* sfile);
 int make_dir(char* dirname);
 
+// Base64 by SSSE3/AVX2 when cpu supports (env NIMAGE_BASE64_SCALAR to disable), new_line: '\n' every 64 chars
 char *base64_encode(const char *input_data, int input_size, int new_line); // free(...)
 char *base64_decode(char *input_data, int input_size, int *output_size, int new_line); // free(...)
 
+// Streaming base64 encoder, data can be fed in pieces of any size
+typedef struct {
+    char* text; // NUL terminated
+    size_t length, capacity;
+    int new_line, column;
+    int ncarry;
+    BYTE carry[3];
+} BASE64;
+
+void base64_begin(BASE64* b, int new_line);
+int base64_reserve(BASE64* b, size_t n); // room for n more input bytes
+int base64_update(BASE64* b, const char* data, size_t n);
+char* base64_end(BASE64* b, int* size); // text, free(...)
+
 #if defined(__cplusplus)
 }
 #endif
@@ -40,21 +40,38 @@ typedef struct {
 typedef struct {
     DWORD magic; // IMAGE_MAGIC
     WORD height, width, format;
-    RGBA_8888 **ie, *base;
+    RGBA_8888 **ie, *base; // base == ie[0], rows are stride bytes apart
+    int stride, pad; // row bytes (IMAGE_ALIGN aligned), border pixels around image
+    char* map; // pixels are in mapped .nimg file, NULL -- in pool memory
+    size_t mapsize;
+    void* owner; // IMAGE whose block holds the pixels (view/share), NULL -- own block
+    int refs; // heads on pixels of this block, block is freed at 0
+    int shares; // copy on write heads on pixels of this block
+    int cow; // pixels are shared copy on write, see image_writable()
+    int view; // pixels are of another image, writes go through, see image_view()
 
     // Extentend for cluster & color mask
     int K, KColors[256], KCounts[256], KRadius, KInstance;
 } IMAGE;
 
+#define IMAGE_ALIGN 64
+
 #define IMAGE_RGBA 0
 #define IMAGE_GRAY 1
 #define IMAGE_RGB565 2
 #define IMAGE_MASK 3
 
+// Layout of .nimg payload
+#define NIMG_RGBA 0 // rows of RGBA_8888, can be mapped as image directly
+#define NIMG_PLANAR 1 // R, G, B, A planes
+
 #define image_foreach(img, i, j)      \
     for (i = 0; i < img->height; i++) \
         for (j = 0; j < img->width; j++)
 
+// Row i in [-pad, height + pad), columns [-pad, width + pad) are valid
+#define image_row(img, i) ((RGBA_8888*)((BYTE*)(img)->base + (long)(i) * (img)->stride))
+
 #define check_image(img)                \
     do {                                \
         if (!image_valid(img)) {        \
@@ -125,8 +142,16 @@ typedef struct {
 #define RGB565_NO(r, g, b) (((r)&0xf8) << 8 | ((g)&0xfc) << 3 | ((b)&0xf8) >> 3)
 
 IMAGE* image_create(WORD h, WORD w);
-IMAGE* image_load(char* fname);
+IMAGE* image_create_uninit(WORD h, WORD w); // pixels are NOT set, caller must write all
+IMAGE* image_create_padded(WORD h, WORD w, int pad); // pad pixels border on every side
+int image_fill_border(IMAGE* img, int method); // PAD_METHOD_ZERO/BORDER/REFLECT
+IMAGE* image_load(char* fname); // .nimg is mapped, not decoded
+IMAGE* image_load_scaled(char* fname, int max_h, int max_w); // fit in max_h x max_w, jpeg scaled in DCT domain
+IMAGE* image_load_rect(char* fname, RECT* rect); // rect is clamped
 IMAGE* image_copy(IMAGE* img);
+IMAGE* image_view(IMAGE* img, RECT* rect); // no copy, shares pixels of img with row stride, rect is clamped
+IMAGE* image_share(IMAGE* img, RECT* rect); // copy on write, rect NULL -- whole image
+int image_writable(IMAGE* img); // before writing ie[][] of a shared image or its source, views write through
 IMAGE* image_zoom(IMAGE* img, int nh, int nw, int method);
 IMAGE* image_hmerge(IMAGE* image1, IMAGE* image2);
 
@@ -135,6 +160,7 @@ int image_clear(IMAGE* img);
 int image_outdoor(IMAGE* img, int i, int di, int j, int dj);
 int image_rectclamp(IMAGE* img, RECT* rect);
 int image_save(IMAGE* img, const char* fname);
+int image_savenimg(IMAGE* img, const char* fname, int layout); // NIMG_RGBA/NIMG_PLANAR
 
 int image_show(IMAGE* image, char* title);
 
@@ -144,6 +170,8 @@ MATRIX* image_getplane(IMAGE* img, char oargb);
 MATRIX* image_rect_plane(IMAGE* img, char oargb, RECT* rect);
 
 int image_setplane(IMAGE* img, char oargb, MATRIX* mat);
+int image_getplanes(IMAGE* img, char* orgb, MATRIX** planes); // one pass, orgb like "RGB"
+int image_setplanes(IMAGE* img, char* orgb, MATRIX** planes);
 
 void color_rgb2gray(BYTE r, BYTE g, BYTE b, BYTE* gray);
 int skin_detect(IMAGE* img);
@@ -170,6 +198,25 @@ int image_drawtext(IMAGE* image, int r, int c, char* texts, int color);
 int image_drawkxb(IMAGE* image, float k, float b, int color);
 
 int image_psnr(char oargb, IMAGE* orig, IMAGE* now, float* psnr);
+
+// Quality of img against ref, over R, G, B of images or all channels of tensors
+#define QUALITY_PSNR 0x01
+#define QUALITY_SSIM 0x02
+#define QUALITY_MSSSIM 0x04 // 5 scales, fewer for small images
+#define QUALITY_ALL (QUALITY_PSNR | QUALITY_SSIM | QUALITY_MSSSIM)
+#define QUALITY_MAX_CHANNELS 4
+#define QUALITY_PSNR_MAX 100.0f // for same images
+
+typedef struct {
+    int channels, frames; // frames -- images, tensor batches or video frames
+    float mse[QUALITY_MAX_CHANNELS], psnr[QUALITY_MAX_CHANNELS];
+    float ssim[QUALITY_MAX_CHANNELS], msssim[QUALITY_MAX_CHANNELS];
+    float mse_all, psnr_all, ssim_all, msssim_all; // over channels
+} QUALITY;
+
+int image_quality(IMAGE* ref, IMAGE* img, int flags, QUALITY* quality);
+int tensor_quality(TENSOR* ref, TENSOR* tensor, float range, int flags, QUALITY* quality); // range -- 1.0 or 255.0
+void quality_dump(char* title, QUALITY* quality);
 int image_paste(IMAGE* img, int r, int c, IMAGE* small, float alpha);
 int image_rect_paste(IMAGE* bigimg, RECT* bigrect, IMAGE* smallimg, RECT* smallrect);
 
@@ -231,10 +278,13 @@ int image_make_noise(IMAGE* img, char orgb, int rate);
 int image_delete_noise(IMAGE* img);
 int image_gauss_filter(IMAGE* image, float sigma);
 int image_guided_filter(IMAGE* img, IMAGE* guidance, int radius, float eps, int scale, int debug);
+int image_color_guided_filter(IMAGE* img, IMAGE* guidance, int radius, float eps, int debug);
 int image_beeps_filter(IMAGE* img, float stdv, float dec, int debug);
+int image_bilate_filter(IMAGE* img, float hs, float hr, int debug);
 int image_lee_filter(IMAGE* img, int radius, float eps, int debug);
 int image_dehaze_filter(IMAGE* img, int radius, int debug);
-int image_medium_filter(IMAGE* img, int radius);
+int image_medium_filter(IMAGE* img, int radius); // R, G, B
+int image_channel_medium_filter(IMAGE* img, int radius, char* orgba);
 int image_fast_filter(IMAGE* img, int n, int* kernel, int total);
 int image_gauss3x3_filter(IMAGE* img, RECT* rect);
 int image_gauss5x5_filter(IMAGE* img, RECT* rect);
@@ -271,11 +321,39 @@ int histogram_cdf(HISTOGRAM* h);
 int histogram_map(HISTOGRAM* h, int max);
 float histogram_likeness(HISTOGRAM* h1, HISTOGRAM* h2);
 void histogram_sum(HISTOGRAM* sum, HISTOGRAM* sub);
+
+// Channels of bulk histograms, gray is color_rgb2gray
+#define HISTOGRAM_R 0x01
+#define HISTOGRAM_G 0x02
+#define HISTOGRAM_B 0x04
+#define HISTOGRAM_GRAY 0x08
+#define HISTOGRAM_ALPHA 0x10
+#define HISTOGRAM_ALL 0x1f
+
+int histogram_count(IMAGE* img, RECT* rect, int channels, uint64_t (*count)[HISTOGRAM_MAX_COUNT]); // rect == NULL -- whole image
+int histogram_image(HISTOGRAM* hist, IMAGE* img, RECT* rect, int channels);
 int histogram_rect(HISTOGRAM* hist, IMAGE* img, RECT* rect);
 void histogram_dump(HISTOGRAM* h);
 
 float image_entropy(IMAGE* img); // Return [0.0, 1.0]
 
+// Statistics of R, G, B and luma 'A' (color_rgb2gray) in one pass, 64 bits counters
+#define STATISTICS_R 0
+#define STATISTICS_G 1
+#define STATISTICS_B 2
+#define STATISTICS_A 3
+#define STATISTICS_CHANNELS 4
+
+typedef struct {
+    uint64_t total;
+    uint64_t count[STATISTICS_CHANNELS][HISTOGRAM_MAX_COUNT];
+    uint64_t sum[STATISTICS_CHANNELS], sum2[STATISTICS_CHANNELS]; // sum of v, v * v
+    int min[STATISTICS_CHANNELS], max[STATISTICS_CHANNELS];
+    float mean[STATISTICS_CHANNELS], var[STATISTICS_CHANNELS], stdv[STATISTICS_CHANNELS];
+} STATISTICS;
+
+int image_statistics_all(IMAGE* img, RECT* rect, STATISTICS* stats); // rect == NULL -- whole image
+
 // Mask is all you need
 #define MASK IMAGE
 
@@ -300,8 +378,41 @@ int image_parse_arrow(IMAGE *image, int *start_row, int *start_col, int *stop_ro
 IMAGE* image_loadpng_from_memory(char *data, size_t size);
 char *image_savepng_to_memory(IMAGE* image, int *size); // if return is not null, need free(...)
 
+// Png save options, strips of rows are deflated on threads and stitched to one IDAT stream
+#define PNG_SAVE_FILTER_NONE 0
+#define PNG_SAVE_FILTER_SUB 1
+#define PNG_SAVE_FILTER_UP 2
+#define PNG_SAVE_FILTER_AVG 3
+#define PNG_SAVE_FILTER_PAETH 4
+#define PNG_SAVE_FILTER_ADAPTIVE 5 // per row, minimum sum of absolute differences
+
+typedef struct {
+    int level; // zlib level 0-9, default 6 (env NIMAGE_PNG_LEVEL), 1 for fast frame dumps
+    int filter; // PNG_SAVE_FILTER_*
+    int strategy; // zlib Z_DEFAULT_STRATEGY/Z_FILTERED/Z_HUFFMAN_ONLY/Z_RLE
+    int rgb; // 1 -- save 3 channels when alpha is all opaque
+    int threads; // <= 0 -- parallel_threads()
+} PNG_OPTIONS;
+
+// Png data in pieces, total is the whole png size, return RET_OK to go on
+typedef int (*png_write_t)(char* data, size_t n, size_t total, void* arg);
+
+void png_options_init(PNG_OPTIONS* opt);
+int image_png_write(IMAGE* img, PNG_OPTIONS* opt, png_write_t func, void* arg); // opt NULL -- default
+char* image_png_encode(IMAGE* img, PNG_OPTIONS* opt, int* size); // opt NULL -- default, need free(...)
+int image_savepng_opt(IMAGE* img, const char* fname, PNG_OPTIONS* opt);
+
+IMAGE* image_loadjpeg_from_memory(char *data, size_t size);
+char *image_savejpeg_to_memory(IMAGE* image, int quality, int *size); // if return is not null, need free(...)
+IMAGE* image_loadqoi(char* fname);
+int image_saveqoi(IMAGE* image, const char* fname);
+IMAGE* image_loadqoi_from_memory(char *data, size_t size);
+char *image_saveqoi_to_memory(IMAGE* image, int *size); // QOI lossless, fast for intermediate frames, need free(...)
+IMAGE* image_load_from_memory(char *data, size_t size); // png/jpeg/nimg/qoi by magic bytes
+void image_jpeg_fastdct(int fast); // jpeg fast integer DCT, env NIMAGE_JPEG_FASTDCT
+
 char *image_base64(IMAGE *image);   // convert image to base64 txt
-IMAGE *base64_image(char *b64_txt); // convert base64 txt to image
+IMAGE *base64_image(char *b64_txt); // convert base64 txt (png/jpeg/nimg/qoi) to image
 
 #if defined(__cplusplus)
 }
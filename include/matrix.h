@@ -53,6 +53,7 @@ typedef struct {
 typedef float (*distancef_t)(float* a, float* b, int n);
 
 MATRIX* matrix_create(int m, int n);
+MATRIX* matrix_create_uninit(int m, int n); // data are NOT cleared
 
 MATRIX* matrix_copy(MATRIX* src);
 MATRIX* matrix_zoom(MATRIX* mat, int nm, int nn, int method);
@@ -0,0 +1,86 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#ifndef __STREAM_H
+#define __STREAM_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "image.h"
+
+// Row streaming of png/jpeg, only one band of rows is in memory
+#define STREAM_BAND 64 // env NIMAGE_STREAM_BAND
+
+#define STREAM_JPEG 1
+#define STREAM_PNG 2
+
+#define check_ireader(r)                        \
+    do {                                        \
+        if (!ireader_valid(r)) {                \
+            syslog_error("Bad image reader.");  \
+            return RET_ERROR;                   \
+        }                                       \
+    } while (0)
+
+#define check_iwriter(w)                        \
+    do {                                        \
+        if (!iwriter_valid(w)) {                \
+            syslog_error("Bad image writer.");  \
+            return RET_ERROR;                   \
+        }                                       \
+    } while (0)
+
+typedef struct {
+    DWORD magic; // IREADER_MAGIC
+    int height, width; // no 65535 limit
+    int format; // IMAGE_RGBA or IMAGE_GRAY, pixels are always RGBA, jpeg alpha is 255
+    int row; // next row to read
+
+    // internal
+    void* _codec;
+} IREADER;
+
+typedef struct {
+    DWORD magic; // IWRITER_MAGIC
+    int height, width;
+    int row; // next row to write
+
+    // internal
+    void* _codec;
+} IWRITER;
+
+// Band of rows [r, r + n), return RET_OK to go on
+typedef int (*stream_func_t)(int r, int n, int width, RGBA_8888** rows, void* arg);
+
+IREADER* ireader_open(char* fname); // png/jpeg
+IREADER* ireader_open_scaled(char* fname, int max_h, int max_w); // jpeg DCT scaled, still covers max_h x max_w fit
+IREADER* ireader_open_memory(char* data, size_t size); // format by magic bytes, data must live until close
+int ireader_valid(IREADER* r);
+int ireader_read(IREADER* r, RGBA_8888** rows, int n); // return rows read, 0 -- end, < 0 -- error
+int ireader_skip(IREADER* r, int n);
+int ireader_crop(IREADER* r, int* c, int* w); // before first row, [*c, *c + *w) is set to decoded columns
+void ireader_close(IREADER* r);
+IMAGE* ireader_image(IREADER* r); // rest rows to image and close r, r can be NULL
+
+IWRITER* iwriter_open(char* fname, int height, int width, int quality); // quality only for jpeg
+int iwriter_valid(IWRITER* w);
+int iwriter_write(IWRITER* w, RGBA_8888** rows, int n);
+int iwriter_close(IWRITER* w); // RET_ERROR if rows are missing
+IWRITER* iwriter_open_memory(int type, int height, int width, int quality); // STREAM_JPEG/STREAM_PNG
+char* iwriter_close_memory(IWRITER* w, int* size); // encoded data, need free(...)
+
+// Decode ifname by bands on a thread, func changes band in place, then band is saved to ofname (NULL -- no save)
+int image_stream(char* ifname, char* ofname, int band, stream_func_t func, void* arg);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // __STREAM_H
@@ -40,6 +40,7 @@ typedef struct {
 
 int tensor_valid(TENSOR* tensor);
 TENSOR* tensor_create(int b, int c, int h, int w);
+TENSOR* tensor_create_uninit(int b, int c, int h, int w); // data are NOT cleared
 TENSOR* tensor_copy(TENSOR* src);
 int tensor_zero_(TENSOR* tensor);
 int tensor_clamp_(TENSOR* tensor, float low, float high);
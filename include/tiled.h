@@ -0,0 +1,84 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#ifndef __TILED_H
+#define __TILED_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "image.h"
+
+// Out of core image, pixels are in TIMAGE_TILE x TIMAGE_TILE tiles of a memory mapped scratch file,
+// only LRU tiles under budget are mapped
+#define TIMAGE_TILE 256
+#define TIMAGE_BUDGET_MB 512 // env NIMAGE_TILE_MB
+
+#define check_timage(t)                          \
+    do {                                         \
+        if (!timage_valid(t)) {                  \
+            syslog_error("Bad tiled image.");    \
+            return RET_ERROR;                    \
+        }                                        \
+    } while (0)
+
+#define CHECK_TIMAGE(t)                          \
+    do {                                         \
+        if (!timage_valid(t)) {                  \
+            syslog_error("Bad tiled image.");    \
+            return NULL;                         \
+        }                                        \
+    } while (0)
+
+typedef struct {
+    DWORD magic; // TIMAGE_MAGIC
+    int height, width; // no 65535 limit
+    int rows, cols; // tiles
+    void* cache; // tile cache, scratch file
+} TIMAGE;
+
+// Tile with halo, halo is clipped at image border, so filters see same border as whole image
+typedef struct {
+    int index; // [0, rows * cols)
+    RECT rect; // tile in TIMAGE
+    int r, c; // tile in img
+    IMAGE* img;
+} TILE;
+
+typedef int (*timage_func_t)(TILE* tile, void* arg);
+
+#define timage_foreach_tile(t, k) for (k = 0; k < (t)->rows * (t)->cols; k++)
+
+TIMAGE* timage_create(int h, int w, int budget_mb); // budget_mb <= 0: default
+int timage_valid(TIMAGE* t);
+void timage_destroy(TIMAGE* t);
+
+int timage_getrow(TIMAGE* t, int i, int c, int n, RGBA_8888* buf); // pixels [c, c + n) of row i
+int timage_setrow(TIMAGE* t, int i, int c, int n, RGBA_8888* buf);
+IMAGE* timage_read_rect(TIMAGE* t, RECT* rect); // pixels out of image are replicated
+int timage_write_rect(TIMAGE* t, RECT* rect, IMAGE* img, int r, int c); // img from (r, c) to rect
+
+int timage_tile_rect(TIMAGE* t, int k, RECT* rect);
+int timage_tile_load(TIMAGE* t, int k, int halo, TILE* tile);
+int timage_tile_save(TIMAGE* t, TILE* tile); // halo is skipped
+void timage_tile_free(TILE* tile);
+int timage_apply(TIMAGE* src, TIMAGE* dst, int halo, timage_func_t func, void* arg); // tile parallel
+
+TIMAGE* timage_zoom(TIMAGE* t, int nh, int nw, int method);
+int timage_gauss_filter(TIMAGE* t, float sigma);
+int timage_clahe(TIMAGE* t, int grid_rows, int grid_cols, float limit);
+
+TIMAGE* timage_load(char* fname, int budget_mb); // png/jpeg, row by row
+int timage_save(TIMAGE* t, char* fname);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // __TILED_H
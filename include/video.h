@@ -95,6 +95,9 @@ int video_mds(char* filename, int start);
 // Video IDS: Instrusion Detection System
 int video_ids(char* filename, int start, float threshold);
 
+// Compare two videos frame by frame, quality is mean of frames
+int video_quality(char* ref_file, char* filename, int flags, QUALITY* quality);
+
 int video_encode(char* input_dir, char* output_file);
 int video_decode(char* input_file, char* output_dir);
 
@@ -0,0 +1,431 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_X86 1
+#endif
+
+// Same text as openssl BIO_f_base64: 64 chars a line, every line ends with '\n'
+#define BASE64_LINE 64
+
+#define BASE64_SIMD_NONE 0
+#define BASE64_SIMD_SSSE3 1
+#define BASE64_SIMD_AVX2 2
+
+static const char __b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int __b64_simd = -1;
+
+// Char -> 6 bits, -1 for chars out of alphabet
+static const signed char __b64_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static int __base64_simd()
+{
+    if (__b64_simd < 0) {
+        __b64_simd = BASE64_SIMD_NONE;
+#ifdef BASE64_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            __b64_simd = BASE64_SIMD_AVX2;
+        else if (__builtin_cpu_supports("ssse3"))
+            __b64_simd = BASE64_SIMD_SSSE3;
+#endif
+        if (getenv("NIMAGE_BASE64_SCALAR"))
+            __b64_simd = BASE64_SIMD_NONE;
+    }
+    return __b64_simd;
+}
+
+#ifdef BASE64_X86
+// Lookup free encoding and decoding, see Wojciech Mula, "Base64 encoding and decoding with SIMD instructions"
+
+__attribute__((target("ssse3"))) static size_t __encode_ssse3(const BYTE* in, size_t n, size_t avail, char* out)
+{
+    size_t i = 0;
+    __m128i x, t, idx, r;
+    const __m128i enc_shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    // Loads 16 bytes for 12
+    for (; i + 12 <= n && i + 16 <= avail; i += 12, out += 16) {
+        // 12 bytes -> 16 indices of 6 bits
+        x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i)), enc_shuf);
+        t = _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        idx = _mm_or_si128(t, _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010)));
+        // Index to ascii by offset of its range
+        r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+        r = _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+        _mm_storeu_si128((__m128i*)out, r);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t __encode_avx2(const BYTE* in, size_t n, size_t avail, char* out)
+{
+    size_t i = 0;
+    __m256i x, t, idx, r;
+    const __m256i enc_shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    // 12 bytes a lane, high lane loads from in + 12
+    for (; i + 24 <= n && i + 28 <= avail; i += 24, out += 32) {
+        x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+            _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+        x = _mm256_shuffle_epi8(x, enc_shuf);
+        t = _mm256_mulhi_epu16(_mm256_and_si256(x, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        idx = _mm256_or_si256(t, _mm256_mullo_epi16(_mm256_and_si256(x, _mm256_set1_epi32(0x003f03f0)),
+            _mm256_set1_epi32(0x01000010)));
+        r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+        r = _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx);
+        _mm256_storeu_si256((__m256i*)out, r);
+    }
+    return i;
+}
+
+// 16 chars -> 12 bytes, stops at first block with any char out of alphabet ('=', '\n', ...)
+__attribute__((target("ssse3"))) static size_t __decode_ssse3(const char* in, size_t n, BYTE* out, size_t* m)
+{
+    size_t i = 0;
+    __m128i x, hi, lo, v;
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    *m = 0;
+    for (; i + 16 <= n; i += 16, *m += 12) {
+        x = _mm_loadu_si128((const __m128i*)(in + i));
+        hi = _mm_and_si128(_mm_srli_epi32(x, 4), nibble);
+        lo = _mm_and_si128(x, nibble);
+        v = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_setzero_si128())))
+            break;
+        v = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')), hi));
+        v = _mm_add_epi8(x, v);
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)(out + *m), _mm_shuffle_epi8(v, pack)); // 4 bytes over, out has room
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t __decode_avx2(const char* in, size_t n, BYTE* out, size_t* m)
+{
+    size_t i = 0;
+    __m256i x, hi, lo, v;
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    *m = 0;
+    for (; i + 32 <= n; i += 32, *m += 24) {
+        x = _mm256_loadu_si256((const __m256i*)(in + i));
+        hi = _mm256_and_si256(_mm256_srli_epi32(x, 4), nibble);
+        lo = _mm256_and_si256(x, nibble);
+        v = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi));
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_setzero_si256())))
+            break;
+        v = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')), hi));
+        v = _mm256_add_epi8(x, v);
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+        v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i*)(out + *m), v); // 8 bytes over, out has room
+    }
+    return i;
+}
+#endif
+
+// 4 chars -> 3 bytes while all chars are in alphabet
+static size_t __decode_scalar(const char* in, size_t n, BYTE* out, size_t* m)
+{
+    size_t i = 0;
+    int a, b, c, d;
+
+    *m = 0;
+    for (; i + 4 <= n; i += 4, *m += 3) {
+        a = __b64_values[(BYTE)in[i]];
+        b = __b64_values[(BYTE)in[i + 1]];
+        c = __b64_values[(BYTE)in[i + 2]];
+        d = __b64_values[(BYTE)in[i + 3]];
+        if ((a | b | c | d) < 0)
+            break;
+        out[*m] = (BYTE)((a << 2) | (b >> 4));
+        out[*m + 1] = (BYTE)((b << 4) | (c >> 2));
+        out[*m + 2] = (BYTE)((c << 6) | d);
+    }
+    return i;
+}
+
+// n bytes, in + avail is readable for vector loads, return chars
+static size_t __encode(const BYTE* in, size_t n, size_t avail, char* out)
+{
+    size_t i = 0;
+    char* o = out;
+    uint32_t t;
+
+#ifdef BASE64_X86
+    if (__base64_simd() == BASE64_SIMD_AVX2) {
+        i = __encode_avx2(in, n, avail, o);
+        o += i / 3 * 4;
+    }
+    if (__base64_simd() >= BASE64_SIMD_SSSE3) {
+        n -= i;
+        avail -= i;
+        in += i;
+        i = __encode_ssse3(in, n, avail, o);
+        o += i / 3 * 4;
+    }
+#else
+    (void)avail;
+#endif
+    for (; i + 3 <= n; i += 3) {
+        t = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+        *o++ = __b64_chars[(t >> 18) & 0x3f];
+        *o++ = __b64_chars[(t >> 12) & 0x3f];
+        *o++ = __b64_chars[(t >> 6) & 0x3f];
+        *o++ = __b64_chars[t & 0x3f];
+    }
+    if (i < n) {
+        t = (uint32_t)in[i] << 16;
+        if (i + 1 < n)
+            t |= (uint32_t)in[i + 1] << 8;
+        *o++ = __b64_chars[(t >> 18) & 0x3f];
+        *o++ = __b64_chars[(t >> 12) & 0x3f];
+        *o++ = (i + 1 < n) ? __b64_chars[(t >> 6) & 0x3f] : '=';
+        *o++ = '=';
+    }
+    return (size_t)(o - out);
+}
+
+static int __base64_grow(BASE64* b, size_t n)
+{
+    size_t cap;
+    char* text;
+
+    if (b->length + n + 1 <= b->capacity)
+        return RET_OK;
+    cap = MAX(b->capacity * 2, b->length + n + 1);
+    text = (char*)realloc(b->text, cap);
+    if (!text) {
+        syslog_error("Allocate memeory.");
+        return RET_ERROR;
+    }
+    b->text = text;
+    b->capacity = cap;
+    return RET_OK;
+}
+
+// Whole groups of 3 bytes only, carry is done by caller
+static void __base64_put(BASE64* b, const BYTE* in, size_t n, size_t avail)
+{
+    size_t k;
+
+    if (!b->new_line) {
+        b->length += __encode(in, n, avail, b->text + b->length);
+        return;
+    }
+    while (n > 0) {
+        k = MIN(n, (size_t)(BASE64_LINE - b->column) / 4 * 3);
+        b->length += __encode(in, k, avail, b->text + b->length);
+        b->column += (int)(k / 3 * 4);
+        if (b->column == BASE64_LINE) {
+            b->text[b->length++] = '\n';
+            b->column = 0;
+        }
+        in += k;
+        n -= k;
+        avail -= k;
+    }
+}
+
+void base64_begin(BASE64* b, int new_line)
+{
+    memset(b, 0, sizeof(BASE64));
+    b->new_line = new_line;
+}
+
+int base64_reserve(BASE64* b, size_t n)
+{
+    size_t m = (n + 2) / 3 * 4 + 4;
+
+    if (b->new_line)
+        m += m / BASE64_LINE + 1;
+    return __base64_grow(b, m);
+}
+
+int base64_update(BASE64* b, const char* data, size_t n)
+{
+    size_t k;
+    const BYTE* in = (const BYTE*)data;
+
+    if (n == 0)
+        return RET_OK;
+    if (base64_reserve(b, b->ncarry + n) != RET_OK)
+        return RET_ERROR;
+
+    if (b->ncarry > 0) {
+        k = MIN(n, (size_t)(3 - b->ncarry));
+        memcpy(b->carry + b->ncarry, in, k);
+        b->ncarry += (int)k;
+        in += k;
+        n -= k;
+        if (b->ncarry < 3)
+            return RET_OK;
+        __base64_put(b, b->carry, 3, 3);
+        b->ncarry = 0;
+    }
+    k = n / 3 * 3;
+    __base64_put(b, in, k, n);
+    b->ncarry = (int)(n - k);
+    memcpy(b->carry, in + k, b->ncarry);
+    b->text[b->length] = '\0';
+
+    return RET_OK;
+}
+
+char* base64_end(BASE64* b, int* size)
+{
+    char* text;
+
+    if (base64_reserve(b, 3) != RET_OK) {
+        free(b->text);
+        return NULL;
+    }
+    if (b->ncarry > 0) {
+        b->length += __encode(b->carry, b->ncarry, b->ncarry, b->text + b->length);
+        b->column += 4;
+    }
+    if (b->new_line && b->column > 0)
+        b->text[b->length++] = '\n';
+    b->text[b->length] = '\0';
+
+    text = b->text;
+    if (size)
+        *size = (int)b->length;
+    memset(b, 0, sizeof(BASE64));
+    return text;
+}
+
+char *base64_encode(const char *input_data, int input_size, int new_line)
+{
+    BASE64 b;
+
+    CHECK_POINT(input_data != NULL && input_size >= 0);
+    base64_begin(&b, new_line);
+    if (base64_reserve(&b, input_size) != RET_OK || base64_update(&b, input_data, input_size) != RET_OK) {
+        free(b.text);
+        return NULL;
+    }
+    return base64_end(&b, NULL);
+}
+
+// White spaces are skipped for any new_line, decoding stops at '='
+char *base64_decode(char *input_data, int input_size, int *output_size, int new_line)
+{
+    int k, v;
+    size_t i, n, m;
+    BYTE q[4], *out, *o;
+
+    (void)new_line;
+    *output_size = 0;
+    CHECK_POINT(input_data != NULL && input_size >= 0);
+    n = (size_t)input_size;
+    out = (BYTE*)calloc(n / 4 * 3 + 32 + 1, sizeof(BYTE)); // room for vector stores
+    CHECK_POINT(out != NULL);
+
+    o = out;
+    i = 0;
+    while (i < n) {
+#ifdef BASE64_X86
+        if (__base64_simd() == BASE64_SIMD_AVX2) {
+            i += __decode_avx2(input_data + i, n - i, o, &m);
+            o += m;
+        }
+        if (__base64_simd() >= BASE64_SIMD_SSSE3) {
+            i += __decode_ssse3(input_data + i, n - i, o, &m);
+            o += m;
+        }
+#endif
+        i += __decode_scalar(input_data + i, n - i, o, &m);
+        o += m;
+
+        // One quantum by scalar, over white spaces or to the end
+        for (k = 0; k < 4 && i < n; i++) {
+            if (isspace((unsigned char)input_data[i]))
+                continue;
+            if (input_data[i] == '=')
+                break;
+            v = __b64_values[(BYTE)input_data[i]];
+            if (v < 0) {
+                syslog_error("Bad base64 char 0x%02x.", (unsigned char)input_data[i]);
+                free(out);
+                return NULL;
+            }
+            q[k++] = (BYTE)v;
+        }
+        if (k == 1) {
+            syslog_error("Bad base64 length.");
+            free(out);
+            return NULL;
+        }
+        if (k >= 2)
+            *o++ = (BYTE)((q[0] << 2) | (q[1] >> 4));
+        if (k >= 3)
+            *o++ = (BYTE)((q[1] << 4) | (q[2] >> 2));
+        if (k == 4)
+            *o++ = (BYTE)((q[2] << 6) | q[3]);
+        if (k < 4)
+            break;
+    }
+    *o = '\0';
+    *output_size = (int)(o - out);
+
+    return (char*)out;
+}
@@ -139,6 +139,8 @@ int image_blend(IMAGE* src, IMAGE* mask, IMAGE* dst, int top, int left,
 
     check_image(src);
     check_image(dst);
+    check_point(image_writable(src) == RET_OK);
+    check_point(image_writable(dst) == RET_OK);
 
     if (debug) {
         time_reset();
@@ -265,6 +265,7 @@ int skin_detect(IMAGE* img)
 {
     int i, j;
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     image_foreach(img, i, j)
     {
         if (!color_beskin(img->ie[i][j].r, img->ie[i][j].g, img->ie[i][j].b)) {
@@ -322,6 +323,7 @@ int color_cluster(IMAGE* image, int num)
     int classno[0xffff + 1];
 
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
 
     mat = color_classmat(image);
     check_matrix(mat);
@@ -556,6 +558,7 @@ int color_correct(IMAGE* img, float gain_r, float gain_g, float gain_b)
     float d;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     image_foreach(img, i, j)
     {
@@ -578,6 +581,7 @@ int color_togray(IMAGE* img)
     int i, j;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     image_foreach(img, i, j)
     {
@@ -595,6 +599,7 @@ int color_torgb565(IMAGE* img)
     int i, j;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     image_foreach(img, i, j)
     {
@@ -14,9 +14,20 @@
 #include <sys/file.h>
 
 // stat ...
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <zlib.h>
 
+#include <pthread.h>
+
+#define PARALLEL_MAX_THREADS 64
+
+typedef struct {
+    parallel_func_t func;
+    void* arg;
+    int start, stop;
+} ParallelTask;
+
 static TIME __system_ms_time;
 
 
@@ -64,6 +75,70 @@ void space_resize(int h, int w, int maxhw, int times, int* nh, int* nw)
     *nw = w * times;
 }
 
+static void* __parallel_worker(void* p)
+{
+    ParallelTask* t = (ParallelTask*)p;
+    t->func(t->arg, t->start, t->stop);
+    return NULL;
+}
+
+int parallel_threads()
+{
+    static int threads = 0;
+    char* env;
+
+    if (threads < 1) {
+        env = getenv("NIMAGE_THREADS");
+        threads = (env) ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        threads = CLAMP(threads, 1, PARALLEL_MAX_THREADS);
+    }
+    return threads;
+}
+
+// Run func over [0, n) with at most parallel_threads() bands, every band >= grain,
+// the first band runs on caller thread
+int parallel_for(int n, int grain, parallel_func_t func, void* arg)
+{
+    int i, k, step;
+    pthread_t tid[PARALLEL_MAX_THREADS];
+    ParallelTask task[PARALLEL_MAX_THREADS];
+    int started[PARALLEL_MAX_THREADS];
+
+    if (n < 1 || !func)
+        return RET_ERROR;
+
+    grain = MAX(grain, 1);
+    k = MIN(parallel_threads(), (n + grain - 1) / grain);
+    if (k <= 1) {
+        func(arg, 0, n);
+        return RET_OK;
+    }
+
+    step = (n + k - 1) / k;
+    for (i = 0; i < k; i++) {
+        task[i].func = func;
+        task[i].arg = arg;
+        task[i].start = i * step;
+        task[i].stop = MIN(n, (i + 1) * step);
+        started[i] = 0;
+    }
+    for (i = 1; i < k; i++) {
+        if (task[i].start < task[i].stop)
+            started[i] = (pthread_create(&tid[i], NULL, __parallel_worker, &task[i]) == 0);
+    }
+
+    // Band 0 and bands which could not start a thread run here
+    func(arg, task[0].start, task[0].stop);
+    for (i = 1; i < k; i++) {
+        if (started[i])
+            pthread_join(tid[i], NULL);
+        else if (task[i].start < task[i].stop)
+            func(arg, task[i].start, task[i].stop);
+    }
+
+    return RET_OK;
+}
+
 int file_locked(char* endpoint)
 {
     int i, n, fd;
@@ -158,10 +233,41 @@ char* file_load(char *filename, int *size)
     return NULL;
 }
 
+// Private writable mapping, writes go to memory only, free by file_unmap
+char* file_map(char* filename, size_t* size)
+{
+    int fd;
+    void* buf;
+    struct stat s;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || s.st_size < 1) {
+        if (fd >= 0)
+            close(fd);
+        syslog_error("Loading file (%s).", filename);
+        return NULL;
+    }
+    *size = (size_t)s.st_size;
+    buf = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        syslog_error("Map file (%s).", filename);
+        return NULL;
+    }
+
+    return (char*)buf;
+}
+
+void file_unmap(char* buf, size_t size)
+{
+    if (buf && size > 0)
+        munmap(buf, size);
+}
+
 int file_save(char* filename, char* buf, int size)
 {
     int ret = RET_ERROR;
-    int fd = open(filename, O_RDWR | O_CREAT, 0600);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
     if (fd >= 0) {
         ret = (write(fd, buf, size) == size) ? RET_OK : RET_ERROR;
         close(fd);
@@ -14,35 +14,107 @@ extern int matrix_fast_guided_filter(MATRIX* P, MATRIX* I, int radius,
     float eps, int scale);
 extern int matrix_guided_filter(MATRIX* mat, MATRIX* guidance, int radius,
     float eps);
+extern int matrix_color_guided_filter(MATRIX* P, MATRIX* IR, MATRIX* IG, MATRIX* IB,
+    int radius, float eps);
 extern int matrix_lee_filter(MATRIX* mat, int radius, float eps);
 extern int matrix_gauss_filter(MATRIX* mat, float sigma);
 extern int matrix_bilate_filter(MATRIX* mat, float hs, float hr);
 extern MATRIX* matrix_box_filter(MATRIX* src, int r);
 extern MATRIX* matrix_mean_filter(MATRIX* src, int r);
+extern int matrix_box_means(MATRIX* src, int r, MATRIX* mean, MATRIX* mean2);
 
-static int __accumulate_by_rows(MATRIX* mat)
-{
-    int i, j;
+#define GAUSS_IIR_SIGMA 3.0f
+#define GAUSS_BAND_ROWS 16
+#define GAUSS_BAND_COLS 64
 
-    for (j = 0; j < mat->n; j++) {
-        for (i = 1; i < mat->m; i++)
-            mat->me[i][j] += mat->me[i - 1][j];
-    }
+typedef struct {
+    MATRIX *mat, *temp;
+    VECTOR* vec;
+    float b, a1, a2, a3; // recursive coefficients
+} GaussArgs;
 
-    return RET_OK;
-}
+#define MINMAX_BAND_LINES 16
 
-static int __accumulate_by_cols(MATRIX* mat)
-{
-    int i, j;
+typedef struct {
+    float* fdata; // MATRIX data, or
+    BYTE* bdata; // 8-bit channel data
+    int lines, length, radius, maxmode;
+    int line_stride, stride; // in elements
+    int ret; // RET_ERROR if any band failed
+} MinmaxArgs;
 
-    for (i = 0; i < mat->m; i++) {
-        for (j = 1; j < mat->n; j++)
-            mat->me[i][j] += mat->me[i][j - 1];
-    }
+#define BEEPS_TILE_COLS 16
+#define BEEPS_BAND_LINES 8
 
-    return RET_OK;
-}
+// hv -- horizontal then vertical, vh -- vertical then horizontal, both in one pool
+typedef struct {
+    MATRIX *hv, *vh;
+    float stdv, dec;
+    int phase, tiles;
+    int ret; // RET_ERROR if any band failed
+} BeepsArgs;
+
+#define BOX_BAND_ROWS 32
+
+// Box means of count channels in one row-major sweep, load/save work row by row
+typedef struct BoxSweep BoxSweep;
+struct BoxSweep {
+    int m, n, radius, count;
+    int sum; // 1 -- window sums, 0 -- window means
+    void (*load)(BoxSweep* box, int i, float* rows); // rows + k * n -- channel k of row i
+    void (*save)(BoxSweep* box, int i, float* means); // means + k * n -- box mean of channel k
+    void* arg;
+    int ret; // RET_ERROR if any band failed
+};
+
+typedef struct {
+    MATRIX *P, *I[3]; // color guidance use I[0..2], gray only I[0]
+    MATRIX *a[3], *b;
+    MATRIX *mean_a, *mean_b; // if NULL, save result to P
+    float eps;
+} GuidedArgs;
+
+typedef struct {
+    MATRIX *src, *dst[2]; // dst[0] -- box of src, dst[1] -- box of src .* src
+} BoxArgs;
+
+// Callbacks of matrix_box_sweep, arg is user's
+typedef struct {
+    void (*load)(void* arg, int i, float* rows);
+    void (*save)(void* arg, int i, float* means);
+    void* arg;
+} BoxUser;
+
+#define BILATE_GRID_SIGMA 2.0f
+#define BILATE_GRID_PAD 2
+#define BILATE_BAND_ROWS 16
+#define BILATE_GRID_MAX_BYTES ((size_t)256 << 20) // grid is coarsened to fit
+
+// Bilateral grid, gh x gw x gd cells, each cell has nc floats: values..., weight
+typedef struct {
+    int gh, gw, gd, nc;
+    float ss, sr, vmin; // space/range sample rate, range start
+    float* data;
+    int axis; // blur axis: 0 -- h, 1 -- w, 2 -- d
+    MATRIX* mat; // matrix_bilate_filter
+    IMAGE* img; // image_bilate_filter
+    int ret; // RET_ERROR if any band failed
+} BilateGrid;
+
+#define MEDIAN_BAND_ROWS 32
+
+#define RECT_FILTER_MAX_TAPS 63
+
+typedef struct {
+    IMAGE *src, *dst;
+    int radius, nch, offset[4]; // channel byte offset in RGBA_8888
+    int ret; // RET_ERROR if any band failed
+} MedianArgs;
+
+// Kernel histogram, fine[] of bucket b is valid for columns [lo[b], hi[b]]
+typedef struct {
+    int coarse[16], fine[256], lo[16], hi[16];
+} MedianKernel;
 
 // Forward filter
 static void __beeps_progressive(int n, float* x, float stdv, float dec)
@@ -86,156 +158,657 @@ static void __beeps_regressive(int n, float* x, float stdv, float dec)
     }
 }
 
-// HV Progresss
-static MATRIX* __beeps_hv(MATRIX* mat, float stdv, float dec)
+// x = progressive(x) - gain(x) + regressive(x), p/r -- n floats buffer
+static void __beeps_line(int n, float* x, float stdv, float dec, float gain_dec, float* p, float* r)
 {
-    int i, j;
+    int k;
+
+    memcpy(p, x, n * sizeof(float));
+    memcpy(r, x, n * sizeof(float));
+    __beeps_progressive(n, p, stdv, dec);
+    __beeps_gain(n, x, gain_dec);
+    __beeps_regressive(n, r, stdv, dec);
+
+    for (k = 0; k < n; k++)
+        x[k] = r[k] + (p[k] - x[k]);
+}
+
+// Columns [c, c + BEEPS_TILE_COLS) are copied into a transposed tile, so the column pass
+// runs on contiguous lines
+static void __beeps_tile(MATRIX* mat, int c, float stdv, float dec, float gain_dec, float* tile,
+    float* p, float* r)
+{
+    int i, j, cols;
     float* x;
-    MATRIX *p, *g, *r, *t;
 
-    CHECK_MATRIX(mat);
+    cols = MIN(BEEPS_TILE_COLS, mat->n - c);
+    for (i = 0; i < mat->m; i++) {
+        x = mat->me[i] + c;
+        for (j = 0; j < cols; j++)
+            tile[j * mat->m + i] = x[j];
+    }
+    for (j = 0; j < cols; j++)
+        __beeps_line(mat->m, tile + j * mat->m, stdv, dec, gain_dec, p, r);
+    for (i = 0; i < mat->m; i++) {
+        x = mat->me[i] + c;
+        for (j = 0; j < cols; j++)
+            x[j] = tile[j * mat->m + i];
+    }
+}
 
-    p = matrix_copy(mat);
-    CHECK_MATRIX(p);
-    g = matrix_copy(mat);
-    CHECK_MATRIX(g);
-    r = matrix_copy(mat);
-    CHECK_MATRIX(r);
+// Phase 0: rows of hv, column tiles of vh; phase 1: column tiles of hv, rows of vh
+static void __beeps_band(void* arg, int start, int stop)
+{
+    int k, m, n, len;
+    float *tile, *p, *r;
+    BeepsArgs* b = (BeepsArgs*)arg;
+
+    m = b->hv->m;
+    n = b->hv->n;
+    len = MAX(m, n);
+    tile = (float*)malloc(((size_t)BEEPS_TILE_COLS * m + 2 * len) * sizeof(float));
+    if (tile == NULL) {
+        syslog_error("Allocate memeory.");
+        b->ret = RET_ERROR;
+        return;
+    }
+    p = tile + BEEPS_TILE_COLS * m;
+    r = p + len;
 
-    for (i = 0; i < r->m; i++) {
-        x = p->me[i];
-        __beeps_progressive(r->n, x, stdv, 1.0f - dec);
-        x = g->me[i];
-        __beeps_gain(r->n, x, 1.0f - dec);
-        x = r->me[i];
-        __beeps_regressive(r->n, x, stdv, 1.0f - dec);
+    for (k = start; k < stop; k++) {
+        if (b->phase == 0) {
+            if (k < m)
+                __beeps_line(n, b->hv->me[k], b->stdv, 1.0f - b->dec, 1.0f - b->dec, p, r);
+            else
+                __beeps_tile(b->vh, (k - m) * BEEPS_TILE_COLS, b->stdv, 1.0f - b->dec, b->dec, tile, p, r);
+        } else {
+            if (k < b->tiles)
+                __beeps_tile(b->hv, k * BEEPS_TILE_COLS, b->stdv, 1.0f - b->dec, 1.0f - b->dec, tile, p, r);
+            else
+                __beeps_line(n, b->vh->me[k - b->tiles], b->stdv, 1.0f - b->dec, 1.0f - b->dec, p, r);
+        }
+    }
+    free(tile);
+}
+
+// Young/van Vliet recursive gauss, y[n] = b * x[n] + a1 * y[n-1] + a2 * y[n-2] + a3 * y[n-3]
+static void __gauss_iir_coef(float sigma, GaussArgs* g)
+{
+    float q, b0, b1, b2, b3;
+
+    if (sigma >= 2.5f)
+        q = 0.98711f * sigma - 0.96330f;
+    else
+        q = 3.97156f - 4.14554f * sqrtf(1.0f - 0.26891f * sigma);
+
+    b0 = 1.57825f + 2.44413f * q + 1.4281f * q * q + 0.422205f * q * q * q;
+    b1 = 2.44413f * q + 2.85619f * q * q + 1.26661f * q * q * q;
+    b2 = -(1.4281f * q * q + 1.26661f * q * q * q);
+    b3 = 0.422205f * q * q * q;
+
+    g->a1 = b1 / b0;
+    g->a2 = b2 / b0;
+    g->a3 = b3 / b0;
+    g->b = 1.0f - (g->a1 + g->a2 + g->a3);
+}
+
+// Border is replicated, so y[-1] == y[-2] == y[-3] == x[0] gives y[0] = x[0]
+static void __gauss_iir_rows(void* arg, int start, int stop)
+{
+    int i, j, n;
+    float *x, b, a1, a2, a3;
+    GaussArgs* g = (GaussArgs*)arg;
+
+    n = g->mat->n;
+    b = g->b;
+    a1 = g->a1;
+    a2 = g->a2;
+    a3 = g->a3;
+    for (i = start; i < stop; i++) {
+        x = g->mat->me[i];
+        for (j = 1; j < n; j++)
+            x[j] = b * x[j] + a1 * x[j - 1] + a2 * x[MAX(j - 2, 0)] + a3 * x[MAX(j - 3, 0)];
+        for (j = n - 2; j >= 0; j--)
+            x[j] = b * x[j] + a1 * x[j + 1] + a2 * x[MIN(j + 2, n - 1)] + a3 * x[MIN(j + 3, n - 1)];
+    }
+}
+
+// Column recursion runs along rows, inner loop over columns is contiguous
+static void __gauss_iir_cols(void* arg, int start, int stop)
+{
+    int i, j, m;
+    float *y, *y1, *y2, *y3, b, a1, a2, a3;
+    MATRIX* mat;
+    GaussArgs* g = (GaussArgs*)arg;
+
+    mat = g->mat;
+    m = mat->m;
+    b = g->b;
+    a1 = g->a1;
+    a2 = g->a2;
+    a3 = g->a3;
+    for (i = 1; i < m; i++) {
+        y = mat->me[i];
+        y1 = mat->me[i - 1];
+        y2 = mat->me[MAX(i - 2, 0)];
+        y3 = mat->me[MAX(i - 3, 0)];
+        for (j = start; j < stop; j++)
+            y[j] = b * y[j] + a1 * y1[j] + a2 * y2[j] + a3 * y3[j];
+    }
+    for (i = m - 2; i >= 0; i--) {
+        y = mat->me[i];
+        y1 = mat->me[i + 1];
+        y2 = mat->me[MIN(i + 2, m - 1)];
+        y3 = mat->me[MIN(i + 3, m - 1)];
+        for (j = start; j < stop; j++)
+            y[j] = b * y[j] + a1 * y1[j] + a2 * y2[j] + a3 * y3[j];
     }
+}
 
-    // r += p - g
-    for (i = 0; i < r->m; i++) {
-        for (j = 0; j < r->n; j++)
-            r->me[i][j] += p->me[i][j] - g->me[i][j];
+// Col Conv: mat -> temp, taps out of border use center value
+static void __gauss_conv_cols(void* arg, int start, int stop)
+{
+    int i, j, k, m, n;
+    float d, *x, *y, *v;
+    GaussArgs* g = (GaussArgs*)arg;
+
+    m = g->vec->m / 2;
+    n = g->mat->n;
+    v = g->vec->ve + m;
+    for (i = start; i < stop; i++) {
+        x = g->mat->me[i];
+        y = g->temp->me[i];
+        for (j = 0; j < n; j++) {
+            d = 0;
+            if (j >= m && j < n - m) { // Inside, no border check
+                for (k = -m; k <= m; k++)
+                    d += x[j + k] * v[k];
+            } else {
+                for (k = -m; k <= m; k++)
+                    d += ((k + j >= 0 && k + j < n) ? x[k + j] : x[j]) * v[k];
+            }
+            y[j] = d;
+        }
     }
+}
 
-    // Transpose
-    t = matrix_transpose(r);
-    CHECK_MATRIX(t);
+// Row Conv: temp -> mat
+static void __gauss_conv_rows(void* arg, int start, int stop)
+{
+    int i, j, k, m, n;
+    float w, *x, *y;
+    GaussArgs* g = (GaussArgs*)arg;
+
+    m = g->vec->m / 2;
+    n = g->mat->n;
+    for (i = start; i < stop; i++) {
+        y = g->mat->me[i];
+        memset(y, 0, n * sizeof(float));
+        for (k = -m; k <= m; k++) {
+            x = (k + i >= 0 && k + i < g->mat->m) ? g->temp->me[k + i] : g->temp->me[i];
+            w = g->vec->ve[k + m];
+            for (j = 0; j < n; j++)
+                y[j] += x[j] * w;
+        }
+    }
+}
 
-    matrix_destroy(p);
-    matrix_destroy(g);
-    matrix_destroy(r);
+// Add (d = 1) or remove (d = -1) one image row from column histograms
+static void __median_row(MedianArgs* m, int row, WORD* colc, WORD* colf, int d)
+{
+    int j, c, k;
+    BYTE* p;
+
+    p = (BYTE*)m->src->ie[row];
+    for (j = 0; j < m->src->width; j++, p += sizeof(RGBA_8888)) {
+        for (c = 0; c < m->nch; c++) {
+            k = j * m->nch + c;
+            colc[k * 16 + (p[m->offset[c]] >> 4)] += d;
+            colf[k * 256 + p[m->offset[c]]] += d;
+        }
+    }
+}
 
-    p = matrix_copy(t);
-    CHECK_MATRIX(p);
-    g = matrix_copy(t);
-    CHECK_MATRIX(g);
-    r = matrix_copy(t);
-    CHECK_MATRIX(r);
-    matrix_destroy(t);
+// Bring fine bucket b of kernel up to columns [j1, j2]
+static void __median_fine(MedianKernel* kernel, int b, WORD* colf, int nch, int c, int j1, int j2)
+{
+    int j, k, *f;
+    WORD* h;
+
+    f = kernel->fine + b * 16;
+    if (j1 > kernel->hi[b]) { // No overlap, rebuild
+        memset(f, 0, 16 * sizeof(int));
+        for (j = j1; j <= j2; j++) {
+            h = colf + (j * nch + c) * 256 + b * 16;
+            for (k = 0; k < 16; k++)
+                f[k] += h[k];
+        }
+    } else {
+        for (j = kernel->lo[b]; j < j1; j++) {
+            h = colf + (j * nch + c) * 256 + b * 16;
+            for (k = 0; k < 16; k++)
+                f[k] -= h[k];
+        }
+        for (j = kernel->hi[b] + 1; j <= j2; j++) {
+            h = colf + (j * nch + c) * 256 + b * 16;
+            for (k = 0; k < 16; k++)
+                f[k] += h[k];
+        }
+    }
+    kernel->lo[b] = j1;
+    kernel->hi[b] = j2;
+}
 
-    for (i = 0; i < r->m; i++) {
-        x = p->me[i];
-        __beeps_progressive(r->n, x, stdv, 1.0f - dec);
-        x = g->me[i];
-        __beeps_gain(r->n, x, 1.0f - dec);
-        x = r->me[i];
-        __beeps_regressive(r->n, x, stdv, 1.0f - dec);
+// Perreault/Hebert median for rows [start, stop), column histograms with 16x16 coarse/fine bins
+static void __median_band(void* arg, int start, int stop)
+{
+    int i, j, c, b, k, r, h, w, nch, half, sum, *kc;
+    WORD *colc, *colf, *hc;
+    BYTE* p;
+    MedianKernel* kernel;
+    MedianArgs* m = (MedianArgs*)arg;
+
+    r = m->radius;
+    h = m->src->height;
+    w = m->src->width;
+    nch = m->nch;
+    colc = (WORD*)calloc((size_t)w * nch * 16, sizeof(WORD));
+    colf = (WORD*)calloc((size_t)w * nch * 256, sizeof(WORD));
+    kernel = (MedianKernel*)calloc(nch, sizeof(MedianKernel));
+    if (colc == NULL || colf == NULL || kernel == NULL) {
+        syslog_error("Allocate memeory.");
+        m->ret = RET_ERROR;
+        goto exit;
     }
 
-    // r += p - g
-    for (i = 0; i < r->m; i++) {
-        for (j = 0; j < r->n; j++)
-            r->me[i][j] += p->me[i][j] - g->me[i][j];
+    for (k = MAX(start - r, 0); k < MIN(start + r, h); k++)
+        __median_row(m, k, colc, colf, 1);
+
+    for (i = start; i < stop; i++) {
+        if (i > start && i - r - 1 >= 0)
+            __median_row(m, i - r - 1, colc, colf, -1);
+        if (i + r < h)
+            __median_row(m, i + r, colc, colf, 1);
+
+        for (c = 0; c < nch; c++) {
+            memset(kernel[c].coarse, 0, sizeof(kernel[c].coarse));
+            for (b = 0; b < 16; b++) {
+                kernel[c].lo[b] = 0;
+                kernel[c].hi[b] = -1;
+            }
+            for (j = 0; j <= MIN(r, w - 1); j++) {
+                hc = colc + (j * nch + c) * 16;
+                for (b = 0; b < 16; b++)
+                    kernel[c].coarse[b] += hc[b];
+            }
+        }
+
+        p = (BYTE*)m->dst->ie[i];
+        for (j = 0; j < w; j++, p += sizeof(RGBA_8888)) {
+            half = (MIN(i + r, h - 1) - MAX(i - r, 0) + 1) * (MIN(j + r, w - 1) - MAX(j - r, 0) + 1) / 2;
+            for (c = 0; c < nch; c++) {
+                kc = kernel[c].coarse;
+                if (j > 0 && j + r < w) {
+                    hc = colc + ((j + r) * nch + c) * 16;
+                    for (b = 0; b < 16; b++)
+                        kc[b] += hc[b];
+                }
+                if (j - r - 1 >= 0) {
+                    hc = colc + ((j - r - 1) * nch + c) * 16;
+                    for (b = 0; b < 16; b++)
+                        kc[b] -= hc[b];
+                }
+
+                // Median is the first value with cumulative count > half
+                sum = 0;
+                for (b = 0; b < 15 && sum + kc[b] <= half; b++)
+                    sum += kc[b];
+                __median_fine(&kernel[c], b, colf, nch, c, MAX(j - r, 0), MIN(j + r, w - 1));
+                for (k = 0; k < 15 && sum + kernel[c].fine[b * 16 + k] <= half; k++)
+                    sum += kernel[c].fine[b * 16 + k];
+                p[m->offset[c]] = (BYTE)(b * 16 + k);
+            }
+        }
     }
 
-    t = matrix_transpose(r);
-    CHECK_MATRIX(t);
+exit:
+    free(kernel);
+    free(colf);
+    free(colc);
+}
 
-    matrix_destroy(p);
-    matrix_destroy(g);
-    matrix_destroy(r);
+// van Herk/Gil-Werman min filter on one line, window [j - r, j + r] is cut at border.
+// g -- block prefix min, h -- block suffix min, both n + 2r, max filter by sign flip
+static void __vhgw_fline(float* x, int stride, int n, int r, float sign, float* g, float* h)
+{
+    int p, k, len;
+
+    k = 2 * r + 1;
+    len = n + 2 * r;
+    for (p = 0; p < len; p++) {
+        g[p] = (p >= r && p < n + r) ? sign * x[(p - r) * stride] : INFINITY;
+        h[p] = g[p];
+        if (p % k != 0)
+            g[p] = MIN(g[p - 1], g[p]);
+    }
+    for (p = len - 2; p >= 0; p--) {
+        if (p % k != k - 1)
+            h[p] = MIN(h[p + 1], h[p]);
+    }
+    for (p = 0; p < n; p++)
+        x[p * stride] = sign * MIN(h[p], g[p + k - 1]);
+}
 
-    return t;
+// Same as __vhgw_fline for bytes, max filter by 255 - x
+static void __vhgw_bline(BYTE* x, int stride, int n, int r, BYTE flip, BYTE* g, BYTE* h)
+{
+    int p, k, len;
+
+    k = 2 * r + 1;
+    len = n + 2 * r;
+    for (p = 0; p < len; p++) {
+        g[p] = (p >= r && p < n + r) ? (x[(p - r) * stride] ^ flip) : 255;
+        h[p] = g[p];
+        if (p % k != 0)
+            g[p] = MIN(g[p - 1], g[p]);
+    }
+    for (p = len - 2; p >= 0; p--) {
+        if (p % k != k - 1)
+            h[p] = MIN(h[p + 1], h[p]);
+    }
+    for (p = 0; p < n; p++)
+        x[p * stride] = MIN(h[p], g[p + k - 1]) ^ flip;
 }
 
-// HV Progresss
-static MATRIX* __beeps_vh(MATRIX* mat, float stdv, float dec)
+static void __minmax_band(void* arg, int start, int stop)
 {
-    int i, j;
-    float* x;
-    MATRIX *p, *g, *r, *t;
+    int i, len;
+    void* buffer;
+    MinmaxArgs* a = (MinmaxArgs*)arg;
+
+    len = a->length + 2 * a->radius;
+    buffer = malloc(2 * len * (a->fdata ? sizeof(float) : sizeof(BYTE)));
+    if (buffer == NULL) {
+        syslog_error("Allocate memeory.");
+        a->ret = RET_ERROR;
+        return;
+    }
+    for (i = start; i < stop; i++) {
+        if (a->fdata) {
+            __vhgw_fline(a->fdata + i * a->line_stride, a->stride, a->length, a->radius,
+                a->maxmode ? -1.0f : 1.0f, (float*)buffer, (float*)buffer + len);
+        } else {
+            __vhgw_bline(a->bdata + i * a->line_stride, a->stride, a->length, a->radius,
+                a->maxmode ? 0xff : 0, (BYTE*)buffer, (BYTE*)buffer + len);
+        }
+    }
+    free(buffer);
+}
 
-    CHECK_MATRIX(mat);
+// Separable min/max filter of h x w data, (i, j) at data[i * row_stride + j * col_stride]
+static int __minmax_filter(float* fdata, BYTE* bdata, int h, int w, int row_stride, int col_stride,
+    int radius, int maxmode)
+{
+    MinmaxArgs a;
 
-    t = matrix_transpose(mat);
-    CHECK_MATRIX(t);
-    p = matrix_copy(t);
-    CHECK_MATRIX(p);
-    g = matrix_copy(t);
-    CHECK_MATRIX(g);
-    r = matrix_copy(t);
-    CHECK_MATRIX(r);
-    matrix_destroy(t);
+    if (radius < 1 || h < 1 || w < 1)
+        return RET_OK;
 
-    for (i = 0; i < r->m; i++) {
-        x = p->me[i];
-        __beeps_progressive(r->n, x, stdv, 1.0f - dec);
-        x = g->me[i];
-        __beeps_gain(r->n, x, dec);
-        x = r->me[i];
-        __beeps_regressive(r->n, x, stdv, 1.0f - dec);
+    a.fdata = fdata;
+    a.bdata = bdata;
+    a.radius = radius;
+    a.maxmode = maxmode;
+    a.ret = RET_OK;
+
+    // Col Filter
+    a.lines = h;
+    a.length = w;
+    a.line_stride = row_stride;
+    a.stride = col_stride;
+    parallel_for(a.lines, MINMAX_BAND_LINES, __minmax_band, &a);
+
+    // Row Filter
+    a.lines = w;
+    a.length = h;
+    a.line_stride = col_stride;
+    a.stride = row_stride;
+    if (a.ret == RET_OK)
+        parallel_for(a.lines, MINMAX_BAND_LINES, __minmax_band, &a);
+
+    return a.ret;
+}
+
+static double __bgrid_cells(int h, int w, float range, float ss, float sr, int* gh, int* gw, int* gd)
+{
+    double dh, dw, dd;
+
+    dh = floor((h - 1) / ss) + 2 + 2 * BILATE_GRID_PAD;
+    dw = floor((w - 1) / ss) + 2 + 2 * BILATE_GRID_PAD;
+    dd = floor(range / sr) + 2 + 2 * BILATE_GRID_PAD;
+    if (gh && gw && gd) {
+        *gh = (int)dh;
+        *gw = (int)dw;
+        *gd = (int)dd;
+    }
+    return dh * dw * dd;
+}
+
+// Small hs/hr on big images would need GBs of cells (and overflow gd), so sample rates are raised together
+// until grid fits BILATE_GRID_MAX_BYTES, result is a little smoother then
+static int __bgrid_create(BilateGrid* g, int h, int w, float vmin, float vmax, float hs, float hr,
+    int nc)
+{
+    double f, cells, limit;
+
+    g->ss = MAX(hs, 1.0f);
+    g->sr = MAX(hr, MIN_FLOAT_NUMBER);
+    g->vmin = vmin;
+    g->nc = nc;
+
+    limit = (double)BILATE_GRID_MAX_BYTES / (nc * sizeof(float));
+    cells = __bgrid_cells(h, w, vmax - vmin, g->ss, g->sr, NULL, NULL, NULL);
+    if (cells > limit) {
+        // Range axis alone first, it is often the long one when hr is tiny
+        g->sr = MAX(g->sr, (vmax - vmin) / 256.0f);
+        for (f = cbrt(__bgrid_cells(h, w, vmax - vmin, g->ss, g->sr, NULL, NULL, NULL) / limit); f > 1.0; f *= 1.05) {
+            if (__bgrid_cells(h, w, vmax - vmin, g->ss * f, g->sr * f, NULL, NULL, NULL) <= limit) {
+                g->ss *= f;
+                g->sr *= f;
+                break;
+            }
+        }
+        syslog_info("Bilateral grid is coarsened to space %.2f, range %.2f.", g->ss, g->sr);
+    }
+    cells = __bgrid_cells(h, w, vmax - vmin, g->ss, g->sr, &g->gh, &g->gw, &g->gd);
+    if (cells > limit) {
+        syslog_error("Bilateral grid is too big (%.0f cells).", cells);
+        return RET_ERROR;
     }
 
-    // r += p - g
-    for (i = 0; i < r->m; i++) {
-        for (j = 0; j < r->n; j++)
-            r->me[i][j] += p->me[i][j] - g->me[i][j];
+    g->data = (float*)calloc((size_t)cells * nc, sizeof(float));
+    if (g->data == NULL) {
+        syslog_error("Allocate memeory.");
+        return RET_ERROR;
     }
+    return RET_OK;
+}
 
-    // Transpose
-    t = matrix_transpose(r);
-    p = matrix_copy(t);
-    CHECK_MATRIX(p);
-    g = matrix_copy(t);
-    CHECK_MATRIX(g);
-    r = matrix_copy(t);
-    CHECK_MATRIX(r);
-    matrix_destroy(t);
+// Nearest cell of pixel (i, j) with range value v
+static float* __bgrid_cell(BilateGrid* g, int i, int j, float v)
+{
+    int y, x, z;
 
-    for (i = 0; i < r->m; i++) {
-        x = p->me[i];
-        __beeps_progressive(r->n, x, stdv, 1.0f - dec);
-        x = g->me[i];
-        __beeps_gain(r->n, x, 1.0f - dec);
-        x = r->me[i];
-        __beeps_regressive(r->n, x, stdv, 1.0f - dec);
+    y = (int)(i / g->ss + 0.5f) + BILATE_GRID_PAD;
+    x = (int)(j / g->ss + 0.5f) + BILATE_GRID_PAD;
+    z = (int)((v - g->vmin) / g->sr + 0.5f) + BILATE_GRID_PAD;
+
+    return g->data + (((size_t)y * g->gw + x) * g->gd + z) * g->nc;
+}
+
+// [1 4 6 4 1]/16 along g->axis, that is gauss with sigma = 1 cell
+static void __bgrid_blur_band(void* arg, int start, int stop)
+{
+    int t, k, c, len, a, b, nc;
+    size_t base, stride;
+    float *x, *buf;
+    BilateGrid* g = (BilateGrid*)arg;
+
+    nc = g->nc;
+    len = (g->axis == 0) ? g->gh : ((g->axis == 1) ? g->gw : g->gd);
+    buf = (float*)calloc((size_t)(len + 4) * nc, sizeof(float));
+    if (buf == NULL) {
+        syslog_error("Allocate memeory.");
+        g->ret = RET_ERROR;
+        return;
     }
+    for (t = start; t < stop; t++) {
+        if (g->axis == 0) { // t = x * gd + z
+            base = (size_t)t * nc;
+            stride = (size_t)g->gw * g->gd * nc;
+        } else if (g->axis == 1) { // t = y * gd + z
+            a = t / g->gd;
+            b = t % g->gd;
+            base = ((size_t)a * g->gw * g->gd + b) * nc;
+            stride = (size_t)g->gd * nc;
+        } else { // t = y * gw + x
+            base = (size_t)t * g->gd * nc;
+            stride = nc;
+        }
+        x = g->data + base;
+        for (k = 0; k < len; k++)
+            memcpy(buf + (k + 2) * nc, x + k * stride, nc * sizeof(float));
+        for (k = 0; k < len; k++) {
+            for (c = 0; c < nc; c++) {
+                x[k * stride + c] = (buf[k * nc + c] + 4.0f * buf[(k + 1) * nc + c] + 6.0f * buf[(k + 2) * nc + c]
+                                        + 4.0f * buf[(k + 3) * nc + c] + buf[(k + 4) * nc + c])
+                    / 16.0f;
+            }
+        }
+    }
+    free(buf);
+}
+
+static int __bgrid_blur(BilateGrid* g)
+{
+    g->ret = RET_OK;
+    g->axis = 0;
+    parallel_for(g->gw * g->gd, 64, __bgrid_blur_band, g);
+    g->axis = 1;
+    if (g->ret == RET_OK)
+        parallel_for(g->gh * g->gd, 64, __bgrid_blur_band, g);
+    g->axis = 2;
+    if (g->ret == RET_OK)
+        parallel_for(g->gh * g->gw, 64, __bgrid_blur_band, g);
+
+    return g->ret;
+}
+
+// Trilinear interpolation at pixel (i, j) with range value v
+static void __bgrid_slice(BilateGrid* g, int i, int j, float v, float* out)
+{
+    int y, x, z, c, k;
+    float fy, fx, fz, w;
+    float* cell;
+
+    fy = i / g->ss + BILATE_GRID_PAD;
+    fx = j / g->ss + BILATE_GRID_PAD;
+    fz = (v - g->vmin) / g->sr + BILATE_GRID_PAD;
+    y = (int)fy;
+    x = (int)fx;
+    z = (int)fz;
+    fy -= y;
+    fx -= x;
+    fz -= z;
+
+    for (c = 0; c < g->nc; c++)
+        out[c] = 0.0f;
+    for (k = 0; k < 8; k++) {
+        w = ((k & 4) ? fy : 1.0f - fy) * ((k & 2) ? fx : 1.0f - fx) * ((k & 1) ? fz : 1.0f - fz);
+        cell = g->data + (((size_t)(y + ((k >> 2) & 1)) * g->gw + x + ((k >> 1) & 1)) * g->gd + z + (k & 1)) * g->nc;
+        for (c = 0; c < g->nc; c++)
+            out[c] += w * cell[c];
+    }
+}
 
-    // r += p - g
-    for (i = 0; i < r->m; i++) {
-        for (j = 0; j < r->n; j++)
-            r->me[i][j] += p->me[i][j] - g->me[i][j];
+static void __bilate_matrix_slice(void* arg, int start, int stop)
+{
+    int i, j;
+    float out[2];
+    BilateGrid* g = (BilateGrid*)arg;
+
+    for (i = start; i < stop; i++) {
+        for (j = 0; j < g->mat->n; j++) {
+            __bgrid_slice(g, i, j, g->mat->me[i][j], out);
+            if (out[1] > MIN_FLOAT_NUMBER)
+                g->mat->me[i][j] = out[0] / out[1];
+        }
     }
+}
 
-    matrix_destroy(p);
-    matrix_destroy(g);
-    // matrix_destroy(r);
+// Cost does not depend on hs, splat -> blur -> slice
+static int __bilate_grid_filter(MATRIX* mat, float hs, float hr)
+{
+    int i, j;
+    float vmin, vmax, *cell;
+    BilateGrid g;
 
-    return r;
+    check_matrix(mat);
+
+    vmin = vmax = mat->me[0][0];
+    matrix_foreach(mat, i, j)
+    {
+        vmin = MIN(vmin, mat->me[i][j]);
+        vmax = MAX(vmax, mat->me[i][j]);
+    }
+
+    memset(&g, 0, sizeof(g));
+    if (__bgrid_create(&g, mat->m, mat->n, vmin, vmax, hs, hr, 2) != RET_OK)
+        return RET_ERROR;
+    g.mat = mat;
+
+    matrix_foreach(mat, i, j)
+    {
+        cell = __bgrid_cell(&g, i, j, mat->me[i][j]);
+        cell[0] += mat->me[i][j];
+        cell[1] += 1.0f;
+    }
+    if (__bgrid_blur(&g) == RET_OK)
+        parallel_for(mat->m, BILATE_BAND_ROWS, __bilate_matrix_slice, &g);
+
+    free(g.data);
+
+    return g.ret;
+}
+
+static void __bilate_image_slice(void* arg, int start, int stop)
+{
+    int i, j;
+    BYTE y;
+    float out[4];
+    RGBA_8888* p;
+    BilateGrid* g = (BilateGrid*)arg;
+
+    for (i = start; i < stop; i++) {
+        for (j = 0; j < g->img->width; j++) {
+            p = &g->img->ie[i][j];
+            color_rgb2gray(p->r, p->g, p->b, &y);
+            __bgrid_slice(g, i, j, y, out);
+            if (out[3] > MIN_FLOAT_NUMBER) {
+                p->r = (BYTE)CLAMP((int)(out[0] / out[3] + 0.5f), 0, 255);
+                p->g = (BYTE)CLAMP((int)(out[1] / out[3] + 0.5f), 0, 255);
+                p->b = (BYTE)CLAMP((int)(out[2] / out[3] + 0.5f), 0, 255);
+            }
+        }
+    }
 }
 
 // Create dark channel
 static int __create_darkchan(IMAGE* img, int radius)
 {
-    BYTE min;
-    int i, j, i1, i2, j1, j2, k;
-    MATRIX* mat;
+    int i, j;
 
     check_image(img);
 
-    mat = matrix_create(img->height, img->width);
-    check_matrix(mat);
-
     // 1. Save dark channel AS channel A of image
     image_foreach(img, i, j)
     {
@@ -248,241 +821,491 @@ static int __create_darkchan(IMAGE* img, int radius)
     }
 
     // 2. Dark Channel Min Filter
-    // Col Filter
-    for (i = 0; i < img->height; i++) {
-        for (j = 0; j < img->width; j++) {
-            j1 = MAX(j - radius, 0);
-            j2 = MIN(j + radius, img->width - 1);
-            min = img->ie[i][j1].a;
-            for (k = j1 + 1; k <= j2; k++) {
-                if (img->ie[i][k].a < min)
-                    min = img->ie[i][k].a;
-            }
-            mat->me[i][j] = min;
-        }
+    return __minmax_filter(NULL, &img->ie[0][0].a, img->height, img->width, img->stride, sizeof(RGBA_8888), radius,
+        0);
+}
+
+static void __box_addrow(BoxSweep* box, int i, float* rows, double* colsum, int sub)
+{
+    int k, len;
+
+    box->load(box, i, rows);
+    len = box->count * box->n;
+    if (sub) {
+        for (k = 0; k < len; k++)
+            colsum[k] -= rows[k];
+    } else {
+        for (k = 0; k < len; k++)
+            colsum[k] += rows[k];
     }
-    // Row Filter
-    for (j = 0; j < img->width; j++) {
-        for (i = 0; i < img->height; i++) {
-            i1 = MAX(i - radius, 0);
-            i2 = MIN(i + radius, img->height - 1);
-            min = mat->me[i1][j];
-            for (k = i1 + 1; k <= i2; k++) {
-                if (mat->me[k][j] < min)
-                    min = mat->me[k][j];
+}
+
+// Column sums slide down rows, row sums slide along columns, window is cut at border
+static void __box_band(void* arg, int start, int stop)
+{
+    int i, j, k, r, m, n, i1, i2;
+    double s, *colsum, *d;
+    float *rows, *means, *y;
+    BoxSweep* box = (BoxSweep*)arg;
+
+    m = box->m;
+    n = box->n;
+    r = box->radius;
+    colsum = (double*)calloc((size_t)box->count * n, sizeof(double));
+    rows = (float*)malloc((size_t)box->count * n * sizeof(float));
+    means = (float*)malloc((size_t)box->count * n * sizeof(float));
+    if (colsum == NULL || rows == NULL || means == NULL) {
+        syslog_error("Allocate memeory.");
+        box->ret = RET_ERROR;
+        goto exit;
+    }
+
+    for (i = MAX(start - r, 0); i <= MIN(start + r, m - 1); i++)
+        __box_addrow(box, i, rows, colsum, 0);
+
+    for (i = start; i < stop; i++) {
+        if (i > start) {
+            if (i + r < m)
+                __box_addrow(box, i + r, rows, colsum, 0);
+            if (i - r - 1 >= 0)
+                __box_addrow(box, i - r - 1, rows, colsum, 1);
+        }
+        i1 = MAX(i - r, 0);
+        i2 = MIN(i + r, m - 1);
+        for (k = 0; k < box->count; k++) {
+            d = colsum + k * n;
+            y = means + k * n;
+            s = 0.0;
+            for (j = 0; j <= MIN(r, n - 1); j++)
+                s += d[j];
+            for (j = 0; j < n; j++) {
+                y[j] = box->sum ? (float)s : (float)(s / ((i2 - i1 + 1) * (MIN(j + r, n - 1) - MAX(j - r, 0) + 1)));
+                if (j + r + 1 < n)
+                    s += d[j + r + 1];
+                if (j - r >= 0)
+                    s -= d[j - r];
             }
-            img->ie[i][j].a = min;
         }
+        box->save(box, i, means);
     }
 
-    matrix_destroy(mat);
+exit:
+    free(means);
+    free(rows);
+    free(colsum);
+}
 
-    return RET_OK;
+static int __box_sweep(BoxSweep* box)
+{
+    box->radius = MAX(box->radius, 0);
+    box->ret = RET_OK;
+    parallel_for(box->m, MAX(BOX_BAND_ROWS, 2 * box->radius + 1), __box_band, box);
+
+    return box->ret;
 }
 
-// P --, I -- guidance
-int __guided_means(MATRIX* P, MATRIX* I, int radius, float eps, MATRIX* mean_a,
-    MATRIX* mean_b)
+// Channels: x, x * x
+static void __box_load(BoxSweep* box, int i, float* rows)
 {
-    int i, j;
+    int j, n;
+    float* x;
+    BoxArgs* b = (BoxArgs*)box->arg;
+
+    n = box->n;
+    x = b->src->me[i];
+    memcpy(rows, x, n * sizeof(float));
+    if (box->count > 1) {
+        for (j = 0; j < n; j++)
+            rows[n + j] = x[j] * x[j];
+    }
+}
 
-    MATRIX *zero, *one, *a, *b;
-    MATRIX *mean_p, *mean_i, *mean_ii, *mean_ip;
-    MATRIX *var_i, *cov_ip;
+static void __box_save(BoxSweep* box, int i, float* means)
+{
+    int k;
+    BoxArgs* b = (BoxArgs*)box->arg;
 
-    check_matrix(P);
-    check_matrix(I);
+    for (k = 0; k < box->count; k++)
+        memcpy(b->dst[k]->me[i], means + k * box->n, box->n * sizeof(float));
+}
 
-    if (P->m != I->m || P->n != I->n) {
-        syslog_error("Matrix and guidance size is not same.");
+static int __box_matrix(MATRIX* src, int r, int sum, MATRIX* dst, MATRIX* dst2)
+{
+    BoxSweep box;
+    BoxArgs b;
+
+    check_matrix(src);
+    check_matrix(dst);
+    if (dst->m != src->m || dst->n != src->n || (dst2 && (dst2->m != src->m || dst2->n != src->n))) {
+        syslog_error("Matrix size is not same.");
         return RET_ERROR;
     }
 
-    eps = eps * 255.0f * 255.0f;
+    b.src = src;
+    b.dst[0] = dst;
+    b.dst[1] = dst2;
+
+    memset(&box, 0, sizeof(box));
+    box.m = src->m;
+    box.n = src->n;
+    box.radius = r;
+    box.count = dst2 ? 2 : 1;
+    box.sum = sum;
+    box.load = __box_load;
+    box.save = __box_save;
+    box.arg = &b;
+
+    return __box_sweep(&box);
+}
 
-    // zero is a temp matrix
-    zero = matrix_create(P->m, P->n);
-    check_matrix(zero);
-    matrix_pattern(zero, "one");
-    one = matrix_box_filter(zero, radius);
-    check_matrix(one);
-
-    // Step 1
-    mean_p = matrix_box_filter(P, radius);
-    check_matrix(mean_p);
-    matrix_dotdiv(mean_p, one);
-    mean_i = matrix_box_filter(I, radius);
-    check_matrix(mean_i);
-    matrix_dotdiv(mean_i, one);
-    memcpy(zero->base, I->base, zero->m * I->n * sizeof(float));
-    matrix_dotmul(zero, I); // zero = I .* I
-    mean_ii = matrix_box_filter(zero, radius);
-    check_matrix(mean_ii);
-    matrix_dotdiv(mean_ii, one);
-
-    memcpy(zero->base, I->base, zero->m * I->n * sizeof(float));
-    matrix_dotmul(zero, P); // zero = I .* P
-    mean_ip = matrix_box_filter(zero, radius);
-    check_matrix(mean_ip);
-    matrix_dotdiv(mean_ip, one);
-
-    // Step 2
-    memcpy(zero->base, mean_i->base, zero->m * zero->n * sizeof(float));
-    matrix_dotmul(zero, mean_i); // Zero = mean_i .* mean_i
-    var_i = matrix_copy(mean_ii);
-    check_matrix(var_i);
-    matrix_sub(var_i, zero);
-
-    // Zero = mean_i .* mean_p
-    memcpy(zero->base, mean_i->base, zero->m * zero->n * sizeof(float));
-    matrix_dotmul(zero, mean_p);
-    cov_ip = matrix_copy(mean_ip);
-    check_matrix(cov_ip);
-    matrix_sub(cov_ip, zero);
-
-    // Step 3.
-    a = matrix_copy(cov_ip);
-    check_matrix(a);
-    b = matrix_copy(mean_p);
-    check_matrix(b);
-    // var_i += eps
-    matrix_foreach(var_i, i, j) var_i->me[i][j] += eps;
-    matrix_dotdiv(a, var_i);
-
-    memcpy(zero->base, a->base, zero->m * zero->n * sizeof(float));
-    matrix_dotmul(zero, mean_i); // zero = a .* mean_i
-    matrix_sub(b, zero);
-
-    // Step 4
-    matrix_destroy(zero);
-    zero = matrix_box_filter(a, radius);
-    matrix_dotdiv(zero, one);
-    memcpy(mean_a->base, zero->base, zero->m * zero->n * sizeof(float));
-
-    matrix_destroy(zero);
-    zero = matrix_box_filter(b, radius);
-    matrix_dotdiv(zero, one);
-    memcpy(mean_b->base, zero->base, zero->m * zero->n * sizeof(float));
-
-    matrix_destroy(a);
-    matrix_destroy(b);
-
-    // Cov
-    matrix_destroy(var_i);
-    matrix_destroy(cov_ip);
-
-    // Corr
-    matrix_destroy(mean_ip);
-    matrix_destroy(mean_ii);
-
-    // Mean
-    matrix_destroy(mean_i);
-    matrix_destroy(mean_p);
-
-    matrix_destroy(one);
-    matrix_destroy(zero);
+static void __box_user_load(BoxSweep* box, int i, float* rows)
+{
+    BoxUser* u = (BoxUser*)box->arg;
+    u->load(u->arg, i, rows);
+}
 
-    return RET_OK;
+static void __box_user_save(BoxSweep* box, int i, float* means)
+{
+    BoxUser* u = (BoxUser*)box->arg;
+    u->save(u->arg, i, means);
 }
 
-MATRIX* matrix_box_filter(MATRIX* src, int r)
+// Box means of count channels over m x n, load/save are called row by row on band threads
+int matrix_box_sweep(int m, int n, int radius, int count, void (*load)(void* arg, int i, float* rows),
+    void (*save)(void* arg, int i, float* means), void* arg)
 {
-    int i, j;
-    MATRIX *mat, *sum;
+    BoxSweep box;
+    BoxUser u;
 
-    CHECK_MATRIX(src);
+    if (m < 1 || n < 1 || count < 1 || !load || !save) {
+        syslog_error("Bad box sweep.");
+        return RET_ERROR;
+    }
+    u.load = load;
+    u.save = save;
+    u.arg = arg;
+
+    memset(&box, 0, sizeof(box));
+    box.m = m;
+    box.n = n;
+    box.radius = radius;
+    box.count = count;
+    box.load = __box_user_load;
+    box.save = __box_user_save;
+    box.arg = &u;
+
+    return __box_sweep(&box);
+}
 
-    mat = matrix_create(src->m, src->n);
-    CHECK_MATRIX(mat);
+// Channels: p, I, I * I, I * p
+static void __guided_load(BoxSweep* box, int i, float* rows)
+{
+    int j, n;
+    float *p, *x;
+    GuidedArgs* g = (GuidedArgs*)box->arg;
+
+    n = box->n;
+    p = g->P->me[i];
+    x = g->I[0]->me[i];
+    for (j = 0; j < n; j++) {
+        rows[j] = p[j];
+        rows[n + j] = x[j];
+        rows[2 * n + j] = x[j] * x[j];
+        rows[3 * n + j] = x[j] * p[j];
+    }
+}
 
-    sum = matrix_copy(src);
-    CHECK_MATRIX(sum);
-    // 1. Update row
-    __accumulate_by_rows(sum);
-    for (i = 0; i <= r; i++) {
-        for (j = 0; j < mat->n; j++)
-            mat->me[i][j] = sum->me[i + r][j]; //      -0.0f
+// a = cov_ip / (var_i + eps), b = mean_p - a * mean_i
+static void __guided_save(BoxSweep* box, int i, float* means)
+{
+    int j, n;
+    float *mean_p, *mean_i, *mean_ii, *mean_ip, *a, *b;
+    GuidedArgs* g = (GuidedArgs*)box->arg;
+
+    n = box->n;
+    mean_p = means;
+    mean_i = means + n;
+    mean_ii = means + 2 * n;
+    mean_ip = means + 3 * n;
+    a = g->a[0]->me[i];
+    b = g->b->me[i];
+    for (j = 0; j < n; j++) {
+        a[j] = (mean_ip[j] - mean_i[j] * mean_p[j]) / (mean_ii[j] - mean_i[j] * mean_i[j] + g->eps);
+        b[j] = mean_p[j] - a[j] * mean_i[j];
     }
-    // [i - r, i + r]
-    for (i = r + 1; i < mat->m - r; i++) {
-        for (j = 0; j < mat->n; j++) {
-            mat->me[i][j] = sum->me[i + r][j] - sum->me[i - r - 1][j];
-        }
+}
+
+// Channels: a, b
+static void __guided_load_ab(BoxSweep* box, int i, float* rows)
+{
+    GuidedArgs* g = (GuidedArgs*)box->arg;
+
+    memcpy(rows, g->a[0]->me[i], box->n * sizeof(float));
+    memcpy(rows + box->n, g->b->me[i], box->n * sizeof(float));
+}
+
+// q = mean_a .* I + mean_b
+static void __guided_save_ab(BoxSweep* box, int i, float* means)
+{
+    int j, n;
+    float *q, *x;
+    GuidedArgs* g = (GuidedArgs*)box->arg;
+
+    n = box->n;
+    if (g->mean_a && g->mean_b) {
+        memcpy(g->mean_a->me[i], means, n * sizeof(float));
+        memcpy(g->mean_b->me[i], means + n, n * sizeof(float));
+        return;
     }
-    for (i = mat->m - r; i < mat->m; i++) {
-        for (j = 0; j < mat->n; j++) {
-            mat->me[i][j] = sum->me[mat->m - 1][j] - sum->me[i - r - 1][j];
-        }
+    q = g->P->me[i];
+    x = g->I[0]->me[i];
+    for (j = 0; j < n; j++)
+        q[j] = means[j] * x[j] + means[n + j];
+}
+
+// Channels: p, Ir, Ig, Ib, Irr, Irg, Irb, Igg, Igb, Ibb, Irp, Igp, Ibp
+static void __color_guided_load(BoxSweep* box, int i, float* rows)
+{
+    int j, n;
+    float *p, *r, *g, *b;
+    GuidedArgs* a = (GuidedArgs*)box->arg;
+
+    n = box->n;
+    p = a->P->me[i];
+    r = a->I[0]->me[i];
+    g = a->I[1]->me[i];
+    b = a->I[2]->me[i];
+    for (j = 0; j < n; j++) {
+        rows[j] = p[j];
+        rows[n + j] = r[j];
+        rows[2 * n + j] = g[j];
+        rows[3 * n + j] = b[j];
+        rows[4 * n + j] = r[j] * r[j];
+        rows[5 * n + j] = r[j] * g[j];
+        rows[6 * n + j] = r[j] * b[j];
+        rows[7 * n + j] = g[j] * g[j];
+        rows[8 * n + j] = g[j] * b[j];
+        rows[9 * n + j] = b[j] * b[j];
+        rows[10 * n + j] = r[j] * p[j];
+        rows[11 * n + j] = g[j] * p[j];
+        rows[12 * n + j] = b[j] * p[j];
     }
+}
 
-    // 2. Update col
-    memcpy(sum->base, mat->base, mat->m * mat->n * sizeof(float));
-    __accumulate_by_cols(sum);
-    for (j = 0; j <= r; j++) {
-        for (i = 0; i < mat->m; i++)
-            mat->me[i][j] = sum->me[i][j + r]; // - 0.0f
+// a = (Sigma + eps * U)^-1 * cov_Ip, b = mean_p - a' * mean_I
+static void __color_guided_save(BoxSweep* box, int i, float* means)
+{
+    int j, k, n;
+    float m[13], rr, rg, rb, gg, gb, bb, cr, cg, cb;
+    float i_rr, i_rg, i_rb, i_gg, i_gb, i_bb, det, a0, a1, a2;
+    GuidedArgs* g = (GuidedArgs*)box->arg;
+
+    n = box->n;
+    for (j = 0; j < n; j++) {
+        for (k = 0; k < 13; k++)
+            m[k] = means[k * n + j];
+
+        rr = m[4] - m[1] * m[1] + g->eps;
+        rg = m[5] - m[1] * m[2];
+        rb = m[6] - m[1] * m[3];
+        gg = m[7] - m[2] * m[2] + g->eps;
+        gb = m[8] - m[2] * m[3];
+        bb = m[9] - m[3] * m[3] + g->eps;
+        cr = m[10] - m[1] * m[0];
+        cg = m[11] - m[2] * m[0];
+        cb = m[12] - m[3] * m[0];
+
+        // Inverse of symmetric 3x3 by cofactors
+        i_rr = gg * bb - gb * gb;
+        i_rg = gb * rb - rg * bb;
+        i_rb = rg * gb - gg * rb;
+        i_gg = rr * bb - rb * rb;
+        i_gb = rb * rg - rr * gb;
+        i_bb = rr * gg - rg * rg;
+        det = rr * i_rr + rg * i_rg + rb * i_rb;
+        if (ABS(det) < MIN_FLOAT_NUMBER)
+            det = MIN_FLOAT_NUMBER;
+
+        a0 = (i_rr * cr + i_rg * cg + i_rb * cb) / det;
+        a1 = (i_rg * cr + i_gg * cg + i_gb * cb) / det;
+        a2 = (i_rb * cr + i_gb * cg + i_bb * cb) / det;
+        g->a[0]->me[i][j] = a0;
+        g->a[1]->me[i][j] = a1;
+        g->a[2]->me[i][j] = a2;
+        g->b->me[i][j] = m[0] - a0 * m[1] - a1 * m[2] - a2 * m[3];
     }
+}
+
+// Channels: a_r, a_g, a_b, b
+static void __color_guided_load_ab(BoxSweep* box, int i, float* rows)
+{
+    int k;
+    GuidedArgs* g = (GuidedArgs*)box->arg;
 
-    for (j = r + 1; j < mat->n - r; j++) {
-        for (i = 0; i < mat->m; i++)
-            mat->me[i][j] = sum->me[i][j + r] - sum->me[i][j - r - 1];
+    for (k = 0; k < 3; k++)
+        memcpy(rows + k * box->n, g->a[k]->me[i], box->n * sizeof(float));
+    memcpy(rows + 3 * box->n, g->b->me[i], box->n * sizeof(float));
+}
+
+// q = mean_a' * I + mean_b
+static void __color_guided_save_ab(BoxSweep* box, int i, float* means)
+{
+    int j, n;
+    float *q, *r, *g, *b;
+    GuidedArgs* a = (GuidedArgs*)box->arg;
+
+    n = box->n;
+    q = a->P->me[i];
+    r = a->I[0]->me[i];
+    g = a->I[1]->me[i];
+    b = a->I[2]->me[i];
+    for (j = 0; j < n; j++)
+        q[j] = means[j] * r[j] + means[n + j] * g[j] + means[2 * n + j] * b[j] + means[3 * n + j];
+}
+
+// P --, I -- guidance, mean_a/mean_b == NULL: P = mean_a .* I + mean_b
+static int __guided_sweep(MATRIX* P, MATRIX* I, int radius, float eps, MATRIX* mean_a,
+    MATRIX* mean_b)
+{
+    BoxSweep box;
+    GuidedArgs g;
+
+    check_matrix(P);
+    check_matrix(I);
+
+    if (P->m != I->m || P->n != I->n) {
+        syslog_error("Matrix and guidance size is not same.");
+        return RET_ERROR;
+    }
+
+    memset(&g, 0, sizeof(g));
+    g.P = P;
+    g.I[0] = I;
+    g.mean_a = mean_a;
+    g.mean_b = mean_b;
+    g.eps = eps * 255.0f * 255.0f;
+    g.a[0] = matrix_create(P->m, P->n);
+    g.b = matrix_create(P->m, P->n);
+    if (!matrix_valid(g.a[0]) || !matrix_valid(g.b)) {
+        syslog_error("Allocate memeory.");
+        matrix_destroy(g.a[0]);
+        matrix_destroy(g.b);
+        return RET_ERROR;
     }
-    for (j = mat->n - r; j < mat->n; j++) {
-        for (i = 0; i < mat->m; i++)
-            mat->me[i][j] = sum->me[i][mat->n - 1] - sum->me[i][j - r - 1];
+
+    memset(&box, 0, sizeof(box));
+    box.m = P->m;
+    box.n = P->n;
+    box.radius = radius;
+    box.arg = &g;
+
+    // Step 1 - 3: means of p, I, I .* I, I .* p give a, b
+    box.count = 4;
+    box.load = __guided_load;
+    box.save = __guided_save;
+    if (__box_sweep(&box) == RET_OK) {
+        // Step 4 - 5: means of a, b
+        box.count = 2;
+        box.load = __guided_load_ab;
+        box.save = __guided_save_ab;
+        __box_sweep(&box);
     }
 
-    matrix_destroy(sum);
+    matrix_destroy(g.b);
+    matrix_destroy(g.a[0]);
+
+    return box.ret;
+}
+
+// P --, I -- guidance
+int __guided_means(MATRIX* P, MATRIX* I, int radius, float eps, MATRIX* mean_a,
+    MATRIX* mean_b)
+{
+    check_matrix(mean_a);
+    check_matrix(mean_b);
+
+    return __guided_sweep(P, I, radius, eps, mean_a, mean_b);
+}
+
+// Window sums of [i - r, i + r] x [j - r, j + r], cut at border
+MATRIX* matrix_box_filter(MATRIX* src, int r)
+{
+    MATRIX* mat;
+
+    CHECK_MATRIX(src);
+
+    mat = matrix_create(src->m, src->n);
+    CHECK_MATRIX(mat);
+    if (__box_matrix(src, r, 1, mat, NULL) != RET_OK) {
+        matrix_destroy(mat);
+        return NULL;
+    }
 
     return mat;
 }
 
 MATRIX* matrix_mean_filter(MATRIX* src, int r)
 {
-    MATRIX *zero, *one, *mean;
+    MATRIX* mean;
 
-    zero = matrix_create(src->m, src->n);
-    CHECK_MATRIX(zero);
-    matrix_pattern(zero, "one");
-    one = matrix_box_filter(zero, r);
-    CHECK_MATRIX(one);
+    CHECK_MATRIX(src);
 
-    mean = matrix_box_filter(src, r);
+    mean = matrix_create(src->m, src->n);
     CHECK_MATRIX(mean);
-    matrix_dotdiv(mean, one);
-
-    matrix_destroy(one);
-    matrix_destroy(zero);
+    if (__box_matrix(src, r, 0, mean, NULL) != RET_OK) {
+        matrix_destroy(mean);
+        return NULL;
+    }
 
     return mean;
 }
 
+// mean -- box mean of src, mean2 -- box mean of src .* src (could be NULL), one sweep
+int matrix_box_means(MATRIX* src, int r, MATRIX* mean, MATRIX* mean2)
+{
+    return __box_matrix(src, r, 0, mean, mean2);
+}
+
 // BEEPS
 // stdv -- Photometric Standard Deviation, dec -- Spatial Contra Decay
 int matrix_beeps_filter(MATRIX* mat, float stdv, float dec)
 {
     int i, j;
-    MATRIX *hv, *vh;
+    BeepsArgs b;
 
     check_matrix(mat);
 
-    hv = __beeps_hv(mat, stdv, dec);
-    check_matrix(hv);
-    vh = __beeps_vh(mat, stdv, dec);
-    check_matrix(vh);
+    b.stdv = stdv;
+    b.dec = dec;
+    b.tiles = (mat->n + BEEPS_TILE_COLS - 1) / BEEPS_TILE_COLS;
+    b.hv = matrix_copy(mat);
+    check_matrix(b.hv);
+    b.vh = matrix_copy(mat);
+    check_matrix(b.vh);
+
+    // Both directions share the pool, every row or column tile is a task
+    b.ret = RET_OK;
+    for (b.phase = 0; b.phase < 2 && b.ret == RET_OK; b.phase++)
+        parallel_for(mat->m + b.tiles, BEEPS_BAND_LINES, __beeps_band, &b);
+    if (b.ret != RET_OK) {
+        matrix_destroy(b.hv);
+        matrix_destroy(b.vh);
+        return RET_ERROR;
+    }
 
     for (i = 0; i < mat->m; i++) {
         for (j = 0; j < mat->n; j++) {
-            mat->me[i][j] = (hv->me[i][j] + vh->me[i][j]) / 2.0f;
+            mat->me[i][j] = (b.hv->me[i][j] + b.vh->me[i][j]) / 2.0f;
         }
     }
-    matrix_destroy(hv);
-    matrix_destroy(vh);
+    matrix_destroy(b.hv);
+    matrix_destroy(b.vh);
 
     return RET_OK;
 }
 
 // hs -- space sigma,  hr -- value sigma
+// hs >= BILATE_GRID_SIGMA: bilateral grid, cost is same for any hs
 int matrix_bilate_filter(MATRIX* mat, float hs, float hr)
 {
     int i, j, i2, j2, k, sdim;
@@ -492,6 +1315,9 @@ int matrix_bilate_filter(MATRIX* mat, float hs, float hr)
 
     check_matrix(mat);
 
+    if (hs >= BILATE_GRID_SIGMA && hr >= 1.0f)
+        return __bilate_grid_filter(mat, hs, hr);
+
     skern = matrix_gskernel(hs);
     check_matrix(skern);
     sdim = skern->m / 2;
@@ -587,47 +1413,33 @@ int matrix_fast_guided_filter(MATRIX* P, MATRIX* I, int radius, float eps,
 // sigma = 0.5: convert kernel = 5x5
 // sigma = 1: convert kernel = 7x7
 // sigma = 2: convert kernel = 13x13
+// sigma >= GAUSS_IIR_SIGMA: recursive filter, cost is same for any sigma
 int matrix_gauss_filter(MATRIX* mat, float sigma)
 {
-    int i, j, m, k;
-    float d;
-    VECTOR* vec;
-    MATRIX* temp;
+    GaussArgs g;
 
     check_matrix(mat);
-    vec = vector_gskernel(sigma);
-    check_vector(vec);
-    m = vec->m / 2;
-    temp = matrix_create(mat->m, mat->n);
-    check_matrix(temp);
 
-    // Col Conv
-    matrix_foreach(mat, i, j)
-    {
-        d = 0;
-        for (k = -m; k <= m; k++) {
-            if (k + j >= 0 && k + j < mat->n)
-                d += mat->me[i][k + j] * vec->ve[k + m];
-            else
-                d += mat->me[i][j] * vec->ve[k + m];
-        }
-        temp->me[i][j] = d;
-    }
+    memset(&g, 0, sizeof(g));
+    g.mat = mat;
 
-    // Row Conv
-    matrix_foreach(mat, i, j)
-    {
-        d = 0;
-        for (k = -m; k <= m; k++) {
-            if (k + i >= 0 && k + i < mat->m)
-                d += temp->me[k + i][j] * vec->ve[k + m];
-            else
-                d += temp->me[i][j] * vec->ve[k + m];
-        }
-        mat->me[i][j] = d;
+    if (sigma >= GAUSS_IIR_SIGMA) {
+        __gauss_iir_coef(sigma, &g);
+        parallel_for(mat->m, GAUSS_BAND_ROWS, __gauss_iir_rows, &g);
+        parallel_for(mat->n, GAUSS_BAND_COLS, __gauss_iir_cols, &g);
+        return RET_OK;
     }
 
-    matrix_destroy(temp);
+    g.vec = vector_gskernel(sigma);
+    check_vector(g.vec);
+    g.temp = matrix_create(mat->m, mat->n);
+    check_matrix(g.temp);
+
+    parallel_for(mat->m, GAUSS_BAND_ROWS, __gauss_conv_cols, &g); // mat -> temp
+    parallel_for(mat->m, GAUSS_BAND_ROWS, __gauss_conv_rows, &g); // temp -> mat
+
+    matrix_destroy(g.temp);
+    vector_destroy(g.vec);
 
     return RET_OK;
 }
@@ -635,26 +1447,64 @@ int matrix_gauss_filter(MATRIX* mat, float sigma)
 // P --, I -- guidance
 int matrix_guided_filter(MATRIX* P, MATRIX* I, int radius, float eps)
 {
-    int ret;
-    MATRIX *mean_a, *mean_b;
+    return __guided_sweep(P, I, radius, eps, NULL, NULL);
+}
 
-    mean_a = matrix_create(P->m, P->n);
-    check_matrix(mean_a);
-    mean_b = matrix_create(P->m, P->n);
-    check_matrix(mean_b);
+// P --, IR, IG, IB -- color guidance
+int matrix_color_guided_filter(MATRIX* P, MATRIX* IR, MATRIX* IG, MATRIX* IB, int radius,
+    float eps)
+{
+    int k, ret = RET_ERROR;
+    BoxSweep box;
+    GuidedArgs g;
 
-    ret = __guided_means(P, I, radius, eps, mean_a, mean_b);
-    if (ret == RET_OK) {
-        // Step 5
-        // mean_a .* I + mean_b
-        matrix_dotmul(mean_a, I);
-        matrix_add(mean_a, mean_b);
+    check_matrix(P);
+    check_matrix(IR);
+    check_matrix(IG);
+    check_matrix(IB);
 
-        memcpy(P->base, mean_a->base, mean_a->m * mean_a->n * sizeof(float));
+    if (P->m != IR->m || P->n != IR->n || P->m != IG->m || P->n != IG->n || P->m != IB->m
+        || P->n != IB->n) {
+        syslog_error("Matrix and guidance size is not same.");
+        return RET_ERROR;
     }
 
-    matrix_destroy(mean_a);
-    matrix_destroy(mean_b);
+    memset(&g, 0, sizeof(g));
+    g.P = P;
+    g.I[0] = IR;
+    g.I[1] = IG;
+    g.I[2] = IB;
+    g.eps = eps * 255.0f * 255.0f;
+    for (k = 0; k < 3; k++)
+        g.a[k] = matrix_create(P->m, P->n);
+    g.b = matrix_create(P->m, P->n);
+    if (!matrix_valid(g.a[0]) || !matrix_valid(g.a[1]) || !matrix_valid(g.a[2])
+        || !matrix_valid(g.b)) {
+        syslog_error("Allocate memeory.");
+        goto exit;
+    }
+
+    memset(&box, 0, sizeof(box));
+    box.m = P->m;
+    box.n = P->n;
+    box.radius = radius;
+    box.arg = &g;
+
+    box.count = 13;
+    box.load = __color_guided_load;
+    box.save = __color_guided_save;
+    if (__box_sweep(&box) != RET_OK)
+        goto exit;
+
+    box.count = 4;
+    box.load = __color_guided_load_ab;
+    box.save = __color_guided_save_ab;
+    ret = __box_sweep(&box);
+
+exit:
+    for (k = 0; k < 3; k++)
+        matrix_destroy(g.a[k]);
+    matrix_destroy(g.b);
 
     return ret;
 }
@@ -662,165 +1512,65 @@ int matrix_guided_filter(MATRIX* P, MATRIX* I, int radius, float eps)
 int matrix_lee_filter(MATRIX* mat, int radius, float eps)
 {
     int i, j;
-
-    MATRIX *dst, *zero, *one;
-    MATRIX *mean_mat, *mean_mat_mat, *k_mat;
+    float k, var;
+    MATRIX *mean, *mean2;
 
     check_matrix(mat);
 
     eps = eps * 255.0f * 255.0f;
 
-    // zero is a temp matrix
-    zero = matrix_create(mat->m, mat->n);
-    check_matrix(zero);
-    matrix_pattern(zero, "one");
-    one = matrix_box_filter(zero, radius);
-    check_matrix(one);
-
-    // Step 1
-    mean_mat = matrix_box_filter(mat, radius);
-    check_matrix(mean_mat);
-    matrix_dotdiv(mean_mat, one);
-
-    memcpy(zero->base, mat->base, zero->m * zero->n * sizeof(float));
-    matrix_dotmul(zero, mat); // zero = mat .* mat
-    mean_mat_mat = matrix_box_filter(zero, radius);
-    check_matrix(mean_mat_mat);
-    matrix_dotdiv(mean_mat_mat, one);
-    matrix_sub(mean_mat_mat, mean_mat);
-
-    k_mat = matrix_copy(mean_mat_mat);
-    check_matrix(k_mat);
-    memcpy(zero->base, mean_mat_mat->base, zero->m * zero->n * sizeof(float));
-    matrix_foreach(zero, i, j) { zero->me[i][j] += eps; }
-    matrix_dotdiv(k_mat, zero); // K = mean_mat_mat/(mean_mat_mat + eps)
-
-    // zero = (1 - k) * mean_mat
-    memcpy(zero->base, k_mat->base, zero->m * zero->n * sizeof(float));
-    matrix_foreach(zero, i, j) { zero->me[i][j] = 1.0f - zero->me[i][j]; }
-    matrix_dotmul(zero, mean_mat);
-
-    //  dst = (1 - k) * mean_mat + k * mat
-    dst = matrix_copy(zero);
-    check_matrix(dst);
-    memcpy(zero->base, k_mat->base, zero->m * zero->n * sizeof(float));
-    matrix_dotmul(zero, mat);
-    matrix_add(dst, zero);
+    mean = matrix_create(mat->m, mat->n);
+    check_matrix(mean);
+    mean2 = matrix_create(mat->m, mat->n);
+    check_matrix(mean2);
 
-    // Save dst to mat
-    memcpy(mat->base, dst->base, mat->m * mat->n * sizeof(float));
+    if (matrix_box_means(mat, radius, mean, mean2) != RET_OK) {
+        matrix_destroy(mean2);
+        matrix_destroy(mean);
+        return RET_ERROR;
+    }
 
-    matrix_destroy(dst);
-    matrix_destroy(k_mat);
-    matrix_destroy(mean_mat_mat);
-    matrix_destroy(mean_mat);
-    matrix_destroy(one);
-    matrix_destroy(zero);
+    // K = var/(var + eps), mat = (1 - k) * mean + k * mat
+    matrix_foreach(mat, i, j)
+    {
+        var = mean2->me[i][j] - mean->me[i][j] * mean->me[i][j];
+        var = MAX(var, 0.0f);
+        k = var / (var + eps);
+        mat->me[i][j] = (1.0f - k) * mean->me[i][j] + k * mat->me[i][j];
+    }
+
+    matrix_destroy(mean2);
+    matrix_destroy(mean);
 
     return RET_OK;
 }
 
 int matrix_minmax_filter(MATRIX* mat, int radius, int maxmode)
 {
-    int i, j, i1, i2, j1, j2, k;
-    float d;
-    MATRIX* copy;
-
     check_matrix(mat);
-    copy = matrix_copy(mat);
-    check_matrix(copy);
-
-    if (maxmode) {
-        // MAX Col Filter
-        for (i = 0; i < copy->m; i++) {
-            for (j = 0; j < copy->n; j++) {
-                j1 = MAX(j - radius, 0);
-                j2 = MIN(j + radius, copy->n - 1);
-                d = mat->me[i][j1];
-                for (k = j1 + 1; k <= j2; k++) {
-                    if (mat->me[i][k] > d)
-                        d = mat->me[i][k];
-                }
-                copy->me[i][j] = d;
-            }
-        }
-        // Row Filter
-
-        for (j = 0; j < mat->n; j++) {
-            for (i = 0; i < mat->m; i++) {
-                i1 = MAX(i - radius, 0);
-                i2 = MIN(i + radius, mat->m - 1);
-                d = copy->me[i1][j];
-                for (k = i1 + 1; k <= i2; k++) {
-                    if (copy->me[k][j] > d)
-                        d = copy->me[k][j];
-                }
-                mat->me[i][j] = d;
-            }
-        }
-    } else {
-        // MIN Col Filter
-        for (i = 0; i < copy->m; i++) {
-            for (j = 0; j < copy->n; j++) {
-                j1 = MAX(j - radius, 0);
-                j2 = MIN(j + radius, copy->n - 1);
-                d = mat->me[i][j1];
-                for (k = j1 + 1; k <= j2; k++) {
-                    if (mat->me[i][k] < d)
-                        d = mat->me[i][k];
-                }
-                copy->me[i][j] = d;
-            }
-        }
-        // Row Filter
-        for (j = 0; j < mat->n; j++) {
-            for (i = 0; i < mat->m; i++) {
-                i1 = MAX(i - radius, 0);
-                i2 = MIN(i + radius, mat->m - 1);
-                d = copy->me[i1][j];
-                for (k = i1 + 1; k <= i2; k++) {
-                    if (copy->me[k][j] < d)
-                        d = copy->me[k][j];
-                }
-                mat->me[i][j] = d;
-            }
-        }
-    }
-
-    matrix_destroy(copy);
 
-    return RET_OK;
+    return __minmax_filter(mat->base, NULL, mat->m, mat->n, mat->n, 1, radius, maxmode);
 }
 
 int image_beeps_filter(IMAGE* img, float stdv, float dec, int debug)
 {
-    MATRIX* mat;
+    int k;
+    MATRIX* mat[3];
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     if (debug) {
         time_reset();
     }
-    // R Channel
-    mat = image_getplane(img, 'R');
-    check_matrix(mat);
-    matrix_beeps_filter(mat, stdv, dec);
-    image_setplane(img, 'R', mat);
-    matrix_destroy(mat);
-
-    // G Channel
-    mat = image_getplane(img, 'G');
-    check_matrix(mat);
-    matrix_beeps_filter(mat, stdv, dec);
-    image_setplane(img, 'G', mat);
-    matrix_destroy(mat);
-
-    // B Channel
-    mat = image_getplane(img, 'B');
-    check_matrix(mat);
-    matrix_beeps_filter(mat, stdv, dec);
-    image_setplane(img, 'B', mat);
-    matrix_destroy(mat);
+    if (image_getplanes(img, "RGB", mat) != RET_OK)
+        return RET_ERROR;
+    for (k = 0; k < 3; k++) {
+        matrix_beeps_filter(mat[k], stdv, dec);
+    }
+    image_setplanes(img, "RGB", mat);
+    for (k = 0; k < 3; k++)
+        matrix_destroy(mat[k]);
 
     if (debug) {
         time_spend("BEEPS filter");
@@ -831,33 +1581,23 @@ int image_beeps_filter(IMAGE* img, float stdv, float dec, int debug)
 
 int image_lee_filter(IMAGE* img, int radius, float eps, int debug)
 {
-    MATRIX* mat;
+    int k;
+    MATRIX* mat[3];
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     if (debug) {
         time_reset();
     }
-    // R Channel
-    mat = image_getplane(img, 'R');
-    check_matrix(mat);
-    matrix_lee_filter(mat, radius, eps);
-    image_setplane(img, 'R', mat);
-    matrix_destroy(mat);
-
-    // G Channel
-    mat = image_getplane(img, 'G');
-    check_matrix(mat);
-    matrix_lee_filter(mat, radius, eps);
-    image_setplane(img, 'G', mat);
-    matrix_destroy(mat);
-
-    // B Channel
-    mat = image_getplane(img, 'B');
-    check_matrix(mat);
-    matrix_lee_filter(mat, radius, eps);
-    image_setplane(img, 'B', mat);
-    matrix_destroy(mat);
+    if (image_getplanes(img, "RGB", mat) != RET_OK)
+        return RET_ERROR;
+    for (k = 0; k < 3; k++) {
+        matrix_lee_filter(mat[k], radius, eps);
+    }
+    image_setplanes(img, "RGB", mat);
+    for (k = 0; k < 3; k++)
+        matrix_destroy(mat[k]);
 
     if (debug) {
         time_spend("Lee filter");
@@ -868,36 +1608,23 @@ int image_lee_filter(IMAGE* img, int radius, float eps, int debug)
 
 int image_gauss_filter(IMAGE* image, float sigma)
 {
-    int i, j;
-    MATRIX* mat;
+    int i, j, k, n;
+    MATRIX* mat[3];
 
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
+
+    n = (image->format == IMAGE_GRAY) ? 1 : 3;
+    if (image_getplanes(image, (n == 1) ? "R" : "RGB", mat) != RET_OK)
+        return RET_ERROR;
+    for (k = 0; k < n; k++)
+        matrix_gauss_filter(mat[k], sigma);
+    image_setplanes(image, (n == 1) ? "R" : "RGB", mat);
+    for (k = 0; k < n; k++)
+        matrix_destroy(mat[k]);
 
     if (image->format == IMAGE_GRAY) {
-        mat = image_getplane(image, 'R');
-        check_matrix(mat);
-        matrix_gauss_filter(mat, sigma);
-        image_setplane(image, 'R', mat);
-        matrix_destroy(mat);
         image_foreach(image, i, j) image->ie[i][j].g = image->ie[i][j].b = image->ie[i][j].r;
-    } else {
-        mat = image_getplane(image, 'R');
-        check_matrix(mat);
-        matrix_gauss_filter(mat, sigma);
-        image_setplane(image, 'R', mat);
-        matrix_destroy(mat);
-
-        mat = image_getplane(image, 'G');
-        check_matrix(mat);
-        matrix_gauss_filter(mat, sigma);
-        image_setplane(image, 'G', mat);
-        matrix_destroy(mat);
-
-        mat = image_getplane(image, 'B');
-        check_matrix(mat);
-        matrix_gauss_filter(mat, sigma);
-        image_setplane(image, 'B', mat);
-        matrix_destroy(mat);
     }
 
     return RET_OK;
@@ -906,9 +1633,11 @@ int image_gauss_filter(IMAGE* image, float sigma)
 int image_guided_filter(IMAGE* img, IMAGE* guidance, int radius, float eps,
     int scale, int debug)
 {
-    MATRIX *mat_img, *mat_guidance;
+    int k;
+    MATRIX *mat_img[3], *mat_guidance[3];
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     if (!guidance) {
         guidance = img;
@@ -919,47 +1648,28 @@ int image_guided_filter(IMAGE* img, IMAGE* guidance, int radius, float eps,
     if (debug)
         time_reset();
 
-    // R Channel
-    mat_img = image_getplane(img, 'R');
-    check_matrix(mat_img);
-    mat_guidance = image_getplane(guidance, 'R');
-    check_matrix(mat_guidance);
-    if (scale > 1) {
-        matrix_fast_guided_filter(mat_img, mat_guidance, radius, eps, scale);
-    } else {
-        matrix_guided_filter(mat_img, mat_guidance, radius, eps);
-    }
-    image_setplane(img, 'R', mat_img);
-    matrix_destroy(mat_guidance);
-    matrix_destroy(mat_img);
-
-    // G Channel
-    mat_img = image_getplane(img, 'G');
-    check_matrix(mat_img);
-    mat_guidance = image_getplane(guidance, 'G');
-    check_matrix(mat_guidance);
-    if (scale > 1) {
-        matrix_fast_guided_filter(mat_img, mat_guidance, radius, eps, scale);
-    } else {
-        matrix_guided_filter(mat_img, mat_guidance, radius, eps);
-    }
-    image_setplane(img, 'G', mat_img);
-    matrix_destroy(mat_guidance);
-    matrix_destroy(mat_img);
-
-    // B Channel
-    mat_img = image_getplane(img, 'B');
-    check_matrix(mat_img);
-    mat_guidance = image_getplane(guidance, 'B');
-    check_matrix(mat_guidance);
-    if (scale > 1) {
-        matrix_fast_guided_filter(mat_img, mat_guidance, radius, eps, scale);
-    } else {
-        matrix_guided_filter(mat_img, mat_guidance, radius, eps);
+    if (image_getplanes(img, "RGB", mat_img) != RET_OK)
+        return RET_ERROR;
+    if (image_getplanes(guidance, "RGB", mat_guidance) != RET_OK) {
+        for (k = 0; k < 3; k++)
+            matrix_destroy(mat_img[k]);
+        return RET_ERROR;
+    }
+
+    // R, G, B Channel
+    for (k = 0; k < 3; k++) {
+        if (scale > 1) {
+            matrix_fast_guided_filter(mat_img[k], mat_guidance[k], radius, eps, scale);
+        } else {
+            matrix_guided_filter(mat_img[k], mat_guidance[k], radius, eps);
+        }
+    }
+    image_setplanes(img, "RGB", mat_img);
+
+    for (k = 0; k < 3; k++) {
+        matrix_destroy(mat_guidance[k]);
+        matrix_destroy(mat_img[k]);
     }
-    image_setplane(img, 'B', mat_img);
-    matrix_destroy(mat_guidance);
-    matrix_destroy(mat_img);
 
     if (debug)
         time_spend("Guided filter.");
@@ -967,6 +1677,89 @@ int image_guided_filter(IMAGE* img, IMAGE* guidance, int radius, float eps,
     return RET_OK;
 }
 
+// R, G, B of img are filtered with color guidance
+int image_color_guided_filter(IMAGE* img, IMAGE* guidance, int radius, float eps, int debug)
+{
+    int k, ret = RET_OK;
+    MATRIX *mat[3], *guide[3];
+
+    check_image(img);
+    check_point(image_writable(img) == RET_OK);
+
+    if (!guidance)
+        guidance = img;
+    check_image(guidance);
+
+    if (debug)
+        time_reset();
+
+    if (image_getplanes(img, "RGB", mat) != RET_OK)
+        return RET_ERROR;
+    if (image_getplanes(guidance, "RGB", guide) != RET_OK) {
+        for (k = 0; k < 3; k++)
+            matrix_destroy(mat[k]);
+        return RET_ERROR;
+    }
+
+    for (k = 0; k < 3 && ret == RET_OK; k++)
+        ret = matrix_color_guided_filter(mat[k], guide[0], guide[1], guide[2], radius, eps);
+    if (ret == RET_OK)
+        image_setplanes(img, "RGB", mat);
+
+    for (k = 0; k < 3; k++) {
+        matrix_destroy(guide[k]);
+        matrix_destroy(mat[k]);
+    }
+
+    if (debug)
+        time_spend("Color guided filter.");
+
+    return ret;
+}
+
+// R, G, B share one bilateral grid, luma is edge guide
+int image_bilate_filter(IMAGE* img, float hs, float hr, int debug)
+{
+    int i, j;
+    BYTE y;
+    float* cell;
+    RGBA_8888* p;
+    BilateGrid g;
+
+    check_image(img);
+    check_point(image_writable(img) == RET_OK);
+
+    if (debug)
+        time_reset();
+
+    memset(&g, 0, sizeof(g));
+    if (__bgrid_create(&g, img->height, img->width, 0.0f, 255.0f, hs, hr, 4) != RET_OK)
+        return RET_ERROR;
+    g.img = img;
+
+    image_foreach(img, i, j)
+    {
+        p = &img->ie[i][j];
+        color_rgb2gray(p->r, p->g, p->b, &y);
+        cell = __bgrid_cell(&g, i, j, y);
+        cell[0] += p->r;
+        cell[1] += p->g;
+        cell[2] += p->b;
+        cell[3] += 1.0f;
+    }
+    if (__bgrid_blur(&g) == RET_OK)
+        parallel_for(img->height, BILATE_BAND_ROWS, __bilate_image_slice, &g);
+
+    free(g.data);
+    if (g.ret != RET_OK)
+        return RET_ERROR;
+
+    if (debug)
+        time_spend("Bilateral filter.");
+
+    return RET_OK;
+}
+
 int image_dehaze_filter(IMAGE* img, int radius, int debug)
 {
     HISTOGRAM hist;
@@ -975,15 +1768,15 @@ int image_dehaze_filter(IMAGE* img, int radius, int debug)
     MATRIX* tx;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     if (debug)
         time_reset();
 
-    __create_darkchan(img, radius);
+    check_point(__create_darkchan(img, radius) == RET_OK);
 
     // 3. Get atmos light
-    histogram_reset(&hist);
-    image_foreach(img, i, j) histogram_add(&hist, img->ie[i][j].a);
+    histogram_image(&hist, img, NULL, HISTOGRAM_ALPHA);
     al = histogram_top(&hist, 0.001f); // 0.1%
 
     red_al = green_al = blue_al = 0.0f;
@@ -1029,7 +1822,10 @@ int image_dehaze_filter(IMAGE* img, int radius, int debug)
     }
 
     // tx min filter
-    matrix_minmax_filter(tx, radius, 0); // 0 -- min filter
+    if (matrix_minmax_filter(tx, radius, 0) != RET_OK) { // 0 -- min filter
+        matrix_destroy(tx);
+        return RET_ERROR;
+    }
 
     // tx = 1 - w*..
     float w = 0.95f;
@@ -1064,51 +1860,52 @@ int image_dehaze_filter(IMAGE* img, int radius, int debug)
 // A channel medium filter
 int image_medium_filter(IMAGE* img, int radius)
 {
-    HISTOGRAM hist;
-    int i, j, i1, i2, i3, j1, j2, j3, k;
-    MATRIX* mat;
-
-    check_image(img);
-    mat = matrix_create(img->height, img->width);
-    check_matrix(mat);
+    return image_channel_medium_filter(img, radius, "RGB");
+}
 
-    // Channel a Median Filter
-    for (i = 0; i < img->height; i++) {
-        histogram_reset(&hist);
-        j = 0;
-        i1 = MAX(i - radius, 0);
-        i2 = MIN(i + radius, img->height - 1);
-        j1 = MAX(j - radius, 0);
-        j2 = MIN(j + radius, img->width - 1);
-
-        for (i3 = i1; i3 <= i2; i3++) {
-            for (j3 = j1; j3 <= j2; j3++)
-                histogram_add(&hist, img->ie[i3][j3].a);
-        }
-        mat->me[i][0] = histogram_middle(&hist);
+// orgba -- channels, for example "RGB", "RGBA" or "A"
+int image_channel_medium_filter(IMAGE* img, int radius, char* orgba)
+{
+    MedianArgs m;
 
-        for (j = 1; j < img->width; j++) {
-            // Update histogram ?
-            if (j1 >= 0) { // Delete left column
-                for (k = i1; k <= i2; k++)
-                    histogram_del(&hist, img->ie[k][j1].a);
-            }
-            j1++;
-            j2++;
-            if (j2 < img->width) { // Add right column
-                for (k = i1; k <= i2; k++)
-                    histogram_add(&hist, img->ie[k][j2].a);
-            }
-            mat->me[i][j] = histogram_middle(&hist);
+    check_image(img);
+    check_point(image_writable(img) == RET_OK);
+    check_point(orgba);
+
+    memset(&m, 0, sizeof(m));
+    for (; *orgba && m.nch < 4; orgba++) {
+        switch (*orgba) {
+        case 'R':
+            m.offset[m.nch++] = 0;
+            break;
+        case 'G':
+            m.offset[m.nch++] = 1;
+            break;
+        case 'B':
+            m.offset[m.nch++] = 2;
+            break;
+        case 'A':
+            m.offset[m.nch++] = 3;
+            break;
+        default:
+            syslog_error("Bad channel %c.", *orgba);
+            return RET_ERROR;
         }
     }
+    if (m.nch < 1 || radius < 1)
+        return RET_OK;
 
-    // Save filter result
-    image_foreach(img, i, j) img->ie[i][j].a = mat->me[i][j];
+    m.radius = radius;
+    m.dst = img;
+    m.src = image_copy(img);
+    check_image(m.src);
 
-    matrix_destroy(mat);
+    m.ret = RET_OK;
+    parallel_for(img->height, MAX(MEDIAN_BAND_ROWS, 2 * radius + 1), __median_band, &m);
 
-    return RET_OK;
+    image_destroy(m.src);
+
+    return m.ret;
 }
 
 // [1 2 1], 1/16
@@ -1147,88 +1944,117 @@ int image_fast_filter(IMAGE* img, int n, int* kernel, int total)
     return image_rect_filter(img, &rect, n, kernel, total);
 }
 
+// Horizontal taps of one row, R, G, B together (alpha is kept), dst[j] is for column j + taps/2
+static inline __attribute__((always_inline)) void __rect_hrow(BYTE* src, int* dst, int w, int taps, int* kernel)
+{
+    int j, k, x, s[3];
+    BYTE* p;
+
+    for (j = 0; j <= w - taps; j++) {
+        s[0] = s[1] = s[2] = 0;
+        for (k = 0; k < taps; k++) {
+            x = kernel[k];
+            p = src + (j + k) * 4;
+            s[0] += x * p[0];
+            s[1] += x * p[1];
+            s[2] += x * p[2];
+        }
+        dst[j * 3] = s[0];
+        dst[j * 3 + 1] = s[1];
+        dst[j * 3 + 2] = s[2];
+    }
+}
+
+// Vertical taps over ring rows, shift >= 0 means total == 1 << shift
+static inline __attribute__((always_inline)) void __rect_vrow(int** rows, RGBA_8888* dst, int w, int taps,
+    int* kernel, int total, int shift)
+{
+    int j, k, c, s[3];
+
+    for (j = 0; j <= w - taps; j++) {
+        for (c = 0; c < 3; c++) {
+            s[c] = 0;
+            for (k = 0; k < taps; k++)
+                s[c] += kernel[k] * rows[k][j * 3 + c];
+            s[c] = (shift >= 0) ? (s[c] >> shift) : (s[c] / total);
+        }
+        dst[j].r = (BYTE)s[0];
+        dst[j].g = (BYTE)s[1];
+        dst[j].b = (BYTE)s[2];
+    }
+}
+
+// In place with a ring of taps filtered rows, row i is written after row i + taps/2 is read,
+// inlined into every case of image_rect_filter, so common taps are constant
+static inline __attribute__((always_inline)) void __rect_filter(IMAGE* img, RECT* rect, int taps, int* kernel,
+    int total, int shift, int* ring)
+{
+    int i, k, n, len, *rows[RECT_FILTER_MAX_TAPS];
+
+    n = taps / 2;
+    len = (rect->w - taps + 1) * 3;
+    for (i = 0; i < rect->h; i++) {
+        __rect_hrow((BYTE*)&img->ie[i + rect->r][rect->c], ring + (i % taps) * len, rect->w, taps, kernel);
+        if (i < taps - 1)
+            continue;
+        // Output row i - n, needs filtered rows [i - 2n, i]
+        for (k = 0; k < taps; k++)
+            rows[k] = ring + ((i - taps + 1 + k) % taps) * len;
+        __rect_vrow(rows, &img->ie[i - n + rect->r][rect->c + n], rect->w, taps, kernel, total, shift);
+    }
+}
+
 int image_rect_filter(IMAGE* img, RECT* rect, int n, int* kernel, int total)
 {
-    int i, j, k, m;
-    MATRIX* mat;
+    int k, shift, *ring;
 
     check_image(img);
-    mat = matrix_create(img->height, img->width);
-    check_matrix(mat);
+    check_point(image_writable(img) == RET_OK);
+    check_point(kernel);
 
     image_rectclamp(img, rect);
 
-    if (rect->h < n || rect->w < n) {
+    if (rect->h < n || rect->w < n || n < 1 || n > RECT_FILTER_MAX_TAPS || total == 0) {
         //      syslog_debug("NO need to filter.");
         return RET_ERROR;
     }
-
-    n /= 2;
-    // R Channel Col Conv
-    for (i = 0; i < rect->h; i++) {
-        for (j = n; j < rect->w - n; j++) {
-            m = 0;
-            for (k = -n; k <= n; k++) {
-                m += kernel[k + n] * img->ie[i + rect->r][j + rect->c + k].r;
-            }
-            mat->me[i + rect->r][j + rect->c] = m;
-        }
-    }
-    // R Channel Row Conv
-    for (j = n; j < rect->w - n; j++) {
-        for (i = n; i < rect->h - n; i++) {
-            m = 0;
-            for (k = -n; k <= n; k++) {
-                m += kernel[k + n] * mat->me[i + rect->r + k][j + rect->c];
-            }
-            m /= total;
-            img->ie[i + rect->r][j + rect->c].r = (BYTE)(m);
-        }
-    }
-
-    // G Channel Col Conv
-    for (i = 0; i < rect->h; i++) {
-        for (j = n; j < rect->w - n; j++) {
-            m = 0;
-            for (k = -n; k <= n; k++)
-                m += kernel[k + n] * img->ie[i + rect->r][j + rect->c + k].g;
-            mat->me[i + rect->r][j + rect->c] = m;
-        }
+    if (n % 2 == 0) {
+        syslog_error("Rect filter taps %d is not odd.", n);
+        return RET_ERROR;
     }
-    // G Channel Row Conv
-    for (j = n; j < rect->w - n; j++) {
-        for (i = n; i < rect->h - n; i++) {
-            m = 0;
-            for (k = -n; k <= n; k++)
-                m += kernel[k + n] * mat->me[i + rect->r + k][j + rect->c];
-            m /= total;
 
-            img->ie[i + rect->r][j + rect->c].g = (BYTE)(m);
-        }
+    // Shift instead of divide for none negative kernel and total = 2^k
+    shift = -1;
+    for (k = 0; k < n && kernel[k] >= 0; k++)
+        ;
+    if (k == n && total > 0 && (total & (total - 1)) == 0) {
+        for (shift = 0; (1 << shift) < total; shift++)
+            ;
     }
 
-    // B Channel Col Conv
-    for (i = 0; i < rect->h; i++) {
-        for (j = n; j < rect->w - n; j++) {
-            m = 0;
-            for (k = -n; k <= n; k++)
-                m += kernel[k + n] * img->ie[i + rect->r][j + rect->c + k].b;
-            mat->me[i + rect->r][j + rect->c] = m;
-        }
+    ring = (int*)malloc((size_t)n * (rect->w - n + 1) * 3 * sizeof(int));
+    if (ring == NULL) {
+        syslog_error("Allocate memeory.");
+        return RET_ERROR;
     }
-    // B Channel Row Conv
-    for (j = n; j < rect->w - n; j++) {
-        for (i = n; i < rect->h - n; i++) {
-            m = 0;
-            for (k = -n; k <= n; k++)
-                m += kernel[k + n] * mat->me[i + rect->r + k][j + rect->c];
-            m /= total;
 
-            img->ie[i + rect->r][j + rect->c].b = (BYTE)(m);
-        }
+    // Specialized for common taps
+    switch (n) {
+    case 3:
+        __rect_filter(img, rect, 3, kernel, total, shift, ring);
+        break;
+    case 5:
+        __rect_filter(img, rect, 5, kernel, total, shift, ring);
+        break;
+    case 7:
+        __rect_filter(img, rect, 7, kernel, total, shift, ring);
+        break;
+    default:
+        __rect_filter(img, rect, n, kernel, total, shift, ring);
+        break;
     }
 
-    matrix_destroy(mat);
+    free(ring);
 
     return RET_OK;
 }
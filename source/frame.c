@@ -230,6 +230,7 @@ int frame_toimage(FRAME* f, IMAGE* img)
 
     check_frame(f);
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     y = cb = cr = r = g = b = a = 0;
 
@@ -344,7 +345,13 @@ int frame_toimage(FRAME* f, IMAGE* img)
         }
         break;
     case FRAME_FMT_RGB24:
-        memcpy(img->base, ys, 3 * img->width * img->height);
+        image_foreach(img, i, j)
+        {
+            img->ie[i][j].r = *ys++;
+            img->ie[i][j].g = *ys++;
+            img->ie[i][j].b = *ys++;
+            img->ie[i][j].a = 255;
+        }
         break;
     case FRAME_FMT_RGBA32:
         image_foreach(img, i, j)
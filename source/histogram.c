@@ -7,6 +7,23 @@
 ************************************************************************************/
 #include "image.h"
 
+// Pixels go round robin into HISTOGRAM_BANKS sub-histograms which are added at the end,
+// so a run of same values does not wait on the increment of its neighbour
+#define HISTOGRAM_BANKS 4
+#define HISTOGRAM_CHANNELS 5 // R, G, B, gray, alpha
+#define HISTOGRAM_BAND_ROWS 64
+#define HISTOGRAM_BAND_PIXELS (1 << 18) // smaller bands are not worth a thread
+#define HISTOGRAM_GRAY_CHUNK 1024 // gray of a row is counted by pieces on stack
+#define HISTOGRAM_BANK_PIXELS 4096 // smaller bands use one bank, clear and add of banks would cost more
+#define HISTOGRAM_RGB_GRAY (HISTOGRAM_R | HISTOGRAM_G | HISTOGRAM_B | HISTOGRAM_GRAY)
+
+typedef struct {
+    IMAGE* img;
+    RECT* rect;
+    int channels;
+    uint64_t (*count)[HISTOGRAM_MAX_COUNT];
+} HistogramArgs;
+
 void histogram_reset(HISTOGRAM* h)
 {
     h->total = 0;
@@ -133,24 +150,189 @@ int histogram_map(HISTOGRAM* h, int max)
     return RET_OK;
 }
 
-// Suppose: image is gray
-int histogram_rect(HISTOGRAM* hist, IMAGE* img, RECT* rect)
+static void __count_bytes(BYTE* x, int stride, int n, uint32_t (*bank)[HISTOGRAM_MAX_COUNT], int banks)
+{
+    int j;
+
+    for (j = 0; banks == HISTOGRAM_BANKS && j + HISTOGRAM_BANKS <= n; j += HISTOGRAM_BANKS) {
+        bank[0][x[0]]++;
+        bank[1][x[stride]]++;
+        bank[2][x[2 * stride]]++;
+        bank[3][x[3 * stride]]++;
+        x += HISTOGRAM_BANKS * stride;
+    }
+    for (; j < n; j++, x += stride)
+        bank[0][*x]++;
+}
+
+// Four tables per pixel are already independent, two banks each are enough
+static void __count_rgb_gray(RGBA_8888* p, int n, uint32_t (*bank)[HISTOGRAM_BANKS][HISTOGRAM_MAX_COUNT], int banks)
+{
+    int j;
+
+    for (j = 0; banks > 1 && j + 2 <= n; j += 2, p += 2) {
+        bank[0][0][p[0].r]++;
+        bank[1][0][p[0].g]++;
+        bank[2][0][p[0].b]++;
+        bank[3][0][(306 * p[0].r + 601 * p[0].g + 117 * p[0].b) >> 10]++;
+        bank[0][1][p[1].r]++;
+        bank[1][1][p[1].g]++;
+        bank[2][1][p[1].b]++;
+        bank[3][1][(306 * p[1].r + 601 * p[1].g + 117 * p[1].b) >> 10]++;
+    }
+    for (; j < n; j++, p++) {
+        bank[0][0][p->r]++;
+        bank[1][0][p->g]++;
+        bank[2][0][p->b]++;
+        bank[3][0][(306 * p->r + 601 * p->g + 117 * p->b) >> 10]++;
+    }
+}
+
+// Banks of requested channels are added to count, clear is only needed before counting goes on
+static void __count_flush(HistogramArgs* h, uint32_t (*bank)[HISTOGRAM_BANKS][HISTOGRAM_MAX_COUNT], int banks,
+    int clear)
+{
+    int b, c, k, v;
+    uint64_t n;
+
+    // Counts are integers, so the order of bands does not matter
+    for (c = 0, k = 0; c < HISTOGRAM_CHANNELS; c++) {
+        if (!(h->channels & (1 << c)))
+            continue;
+        for (v = 0; v < HISTOGRAM_MAX_COUNT; v++) {
+            n = bank[c][0][v];
+            for (b = 1; b < banks; b++)
+                n += bank[c][b][v];
+            if (n)
+                __atomic_add_fetch(&h->count[k][v], n, __ATOMIC_RELAXED);
+        }
+        if (clear)
+            memset(bank[c], 0, banks * sizeof(bank[c][0]));
+        k++;
+    }
+}
+
+static void __histogram_band(void* arg, int start, int stop)
+{
+    int i, j, c, n, w, banks;
+    uint64_t pixels;
+    BYTE gray[HISTOGRAM_GRAY_CHUNK];
+    RGBA_8888* p;
+    uint32_t bank[HISTOGRAM_CHANNELS][HISTOGRAM_BANKS][HISTOGRAM_MAX_COUNT];
+    HistogramArgs* h = (HistogramArgs*)arg;
+
+    w = h->rect->w;
+    banks = ((int64_t)w * (stop - start) < HISTOGRAM_BANK_PIXELS) ? 1 : HISTOGRAM_BANKS;
+
+    // Only banks of requested channels are touched
+    for (c = 0; c < HISTOGRAM_CHANNELS; c++) {
+        if (h->channels & (1 << c))
+            memset(bank[c], 0, banks * sizeof(bank[c][0]));
+    }
+
+    pixels = 0;
+    for (i = start; i < stop; i++) {
+        // 32 bits bank counters must not wrap
+        if (pixels + w > UINT32_MAX) {
+            __count_flush(h, bank, banks, 1);
+            pixels = 0;
+        }
+        pixels += w;
+
+        p = h->img->ie[h->rect->r + i] + h->rect->c;
+        if ((h->channels & HISTOGRAM_RGB_GRAY) == HISTOGRAM_RGB_GRAY) {
+            __count_rgb_gray(p, w, bank, banks);
+            if (h->channels & HISTOGRAM_ALPHA)
+                __count_bytes(&p->a, sizeof(RGBA_8888), w, bank[4], banks);
+            continue;
+        }
+        if (h->channels & HISTOGRAM_R)
+            __count_bytes(&p->r, sizeof(RGBA_8888), w, bank[0], banks);
+        if (h->channels & HISTOGRAM_G)
+            __count_bytes(&p->g, sizeof(RGBA_8888), w, bank[1], banks);
+        if (h->channels & HISTOGRAM_B)
+            __count_bytes(&p->b, sizeof(RGBA_8888), w, bank[2], banks);
+        if (h->channels & HISTOGRAM_GRAY) {
+            for (c = 0; c < w; c += n) {
+                n = MIN(w - c, HISTOGRAM_GRAY_CHUNK);
+                for (j = 0; j < n; j++)
+                    gray[j] = (BYTE)((306 * p[c + j].r + 601 * p[c + j].g + 117 * p[c + j].b) >> 10); // color_rgb2gray
+                __count_bytes(gray, 1, n, bank[3], banks);
+            }
+        }
+        if (h->channels & HISTOGRAM_ALPHA)
+            __count_bytes(&p->a, sizeof(RGBA_8888), w, bank[4], banks);
+    }
+    __count_flush(h, bank, banks, 0);
+}
+
+// count[k] is histogram of k-th channel set in channels, bands of big rect run on threads
+int histogram_count(IMAGE* img, RECT* rect, int channels, uint64_t (*count)[HISTOGRAM_MAX_COUNT])
 {
-    int i, j;
-    BYTE n;
+    int c, n, grain;
+    RECT whole;
+    HistogramArgs args;
+
     check_image(img);
+    check_point(count != NULL);
 
+    if (rect == NULL) {
+        image_rect(&whole, img);
+        rect = &whole;
+    }
     image_rectclamp(img, rect);
-    histogram_reset(hist);
-    for (i = rect->r; i < rect->r + rect->h; i++) {
-        for (j = rect->c; j < rect->c + rect->w; j++) {
-            color_rgb2gray(img->ie[i][j].r, img->ie[i][j].g, img->ie[i][j].b, &n);
-            histogram_add(hist, n);
+
+    channels &= HISTOGRAM_ALL;
+    for (c = 0, n = 0; c < HISTOGRAM_CHANNELS; c++) {
+        if (channels & (1 << c))
+            n++;
+    }
+    memset(count, 0, n * sizeof(*count));
+    if (n == 0 || rect->h < 1 || rect->w < 1)
+        return RET_OK;
+
+    args.img = img;
+    args.rect = rect;
+    args.channels = channels;
+    args.count = count;
+    grain = MAX(HISTOGRAM_BAND_ROWS, HISTOGRAM_BAND_PIXELS / rect->w);
+    parallel_for(rect->h, grain, __histogram_band, &args);
+
+    return RET_OK;
+}
+
+// hist[k] is histogram of k-th channel set in channels
+int histogram_image(HISTOGRAM* hist, IMAGE* img, RECT* rect, int channels)
+{
+    int c, k, v, n;
+    uint64_t count[HISTOGRAM_CHANNELS][HISTOGRAM_MAX_COUNT];
+
+    check_point(hist != NULL);
+    check_point(histogram_count(img, rect, channels, count) == RET_OK);
+
+    channels &= HISTOGRAM_ALL;
+    for (c = 0, k = 0; c < HISTOGRAM_CHANNELS; c++) {
+        if (!(channels & (1 << c)))
+            continue;
+        histogram_reset(&hist[k]);
+        for (v = 0; v < HISTOGRAM_MAX_COUNT; v++) {
+            n = (int)count[k][v];
+            hist[k].count[v] = n;
+            hist[k].total += n;
         }
+        k++;
     }
+
     return RET_OK;
 }
 
+// Suppose: image is gray
+int histogram_rect(HISTOGRAM* hist, IMAGE* img, RECT* rect)
+{
+    check_image(img);
+    return histogram_image(hist, img, rect, HISTOGRAM_GRAY);
+}
+
 float histogram_likeness(HISTOGRAM* h1, HISTOGRAM* h2)
 {
     int k;
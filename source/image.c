@@ -8,71 +8,77 @@
 ************************************************************************************/
 
 #include "image.h"
+#include "stream.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-#include <jerror.h>
-#include <jpeglib.h>
 #include <png.h>
 
-typedef struct {
-    const unsigned char *data;
-    ssize_t size;
-    int offset;
-} PngSource;
-
-typedef struct {
-    char* data; // the begin of the memory
-    size_t length; // ths size of the data
-    size_t offset; // the current read pointer
-} PngDestination;
 
 
 #define IMAGE_MAGIC MAKE_FOURCC('I', 'M', 'A', 'G')
+#define NIMG_MAGIC MAKE_FOURCC('N', 'I', 'M', 'G')
+#define NIMG_VERSION 1
+#define NIMG_STRIP_ROWS 64
 
 #define CLAHE_MAX_ROWS 8
 #define CLAHE_MAX_COLS 8
 
 #define IMAGE_MAX_NB_SIZE 25
+#define IMAGE_PLANE_BAND_ROWS 32
+
+// Head of .nimg file, native byte order, IMAGE_MASK KColors[256] follow it
+typedef struct {
+    DWORD magic; // NIMG_MAGIC
+    WORD version, layout;
+    WORD height, width, format, reserved;
+    int stride; // bytes of payload row, planar: bytes of plane row
+    int offset; // payload from file begin, IMAGE_ALIGN aligned
+    int K, KRadius, KInstance;
+    BYTE padding[28];
+} NImgHead;
+
+typedef struct {
+    IMAGE* img;
+    MATRIX** planes;
+    int n, offset[4]; // byte offset of channel in RGBA_8888
+} PlaneArgs;
 RGBA_8888* __image_rgb_nb[IMAGE_MAX_NB_SIZE];
 
 extern int color_rgbcmp(RGBA_8888* c1, RGBA_8888* c2);
 extern void color_rgbsort(int n, RGBA_8888* cv[]);
-extern int image_memsize(WORD h, WORD w);
-extern void image_membind(IMAGE* img, WORD h, WORD w);
+extern int image_memsize(WORD h, WORD w, int pad);
+extern void image_membind(IMAGE* img, WORD h, WORD w, int pad);
 extern int text_puts(IMAGE* image, int r, int c, char* text, int color);
+extern int image_resample(IMAGE* src, IMAGE* dst, int method);
+extern int matrix_box_means(MATRIX* src, int r, MATRIX* mean, MATRIX* mean2);
 
-static void __jpeg_errexit(j_common_ptr cinfo);
 static int __nb3x3_map(IMAGE* img, int r, int c);
 static void __draw_hline(IMAGE* img, int* x, int* y, int run_length,
     int x_advance, int r, int g, int b);
 static void __draw_vline(IMAGE* img, int* x, int* y, int run_length,
     int x_advance, int r, int g, int b);
 static int __color_rgbfind(RGBA_8888* c, int n, RGBA_8888* cv[]);
-static void* __image_malloc(WORD h, WORD w);
+static void* __image_malloc(WORD h, WORD w, int pad);
 
 static IMAGE* image_loadpng(char* fname);
 static int image_savepng(IMAGE* img, const char* filename);
 static IMAGE* image_loadjpeg(char* fname);
+static IMAGE* image_loadnimg(char* fname);
 static int image_savejpeg(IMAGE* img, const char* filename, int quality);
-static void png_read_callback(png_structp png_ptr, png_bytep data, png_size_t length);
-static void png_write_callback(png_structp png_ptr, png_bytep data, png_size_t size);
 // ---------------------------------------------------------------------
 
-static void __jpeg_errexit(j_common_ptr cinfo)
-{
-    cinfo->err->output_message(cinfo);
-    exit(EXIT_FAILURE);
-}
-
 static int __nb3x3_map(IMAGE* img, int r, int c)
 {
     int i, j, k;
     k = 0;
     for (i = -1; i <= 1; i++) {
         for (j = -1; j <= 1; j++) {
-            __image_rgb_nb[k] = &(img->base[(r + i) * img->width + c + j]);
+            __image_rgb_nb[k] = &(img->ie[r + i][c + j]);
             ++k;
         }
     }
@@ -141,59 +147,146 @@ static int __color_rgbfind(RGBA_8888* c, int n, RGBA_8888* cv[])
     return -1;
 }
 
-static void* __image_malloc(WORD h, WORD w)
+// Only clear head, pixels are set by caller
+static void* __image_malloc(WORD h, WORD w, int pad)
 {
-    void* img = (IMAGE*)calloc((size_t)1, image_memsize(h, w));
+    void* img = pool_malloc(image_memsize(h, w, pad));
     if (!img) {
         syslog_error("Allocate memeory.");
         return NULL;
     }
+    memset(img, 0, sizeof(IMAGE));
     return img;
 }
 
+static int __image_stride(WORD w, int pad)
+{
+    int bytes = (w + 2 * pad) * sizeof(RGBA_8888);
+    return (bytes + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
 
-int image_memsize(WORD h, WORD w)
+// Head + row pointers + (h + 2 * pad) rows, extra IMAGE_ALIGN for alignment
+int image_memsize(WORD h, WORD w, int pad)
 {
     int size;
 
     size = sizeof(IMAGE);
-    size += (h * w) * sizeof(RGBA_8888);
     size += h * sizeof(RGBA_8888*);
+    size += IMAGE_ALIGN;
+    size += (h + 2 * pad) * __image_stride(w, pad);
     return size;
 }
 
-// mem align !
-void image_membind(IMAGE* img, WORD h, WORD w)
+// First pixel of every row is IMAGE_ALIGN aligned, border pixels are before/after
+void image_membind(IMAGE* img, WORD h, WORD w, int pad)
 {
     int i;
+    uintptr_t data;
     void* base = (void*)img;
 
     img->magic = IMAGE_MAGIC;
     img->height = h;
     img->width = w;
-    img->base = (RGBA_8888*)(base + sizeof(IMAGE)); // Data
-    img->ie = (RGBA_8888**)(base + sizeof(IMAGE) + (h * w) * sizeof(RGBA_8888)); // Skip head and data
+    img->pad = pad;
+    img->stride = __image_stride(w, pad);
+    img->refs = 1;
+    img->ie = (RGBA_8888**)(base + sizeof(IMAGE)); // Skip head
+
+    data = (uintptr_t)(base + sizeof(IMAGE) + h * sizeof(RGBA_8888*)) + pad * sizeof(RGBA_8888);
+    data = (data + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    data += pad * img->stride;
+    img->base = (RGBA_8888*)data;
     for (i = 0; i < h; i++)
-        img->ie[i] = &(img->base[i * w]);
+        img->ie[i] = (RGBA_8888*)(data + i * img->stride);
+}
+
+// fill < 0: leave pixels as they are
+static IMAGE* __image_create(WORD h, WORD w, int pad, int fill)
+{
+    IMAGE* img;
+
+    pad = MAX(pad, 0);
+    img = (IMAGE*)__image_malloc(h, w, pad);
+    if (!img) {
+        return NULL;
+    }
+    image_membind(img, h, w, pad);
 
     // Blank image, for png is more import
-    memset(img->base, 255, (h * w) * sizeof(RGBA_8888));
+    if (fill >= 0)
+        memset(image_row(img, -pad) - pad, fill, (size_t)(h + 2 * pad) * img->stride);
+
+    return img;
 }
 
 IMAGE* image_create(WORD h, WORD w)
 {
-    void* base = __image_malloc(h, w);
-    if (!base) {
-        return NULL;
+    return __image_create(h, w, 0, 255);
+}
+
+IMAGE* image_create_uninit(WORD h, WORD w)
+{
+    return __image_create(h, w, 0, -1);
+}
+
+IMAGE* image_create_padded(WORD h, WORD w, int pad)
+{
+    return __image_create(h, w, pad, 255);
+}
+
+// Border pixels: ZERO -- 0, BORDER -- replicate edge, REFLECT -- mirror without edge
+int image_fill_border(IMAGE* img, int method)
+{
+    int i, j, k, pad, w, h;
+    RGBA_8888 *row, zero;
+
+    check_image(img);
+    check_point(image_writable(img) == RET_OK);
+    pad = img->pad;
+    if (pad < 1)
+        return RET_OK;
+
+    h = img->height;
+    w = img->width;
+    memset(&zero, 0, sizeof(zero));
+    for (i = 0; i < h; i++) {
+        row = img->ie[i];
+        for (j = 1; j <= pad; j++) {
+            if (method == PAD_METHOD_ZERO) {
+                row[-j] = row[w - 1 + j] = zero;
+            } else if (method == PAD_METHOD_REFLECT) {
+                row[-j] = row[CLAMP(j, 0, w - 1)];
+                row[w - 1 + j] = row[CLAMP(w - 1 - j, 0, w - 1)];
+            } else {
+                row[-j] = row[0];
+                row[w - 1 + j] = row[w - 1];
+            }
+        }
     }
-    image_membind((IMAGE*)base, h, w);
-    return (IMAGE*)base;
+    // Top and bottom rows, with left/right border
+    for (i = 1; i <= pad; i++) {
+        if (method == PAD_METHOD_ZERO) {
+            memset(image_row(img, -i) - pad, 0, (w + 2 * pad) * sizeof(RGBA_8888));
+            memset(image_row(img, h - 1 + i) - pad, 0, (w + 2 * pad) * sizeof(RGBA_8888));
+            continue;
+        }
+        k = (method == PAD_METHOD_REFLECT) ? CLAMP(i, 0, h - 1) : 0;
+        memcpy(image_row(img, -i) - pad, img->ie[k] - pad, (w + 2 * pad) * sizeof(RGBA_8888));
+        k = (method == PAD_METHOD_REFLECT) ? CLAMP(h - 1 - i, 0, h - 1) : h - 1;
+        memcpy(image_row(img, h - 1 + i) - pad, img->ie[k] - pad, (w + 2 * pad) * sizeof(RGBA_8888));
+    }
+
+    return RET_OK;
 }
 
 int image_clear(IMAGE* img)
 {
+    int i;
+
     check_image(img);
-    memset(img->base, 0, img->height * img->width * sizeof(RGBA_8888));
+    check_point(image_writable(img) == RET_OK);
+    for (i = 0; i < img->height; i++)
+        memset(img->ie[i], 0, img->width * sizeof(RGBA_8888));
     return RET_OK;
 }
 
@@ -339,11 +432,121 @@ MATRIX* image_rect_plane(IMAGE* img, char oargb, RECT* rect)
     return mat;
 }
 
+static int __plane_args(PlaneArgs* a, IMAGE* img, char* orgb, MATRIX** planes)
+{
+    check_image(img);
+    check_point(orgb && planes);
+
+    a->img = img;
+    a->planes = planes;
+    for (a->n = 0; orgb[a->n] && a->n < 4; a->n++) {
+        switch (orgb[a->n]) {
+        case 'R':
+            a->offset[a->n] = 0;
+            break;
+        case 'G':
+            a->offset[a->n] = 1;
+            break;
+        case 'B':
+            a->offset[a->n] = 2;
+            break;
+        default:
+            syslog_error("Bad channel %c.", orgb[a->n]);
+            return RET_ERROR;
+        }
+    }
+    return RET_OK;
+}
+
+static void __getplanes_band(void* arg, int start, int stop)
+{
+    int i, j, k, off;
+    BYTE* p;
+    float* x;
+    PlaneArgs* a = (PlaneArgs*)arg;
+
+    for (i = start; i < stop; i++) {
+        p = (BYTE*)a->img->ie[i];
+        for (k = 0; k < a->n; k++) {
+            x = a->planes[k]->me[i];
+            off = a->offset[k];
+            for (j = 0; j < a->img->width; j++)
+                x[j] = p[4 * j + off];
+        }
+    }
+}
+
+static void __setplanes_band(void* arg, int start, int stop)
+{
+    int i, j, k, off;
+    BYTE* p;
+    float* x;
+    PlaneArgs* a = (PlaneArgs*)arg;
+
+    for (i = start; i < stop; i++) {
+        p = (BYTE*)a->img->ie[i];
+        for (k = 0; k < a->n; k++) {
+            x = a->planes[k]->me[i];
+            off = a->offset[k];
+            for (j = 0; j < a->img->width; j++)
+                p[4 * j + off] = (BYTE)CLAMP(x[j], 0, 255);
+        }
+    }
+}
+
+// Float planes of channels in orgb (made of 'R', 'G', 'B'), one pass over image, caller destroys planes
+int image_getplanes(IMAGE* img, char* orgb, MATRIX** planes)
+{
+    int k;
+    PlaneArgs a;
+
+    if (__plane_args(&a, img, orgb, planes) != RET_OK)
+        return RET_ERROR;
+
+    for (k = 0; k < a.n; k++) {
+        planes[k] = matrix_create_uninit(img->height, img->width);
+        if (!matrix_valid(planes[k])) {
+            syslog_error("Allocate memeory.");
+            while (--k >= 0) {
+                matrix_destroy(planes[k]);
+                planes[k] = NULL;
+            }
+            return RET_ERROR;
+        }
+    }
+    parallel_for(img->height, IMAGE_PLANE_BAND_ROWS, __getplanes_band, &a);
+
+    return RET_OK;
+}
+
+// Save planes back in one pass, planes keep owned by caller
+int image_setplanes(IMAGE* img, char* orgb, MATRIX** planes)
+{
+    int k;
+    PlaneArgs a;
+
+    if (__plane_args(&a, img, orgb, planes) != RET_OK)
+        return RET_ERROR;
+
+    for (k = 0; k < a.n; k++) {
+        check_matrix(planes[k]);
+        if (planes[k]->m != img->height || planes[k]->n != img->width) {
+            syslog_error("Plane size is not same as image.");
+            return RET_ERROR;
+        }
+    }
+    check_point(image_writable(img) == RET_OK);
+    parallel_for(img->height, IMAGE_PLANE_BAND_ROWS, __setplanes_band, &a);
+
+    return RET_OK;
+}
+
 int image_setplane(IMAGE* img, char oargb, MATRIX* mat)
 {
     int i, j;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     check_argb(oargb);
     check_matrix(mat);
 
@@ -409,157 +612,95 @@ int image_rectclamp(IMAGE* img, RECT* rect)
     return RET_OK;
 }
 
-void image_destroy(IMAGE* img)
+static IMAGE* __image_root(IMAGE* img)
 {
-    if (!image_valid(img))
+    return (img->owner) ? (IMAGE*)img->owner : img;
+}
+
+// Block of img is freed when last head on its pixels is gone
+static void __image_release(IMAGE* img)
+{
+    if (__atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) > 0)
         return;
-    free(img);
+    if (img->map)
+        file_unmap(img->map, img->mapsize);
+    pool_free(img);
 }
 
-static IMAGE* image_loadjpeg(char* fname)
+// Head and row table, pixels [r, r + h) x [c, c + w) of img
+static IMAGE* __image_borrow(IMAGE* img, int r, int c, int h, int w)
 {
-    JSAMPARRAY lineBuf;
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr err_mgr;
-    int bytes_per_pixel;
-    FILE* fp = NULL;
-    IMAGE* img = NULL;
-    int i, j;
+    int i;
+    IMAGE *sub, *root;
 
-    if ((fp = fopen(fname, "rb")) == NULL) {
-        syslog_error("Open file %s.", fname);
-        goto read_fail;
+    sub = (IMAGE*)pool_malloc(sizeof(IMAGE) + h * sizeof(RGBA_8888*));
+    if (!sub) {
+        syslog_error("Allocate memeory.");
+        return NULL;
     }
+    memset(sub, 0, sizeof(IMAGE));
+    sub->magic = IMAGE_MAGIC;
+    sub->height = h;
+    sub->width = w;
+    sub->format = img->format;
+    sub->stride = img->stride;
+    sub->ie = (RGBA_8888**)((BYTE*)sub + sizeof(IMAGE));
+    for (i = 0; i < h; i++)
+        sub->ie[i] = img->ie[r + i] + c;
+    sub->base = sub->ie[0];
+    sub->refs = 1;
 
-    cinfo.err = jpeg_std_error(&err_mgr);
-    err_mgr.error_exit = __jpeg_errexit;
-
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, fp);
-    jpeg_read_header(&cinfo, 1);
-    cinfo.do_fancy_upsampling = 0;
-    cinfo.do_block_smoothing = 0;
-    jpeg_start_decompress(&cinfo);
+    root = __image_root(img);
+    __atomic_add_fetch(&root->refs, 1, __ATOMIC_ACQ_REL);
+    sub->owner = root;
 
-    bytes_per_pixel = cinfo.output_components;
-    lineBuf = cinfo.mem->alloc_sarray((j_common_ptr)&cinfo, JPOOL_IMAGE,
-        (cinfo.output_width * bytes_per_pixel), 1);
-    img = image_create(cinfo.output_height, cinfo.output_width);
-    if (!img) {
-        syslog_error("Create image.");
-        goto read_fail;
-    }
+    return sub;
+}
 
-    if (bytes_per_pixel == 4) {
-        img->format = IMAGE_RGBA;
-        for (i = 0; i < img->height; ++i) {
-            jpeg_read_scanlines(&cinfo, lineBuf, 1);
-            for (j = 0; j < img->width; j++) {
-                img->ie[i][j].r = lineBuf[0][4 * j];
-                img->ie[i][j].g = lineBuf[0][4 * j + 1];
-                img->ie[i][j].b = lineBuf[0][4 * j + 2];
-                img->ie[i][j].a = lineBuf[0][4 * j + 3];
-            }
-        }
-    } else if (bytes_per_pixel == 3) {
-        img->format = IMAGE_RGBA;
-        for (i = 0; i < img->height; ++i) {
-            jpeg_read_scanlines(&cinfo, lineBuf, 1);
-            for (j = 0; j < img->width; j++) {
-                img->ie[i][j].r = lineBuf[0][3 * j];
-                img->ie[i][j].g = lineBuf[0][3 * j + 1];
-                img->ie[i][j].b = lineBuf[0][3 * j + 2];
-                // img->ie[i][j].a = 0;
-            }
-        }
-    } else if (bytes_per_pixel == 1) {
-        img->format = IMAGE_GRAY;
-        for (i = 0; i < img->height; ++i) {
-            jpeg_read_scanlines(&cinfo, lineBuf, 1);
-            for (j = 0; j < img->width; j++) {
-                img->ie[i][j].r = lineBuf[0][j];
-                img->ie[i][j].g = img->ie[i][j].r;
-                img->ie[i][j].b = img->ie[i][j].r;
-                // img->ie[i][j].a = 0;
-            }
-        }
-    } else {
-        syslog_error("Color channels is %d (1 or 3).", bytes_per_pixel);
-        goto read_fail;
-    }
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
-    fclose(fp);
+void image_destroy(IMAGE* img)
+{
+    IMAGE* root;
 
-    return img;
-read_fail:
-    if (fp)
-        fclose(fp);
-    if (img)
-        image_destroy(img);
+    if (!image_valid(img))
+        return;
+    img->magic = 0;
+    if (img->owner) {
+        root = (IMAGE*)img->owner;
+        if (img->cow)
+            __atomic_sub_fetch(&root->shares, 1, __ATOMIC_ACQ_REL);
+        __image_release(root);
+    }
+    __image_release(img);
+}
 
-    return NULL;
+static IMAGE* image_loadjpeg(char* fname)
+{
+    return ireader_image(ireader_open(fname));
 }
 
 // save alpha channel？
 static int image_savejpeg(IMAGE* img, const char* filename, int quality)
 {
-    int row_stride;
-    FILE* outfile;
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    JSAMPLE* img_buffer;
-
-    if (!image_valid(img)) {
-        syslog_error("Bad image.");
-        return RET_ERROR;
-    }
-    if ((outfile = fopen(filename, "wb")) == NULL) {
-        syslog_error("Create file (%s).", filename);
-        return RET_ERROR;
-    }
-    img_buffer = (JSAMPLE*)img->base;
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-
-    jpeg_stdio_dest(&cinfo, outfile);
-
-    cinfo.image_width = img->width;
-    cinfo.image_height = img->height;
-    cinfo.input_components = 4;
-    cinfo.in_color_space = JCS_EXT_RGBA; // JCS_RGB;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-
-    jpeg_start_compress(&cinfo, TRUE);
-
-    cinfo.next_scanline = 0;
-    row_stride = img->width * 4;
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &img_buffer[cinfo.next_scanline * row_stride];
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
-    }
+    IWRITER* writer;
 
-    jpeg_finish_compress(&cinfo);
-    fclose(outfile);
-
-    jpeg_destroy_compress(&cinfo);
+    check_image(img);
+    writer = iwriter_open((char*)filename, img->height, img->width, quality);
+    check_point(writer != NULL);
+    iwriter_write(writer, img->ie, img->height);
 
-    return RET_OK;
+    return iwriter_close(writer);
 }
 
 static IMAGE* image_loadpng(char* fname)
 {
 #if 1
-    int size;
+    size_t size;
     CHECK_POINT(fname != NULL);
 
-    char *data = file_load(fname, &size);
+    char *data = file_map(fname, &size);
     CHECK_POINT(data != NULL);
     IMAGE *image = image_loadpng_from_memory(data, size);
-    free(data);
+    file_unmap(data, size);
 
     return image;
 #else 
@@ -764,16 +905,7 @@ read_fail:
 static int image_savepng(IMAGE* img, const char* filename)
 {
 #if 1
-    int size;
-    check_image(img);
-
-    char *data = image_savepng_to_memory(img, &size);
-
-    check_point(data != NULL);
-    int ret = file_save((char *)filename, data, size);
-    free(data);
-
-    return ret;
+    return image_savepng_opt(img, filename, NULL);
 #else
     FILE* outfile;
     png_struct* png_ptr = NULL;
@@ -827,6 +959,266 @@ static int image_savepng(IMAGE* img, const char* filename)
 #endif
 }
 
+static int __nimg_valid(NImgHead* head, size_t size)
+{
+    size_t rows;
+
+    if (size < sizeof(NImgHead) || head->magic != NIMG_MAGIC || head->version != NIMG_VERSION)
+        return 0;
+    if (head->height < 1 || head->width < 1 || head->offset < (int)sizeof(NImgHead) || head->stride < head->width)
+        return 0;
+    if (head->layout == NIMG_RGBA) {
+        if (head->stride < head->width * (int)sizeof(RGBA_8888) || head->stride % sizeof(RGBA_8888))
+            return 0;
+        rows = head->height;
+    } else if (head->layout == NIMG_PLANAR) {
+        rows = 4 * (size_t)head->height;
+    } else {
+        return 0;
+    }
+    if (head->format == IMAGE_MASK && head->offset < (int)(sizeof(NImgHead) + 256 * sizeof(int)))
+        return 0;
+
+    return ((size_t)head->offset + rows * head->stride <= size) ? 1 : 0;
+}
+
+// Head and row table in pool, pixels in mapped file
+static IMAGE* __image_mapped(NImgHead* head, char* map, size_t mapsize)
+{
+    int i;
+    IMAGE* img;
+
+    img = (IMAGE*)pool_malloc(sizeof(IMAGE) + head->height * sizeof(RGBA_8888*));
+    if (!img) {
+        syslog_error("Allocate memeory.");
+        return NULL;
+    }
+    memset(img, 0, sizeof(IMAGE));
+    img->magic = IMAGE_MAGIC;
+    img->height = head->height;
+    img->width = head->width;
+    img->stride = head->stride;
+    img->ie = (RGBA_8888**)((BYTE*)img + sizeof(IMAGE));
+    img->base = (RGBA_8888*)(map + head->offset);
+    for (i = 0; i < img->height; i++)
+        img->ie[i] = image_row(img, i);
+    img->map = map;
+    img->mapsize = mapsize;
+    img->refs = 1;
+
+    return img;
+}
+
+// map: data is mapped file, aligned RGBA payload is used in place
+static IMAGE* __nimg_decode(char* data, size_t size, int map)
+{
+    int i, j;
+    BYTE* plane;
+    NImgHead* head = (NImgHead*)data;
+    IMAGE* img = NULL;
+
+    if (!__nimg_valid(head, size)) {
+        syslog_error("Bad nimg data.");
+        return NULL;
+    }
+
+    if (map && head->layout == NIMG_RGBA && head->stride % IMAGE_ALIGN == 0 && head->offset % IMAGE_ALIGN == 0) {
+        img = __image_mapped(head, data, size);
+    } else if ((img = image_create_uninit(head->height, head->width)) != NULL) {
+        for (i = 0; i < img->height; i++) {
+            if (head->layout == NIMG_RGBA) {
+                memcpy(img->ie[i], data + head->offset + (size_t)i * head->stride, img->width * sizeof(RGBA_8888));
+                continue;
+            }
+            plane = (BYTE*)data + head->offset + (size_t)i * head->stride;
+            for (j = 0; j < img->width; j++) {
+                img->ie[i][j].r = plane[j];
+                img->ie[i][j].g = plane[j + (size_t)img->height * head->stride];
+                img->ie[i][j].b = plane[j + (size_t)2 * img->height * head->stride];
+                img->ie[i][j].a = plane[j + (size_t)3 * img->height * head->stride];
+            }
+        }
+    }
+
+    if (img && head->format == IMAGE_MASK) {
+        img->format = IMAGE_MASK;
+        img->K = head->K;
+        img->KRadius = head->KRadius;
+        img->KInstance = head->KInstance;
+        memcpy(img->KColors, data + sizeof(NImgHead), ARRAY_SIZE(img->KColors) * sizeof(int));
+    }
+
+    return img;
+}
+
+// Pages are copy on write, so image can be changed
+static IMAGE* image_loadnimg(char* fname)
+{
+    size_t size;
+    char* data;
+    IMAGE* img;
+
+    data = file_map(fname, &size);
+    CHECK_POINT(data != NULL);
+    img = __nimg_decode(data, size, 1);
+    if (!img)
+        syslog_error("Load %s.", fname);
+    if (!img || !img->map)
+        file_unmap(data, size);
+
+    return img;
+}
+
+static int __write_all(int fd, void* buf, size_t n)
+{
+    ssize_t k;
+    BYTE* p = (BYTE*)buf;
+
+    while (n > 0) {
+        k = write(fd, p, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return RET_ERROR;
+        p += k;
+        n -= k;
+    }
+    return RET_OK;
+}
+
+// One writev is capped at 0x7ffff000 bytes, so big payloads need more calls
+static int __writev_all(int fd, struct iovec* iov, int n)
+{
+    ssize_t k;
+
+    while (n > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            n--;
+            continue;
+        }
+        k = writev(fd, iov, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return RET_ERROR;
+        while (n > 0 && (size_t)k >= iov->iov_len) {
+            k -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (BYTE*)iov->iov_base + k;
+            iov->iov_len -= k;
+        }
+    }
+    return RET_OK;
+}
+
+// Rows are packed to head stride in strips, planes are split from RGBA
+static int __nimg_payload(int fd, IMAGE* img, NImgHead* head)
+{
+    int i, j, k, m, n, ret = RET_OK;
+    BYTE *strip, *p, *q;
+
+    strip = (BYTE*)pool_calloc((size_t)head->stride * NIMG_STRIP_ROWS);
+    check_point(strip != NULL);
+    for (k = 0; k < (head->layout == NIMG_PLANAR ? 4 : 1) && ret == RET_OK; k++) {
+        for (i = 0; i < img->height && ret == RET_OK; i += n) {
+            n = MIN(NIMG_STRIP_ROWS, img->height - i);
+            for (j = 0; j < n; j++) {
+                p = strip + (size_t)j * head->stride;
+                q = (BYTE*)img->ie[i + j];
+                if (head->layout == NIMG_RGBA) {
+                    memcpy(p, q, img->width * sizeof(RGBA_8888));
+                    continue;
+                }
+                for (m = 0; m < img->width; m++)
+                    p[m] = q[4 * m + k];
+            }
+            ret = __write_all(fd, strip, (size_t)n * head->stride);
+        }
+    }
+    pool_free(strip);
+
+    return ret;
+}
+
+int image_savenimg(IMAGE* img, const char* fname, int layout)
+{
+    int fd, ret;
+    size_t bytes;
+    NImgHead head;
+    BYTE zero[IMAGE_ALIGN + 256 * sizeof(int)];
+    struct iovec iov[3];
+    char temp[FILENAME_MAX];
+
+    check_image(img);
+    if (layout != NIMG_RGBA && layout != NIMG_PLANAR) {
+        syslog_error("Bad nimg layout %d.", layout);
+        return RET_ERROR;
+    }
+
+    memset(&head, 0, sizeof(head));
+    memset(zero, 0, sizeof(zero));
+    head.magic = NIMG_MAGIC;
+    head.version = NIMG_VERSION;
+    head.layout = layout;
+    head.height = img->height;
+    head.width = img->width;
+    head.format = img->format;
+    bytes = (layout == NIMG_RGBA) ? img->width * sizeof(RGBA_8888) : img->width;
+    head.stride = (bytes + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    head.offset = sizeof(NImgHead);
+    if (img->format == IMAGE_MASK) {
+        head.K = img->K;
+        head.KRadius = img->KRadius;
+        head.KInstance = img->KInstance;
+        memcpy(zero, img->KColors, ARRAY_SIZE(img->KColors) * sizeof(int));
+        head.offset += ARRAY_SIZE(img->KColors) * sizeof(int);
+    }
+    head.offset = (head.offset + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+
+    // img may be mapped from fname itself, truncating it would lose the pixels, so write a temp file and rename it
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", fname) >= (int)sizeof(temp)) {
+        syslog_error("File name is too long (%s).", fname);
+        return RET_ERROR;
+    }
+    fd = mkstemp(temp);
+    if (fd < 0) {
+        syslog_error("Create file (%s).", temp);
+        return RET_ERROR;
+    }
+    fchmod(fd, 0644);
+
+    // Rows of image are same as file, one write for all
+    iov[0].iov_base = &head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = zero;
+    iov[1].iov_len = head.offset - sizeof(head);
+    if (layout == NIMG_RGBA && img->stride == head.stride && img->pad == 0) {
+        iov[2].iov_base = img->base;
+        iov[2].iov_len = (size_t)img->height * img->stride;
+    } else {
+        iov[2].iov_base = NULL;
+        iov[2].iov_len = 0;
+    }
+    bytes = iov[2].iov_len;
+    ret = __writev_all(fd, iov, 3);
+    if (ret == RET_OK && bytes == 0)
+        ret = __nimg_payload(fd, img, &head);
+    if (close(fd) != 0)
+        ret = RET_ERROR;
+    if (ret == RET_OK && rename(temp, fname) != 0)
+        ret = RET_ERROR;
+
+    if (ret != RET_OK) {
+        unlink(temp);
+        syslog_error("Write file (%s).", fname);
+    }
+    return ret;
+}
+
 IMAGE* image_load(char* fname)
 {
     char* extname = strrchr(fname, '.');
@@ -835,9 +1227,13 @@ IMAGE* image_load(char* fname)
             return image_loadjpeg(fname);
         if (strcasecmp(extname, ".png") == 0)
             return image_loadpng(fname);
+        if (strcasecmp(extname, ".nimg") == 0)
+            return image_loadnimg(fname);
+        if (strcasecmp(extname, ".qoi") == 0)
+            return image_loadqoi(fname);
     }
 
-    syslog_error("Only support jpg/jpeg/png loading.");
+    syslog_error("Only support jpg/jpeg/png/nimg/qoi loading.");
     return NULL;
 }
 
@@ -851,14 +1247,19 @@ int image_save(IMAGE* img, const char* fname)
             return image_savejpeg(img, fname, 100);
         if (strcasecmp(extname, ".png") == 0)
             return image_savepng(img, fname);
+        if (strcasecmp(extname, ".nimg") == 0)
+            return image_savenimg(img, fname, NIMG_RGBA);
+        if (strcasecmp(extname, ".qoi") == 0)
+            return image_saveqoi(img, fname);
     }
 
-    syslog_error("ONLY Support jpg/jpeg/png image saving.");
+    syslog_error("ONLY Support jpg/jpeg/png/nimg/qoi image saving.");
     return RET_ERROR;
 }
 
 IMAGE* image_copy(IMAGE* img)
 {
+    int i;
     IMAGE* copy;
 
     if (!image_valid(img)) {
@@ -866,11 +1267,12 @@ IMAGE* image_copy(IMAGE* img)
         return NULL;
     }
 
-    if ((copy = image_create(img->height, img->width)) == NULL) {
+    if ((copy = image_create_uninit(img->height, img->width)) == NULL) {
         syslog_error("Create image.");
         return NULL;
     }
-    memcpy(copy->base, img->base, img->height * img->width * sizeof(RGBA_8888));
+    for (i = 0; i < img->height; i++)
+        memcpy(copy->ie[i], img->ie[i], img->width * sizeof(RGBA_8888));
     if (img->format == IMAGE_MASK) {
         copy->format = img->format;
         copy->K = img->K;
@@ -881,69 +1283,92 @@ IMAGE* image_copy(IMAGE* img)
     return copy;
 }
 
+IMAGE* image_view(IMAGE* img, RECT* rect)
+{
+    IMAGE* view;
+
+    CHECK_IMAGE(img);
+    CHECK_POINT(rect != NULL);
+    image_rectclamp(img, rect);
+    if (rect->h < 1 || rect->w < 1) {
+        syslog_error("Bad view rect.");
+        return NULL;
+    }
+    view = __image_borrow(img, rect->r, rect->c, rect->h, rect->w);
+    if (view)
+        view->view = 1;
+    return view;
+}
+
+IMAGE* image_share(IMAGE* img, RECT* rect)
+{
+    RECT all;
+    IMAGE* copy;
+
+    CHECK_IMAGE(img);
+    if (!rect) {
+        image_rect(&all, img);
+        rect = &all;
+    }
+    copy = image_view(img, rect);
+    CHECK_IMAGE(copy);
+    copy->view = 0;
+    copy->cow = 1;
+    __atomic_add_fetch(&((IMAGE*)copy->owner)->shares, 1, __ATOMIC_ACQ_REL);
+    if (img->format == IMAGE_MASK) {
+        copy->K = img->K;
+        memcpy(copy->KColors, img->KColors, ARRAY_SIZE(img->KColors) * sizeof(int));
+        copy->KRadius = img->KRadius;
+        copy->KInstance = img->KInstance;
+    }
+    return copy;
+}
+
+// Pixels of a copy on write share (or of its source) are copied to a private block, views are left as they are
+int image_writable(IMAGE* img)
+{
+    int i;
+    IMAGE *root, *own;
+
+    check_image(img);
+    // Source keeps its own block only while nobody shares it, a share always leaves the block of its source
+    root = __image_root(img);
+    if (img->view || __atomic_load_n(&root->shares, __ATOMIC_ACQUIRE) == 0)
+        return RET_OK;
+
+    // Border rows/columns of a padded source go with it
+    own = __image_create(img->height, img->width, img->pad, -1);
+    check_image(own);
+    for (i = -img->pad; i < img->height + img->pad; i++)
+        memcpy(image_row(own, i) - img->pad, image_row(img, i) - img->pad, (img->width + 2 * img->pad) * sizeof(RGBA_8888));
+    for (i = 0; i < img->height; i++)
+        img->ie[i] = own->ie[i];
+    img->base = own->base;
+    img->stride = own->stride;
+
+    // own->refs (1) is held by img
+    if (img->owner) {
+        if (img->cow)
+            __atomic_sub_fetch(&root->shares, 1, __ATOMIC_ACQ_REL);
+        __image_release(root);
+    }
+    img->owner = own;
+    img->cow = 0;
+
+    return RET_OK;
+}
+
 IMAGE* image_zoom(IMAGE* img, int nh, int nw, int method)
 {
-    int i, j, i2, j2;
-    float di, dj, d1, d2, d3, d4, u, v, d;
     IMAGE* copy;
 
     CHECK_IMAGE(img);
-    copy = image_create(nh, nw);
+    copy = image_create_uninit(nh, nw);
     CHECK_IMAGE(copy);
 
-    di = 1.0 * img->height / copy->height;
-    dj = 1.0 * img->width / copy->width;
-    if (method == ZOOM_METHOD_BLINE) {
-        /**********************************************************************
-d1    d2
-    (p)
-d3    d4
-f(i+u,j+v) = (1-u)(1-v)f(i,j) + (1-u)vf(i,j+1) + u(1-v)f(i+1,j) +
-uvf(i+1,j+1)
-**********************************************************************/
-        image_foreach(copy, i, j)
-        {
-            i2 = (int)(di * i);
-            u = di * i - i2;
-            j2 = (int)(dj * j);
-            v = dj * j - j2;
-            if (i2 == img->height - 1 || j2 == img->width - 1) {
-                copy->ie[i][j].r = img->ie[i2][j2].r;
-                copy->ie[i][j].g = img->ie[i2][j2].g;
-                copy->ie[i][j].b = img->ie[i2][j2].b;
-            } else {
-                // Red
-                d1 = img->ie[i2][j2].r;
-                d2 = img->ie[i2][j2 + 1].r;
-                d3 = img->ie[i2 + 1][j2].r;
-                d4 = img->ie[i2 + 1][j2 + 1].r;
-                d = (1.0 - u) * (1.0 - v) * d1 + (1.0 - u) * v * d2 + u * (1.0 - v) * d3 + u * v * d4;
-                copy->ie[i][j].r = (int)d;
-                // Green
-                d1 = img->ie[i2][j2].g;
-                d2 = img->ie[i2][j2 + 1].g;
-                d3 = img->ie[i2 + 1][j2].g;
-                d4 = img->ie[i2 + 1][j2 + 1].g;
-                d = (1.0 - u) * (1.0 - v) * d1 + (1.0 - u) * v * d2 + u * (1.0 - v) * d3 + u * v * d4;
-                copy->ie[i][j].g = (int)d;
-                // Blue
-                d1 = img->ie[i2][j2].b;
-                d2 = img->ie[i2][j2 + 1].b;
-                d3 = img->ie[i2 + 1][j2].b;
-                d4 = img->ie[i2 + 1][j2 + 1].b;
-                d = (1.0 - u) * (1.0 - v) * d1 + (1.0 - u) * v * d2 + u * (1.0 - v) * d3 + u * v * d4;
-                copy->ie[i][j].b = (int)d;
-            }
-        }
-    } else {
-        image_foreach(copy, i, j)
-        {
-            i2 = (int)(di * i);
-            j2 = (int)(dj * j);
-            copy->ie[i][j].r = img->ie[i2][j2].r;
-            copy->ie[i][j].g = img->ie[i2][j2].g;
-            copy->ie[i][j].b = img->ie[i2][j2].b;
-        }
+    if (image_resample(img, copy, method) != RET_OK) {
+        image_destroy(copy);
+        return NULL;
     }
 
     return copy;
@@ -955,6 +1380,7 @@ int image_drawrect(IMAGE* img, RECT* rect, int color, int fill)
     BYTE r, g, b;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     image_rectclamp(img, rect);
 
     r = RGB_R(color);
@@ -1001,6 +1427,7 @@ int image_drawline(IMAGE* img, int r1, int c1, int r2, int c2, int color)
         whole_step, initial_pixel_count, final_pixel_count, run_length;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     r = RGB_R(color);
     g = RGB_G(color);
     b = RGB_B(color);
@@ -1245,6 +1672,7 @@ int image_drawkxb(IMAGE* image, float k, float b, int color)
 {
     int i, j;
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
     for (j = 0; j < image->width; j++) {
         i = (int)(k * j + b);
 
@@ -1260,63 +1688,28 @@ int image_drawkxb(IMAGE* image, float k, float b, int color)
 // Peak Signal Noise Ratio
 int image_psnr(char oargb, IMAGE* orig, IMAGE* curr, float* psnr)
 {
-    int i, j, k;
-    long long n, sum;
-    float d = 0.0;
+    int c;
+    float d;
+    QUALITY q;
 
     check_rgb(oargb);
-    check_image(orig);
-    check_image(curr);
-
-    if (curr->height != orig->height || curr->width != orig->width) {
-        syslog_error("Different size between two images.");
-        return RET_ERROR;
-    }
-
-    n = sum = 0;
     switch (oargb) {
     case 'R':
-        image_foreach(orig, i, j)
-        {
-            k = orig->ie[i][j].r - curr->ie[i][j].r;
-            n += k * k;
-            k = (orig->ie[i][j].r * orig->ie[i][j].r);
-            sum += k;
-        }
+        c = 0;
         break;
     case 'G':
-        image_foreach(orig, i, j)
-        {
-            k = orig->ie[i][j].g - curr->ie[i][j].g;
-            n += k * k;
-            k = (orig->ie[i][j].g * orig->ie[i][j].g);
-            sum += k;
-        }
+        c = 1;
         break;
     case 'B':
-        image_foreach(orig, i, j)
-        {
-            k = orig->ie[i][j].b - curr->ie[i][j].b;
-            n += k * k;
-            k = (orig->ie[i][j].b * orig->ie[i][j].b);
-            sum += k;
-        }
+        c = 2;
         break;
     default:
         syslog_error("Bad color %c (ARGB).", oargb);
         return RET_ERROR;
-        break;
     }
+    check_point(image_quality(orig, curr, QUALITY_PSNR, &q) == RET_OK);
 
-    if (sum == 0) // Force sum == 1
-        sum = 1;
-    d = 1.0f * n / sum;
-
-    // Calculate 10 * logf(3 * 255 * 255 * orig->height * orig->width / n);
-    if (n == 0)
-        n = 1; // FORCE n == 1
-    d = log(65025.0f * orig->height * orig->width / n);
-    d = 10.0f * d;
+    d = q.psnr[c];
     printf("PSNR = %f\n", d);
     if (psnr)
         *psnr = d;
@@ -1329,6 +1722,7 @@ int image_paste(IMAGE* img, int r, int c, IMAGE* small, float alpha)
     int i, j, x2, y2, offx, offy;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     if (alpha < 0 || alpha > 1.00f) {
         syslog_error("Bad paste alpha parameter %f (0 ~ 1.0f).", alpha);
         return RET_ERROR;
@@ -1367,6 +1761,7 @@ int image_rect_paste(IMAGE* bigimg, RECT* bigrect, IMAGE* smallimg,
 {
     int i, j;
     check_image(bigimg);
+    check_point(image_writable(bigimg) == RET_OK);
     check_image(smallimg);
 
     image_rectclamp(bigimg, bigrect);
@@ -1393,6 +1788,7 @@ int image_make_noise(IMAGE* img, char orgb, int rate)
 
     check_argb(orgb);
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
 
     srandom((unsigned int)time(NULL));
     image_foreach(img, i, j)
@@ -1419,12 +1815,13 @@ int image_delete_noise(IMAGE* img)
     IMAGE* orig;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     orig = image_copy(img);
     check_image(orig);
     for (i = 1; i < img->height - 1; i++) {
         for (j = 1; j < img->width - 1; j++) {
             __nb3x3_map(orig, i, j);
-            cell = &(img->base[i * img->width + j]);
+            cell = &(img->ie[i][j]);
             index = __color_rgbfind(cell, 3 * 3, __image_rgb_nb);
 
             if (ABS(index - 4) > 1) {
@@ -1448,63 +1845,60 @@ int image_statistics(IMAGE* img, char orgb, float* avg, float* stdv)
     return image_rect_statistics(img, &rect, orgb, avg, stdv);
 }
 
-int image_rect_statistics(IMAGE* img, RECT* rect, char orgb, float* avg,
-    float* stdv)
+int image_rect_statistics(IMAGE* img, RECT* rect, char orgb, float* avg, float* stdv)
 {
-    BYTE n;
-    int i, j;
-    float davg, dstdv;
+    int k;
+    STATISTICS stats;
 
-    check_image(img);
+    check_rgb(orgb);
+    check_point(image_statistics_all(img, rect, &stats) == RET_OK);
 
-    image_rectclamp(img, rect);
+    k = (orgb == 'A') ? STATISTICS_A : (orgb == 'R') ? STATISTICS_R : (orgb == 'G') ? STATISTICS_G : STATISTICS_B;
+    if (avg)
+        *avg = stats.mean[k];
+    if (stdv)
+        *stdv = stats.stdv[k];
 
-    davg = dstdv = 0.0f;
-    switch (orgb) {
-    case 'A':
-        rect_foreach(rect, i, j)
-        {
-            color_rgb2gray(img->ie[rect->r + i][rect->c + j].r,
-                img->ie[rect->r + i][rect->c + j].g,
-                img->ie[rect->r + i][rect->c + j].b, &n);
-            davg += n;
-            dstdv += n * n;
-        }
-        break;
-    case 'R':
-        rect_foreach(rect, i, j)
-        {
-            n = img->ie[rect->r + i][rect->c + j].r;
-            davg += n;
-            dstdv += n * n;
-        }
+    return RET_OK;
+}
 
-        break;
-    case 'G':
-        rect_foreach(rect, i, j)
-        {
-            n = img->ie[rect->r + i][rect->c + j].g;
-            davg += n;
-            dstdv += n * n;
-        }
+// Moments, min and max come from the histograms, so one pass over pixels is enough
+int image_statistics_all(IMAGE* img, RECT* rect, STATISTICS* stats)
+{
+    int j, k;
+    double mean, var;
+    RECT whole;
 
-        break;
-    case 'B':
-        rect_foreach(rect, i, j)
-        {
-            n = img->ie[rect->r + i][rect->c + j].b;
-            davg += n;
-            dstdv += n * n;
-        }
+    check_image(img);
+    check_point(stats != NULL);
 
-        break;
-    default:
-        break;
+    if (rect == NULL) {
+        image_rect(&whole, img);
+        rect = &whole;
     }
+    memset(stats, 0, sizeof(STATISTICS));
+    // Order of channels is same as STATISTICS_R, G, B, A
+    check_point(histogram_count(img, rect, HISTOGRAM_R | HISTOGRAM_G | HISTOGRAM_B | HISTOGRAM_GRAY, stats->count) == RET_OK);
 
-    davg /= (rect->h * rect->w);
-    *avg = davg;
-    *stdv = sqrt(dstdv / (rect->h * rect->w) - davg * davg);
+    stats->total = (uint64_t)MAX(rect->h, 0) * MAX(rect->w, 0);
+    if (stats->total == 0)
+        return RET_OK;
+    for (k = 0; k < STATISTICS_CHANNELS; k++) {
+        stats->min[k] = HISTOGRAM_MAX_COUNT - 1;
+        for (j = 0; j < HISTOGRAM_MAX_COUNT; j++) {
+            if (stats->count[k][j] == 0)
+                continue;
+            stats->min[k] = MIN(stats->min[k], j);
+            stats->max[k] = j;
+            stats->sum[k] += stats->count[k][j] * j;
+            stats->sum2[k] += stats->count[k][j] * j * j;
+        }
+        mean = (double)stats->sum[k] / stats->total;
+        var = (double)stats->sum2[k] / stats->total - mean * mean;
+        stats->mean[k] = (float)mean;
+        stats->var[k] = (float)MAX(var, 0.0);
+        stats->stdv[k] = sqrtf(stats->var[k]);
+    }
 
     return RET_OK;
 }
@@ -1671,44 +2065,35 @@ MATRIX* image_gstatics(IMAGE* img, int rows, int cols)
     return mat;
 }
 
-// Example: image_clahe(image, 4, 4, 4);
-int image_clahe(IMAGE* image, int grid_rows, int grid_cols, float limit)
+// CLAHE grid: cell is h x w, limit is clip threshold of cell histogram
+void clahe_grid(int height, int width, int* grid_rows, int* grid_cols, int* h, int* w, float* limit)
+{
+    if (*grid_rows > CLAHE_MAX_ROWS)
+        *grid_rows = CLAHE_MAX_ROWS;
+    if (*grid_cols > CLAHE_MAX_COLS)
+        *grid_cols = CLAHE_MAX_COLS;
+
+    *h = (height + *grid_rows - 1) / *grid_rows;
+    *w = (width + *grid_cols - 1) / *grid_cols;
+    *limit = MAX(1, (*limit * (*h) * (*w) / 256.0));
+}
+
+// Interpolate, img is rows [r0, r0 + img->height), cols [c0, c0 + img->width) of height x width image,
+// hist[i * grid_cols + j] is map of cell (i, j)
+void clahe_interpolate(IMAGE* img, int r0, int c0, int height, int width, int grid_rows, int grid_cols,
+    int h, int w, HISTOGRAM* hist)
 {
     BYTE g;
-    int i, j, h, w, i2, j2;
+    int i, j, i2, j2, r1, c1;
     float u, v, d;
     int d1r, d1c, d2r, d2c, d3r, d3c, d4r, d4c;
     RECT rect;
-    HISTOGRAM hist[CLAHE_MAX_ROWS][CLAHE_MAX_COLS], *d1, *d2, *d3, *d4;
-
-    check_image(image);
-
-    if (grid_rows > CLAHE_MAX_ROWS)
-        grid_rows = CLAHE_MAX_ROWS;
-    if (grid_cols > CLAHE_MAX_COLS)
-        grid_cols = CLAHE_MAX_COLS;
-
-    h = (image->height + grid_rows - 1) / grid_rows;
-    w = (image->width + grid_cols - 1) / grid_cols;
-    limit = MAX(1, (limit * h * w / 256.0));
-
-    for (i = 0; i < grid_rows; i++) {
-        for (j = 0; j < grid_cols; j++) {
-            rect.r = i * h;
-            rect.h = h;
-            rect.c = j * w;
-            rect.w = w;
-            image_rectclamp(image, &rect);
+    HISTOGRAM *d1, *d2, *d3, *d4;
+    RGBA_8888* p;
 
-            histogram_rect(&hist[i][j], image, &rect); // Suppose: image is gray
-            histogram_clip(&hist[i][j], (int)limit);
-            histogram_cdf(&hist[i][j]);
-            histogram_map(&hist[i][j], 255);
-            // histogram_dump(&hist[i][j]);
-        }
-    }
+    r1 = MIN(height, r0 + img->height);
+    c1 = MIN(width, c0 + img->width);
 
-    // Interpolate
     /*************************************************************************************
   d1    d2
       (p)
@@ -1733,6 +2118,8 @@ int image_clahe(IMAGE* image, int grid_rows, int grid_cols, float limit)
             d1r = d2r = i - 1;
             d3r = d4r = i;
         }
+        if (rect.r >= r1 || rect.r + rect.h <= r0)
+            continue;
 
         for (j = 0; j <= grid_cols; j++) {
             if (j == 0) {
@@ -1752,96 +2139,109 @@ int image_clahe(IMAGE* image, int grid_rows, int grid_cols, float limit)
                 d1c = d3c = j - 1;
                 d2c = d4c = j;
             }
+            if (rect.c >= c1 || rect.c + rect.w <= c0)
+                continue;
 
-            d1 = &hist[d1r][d1c];
-            d2 = &hist[d2r][d2c];
-            d3 = &hist[d3r][d3c];
-            d4 = &hist[d4r][d4c];
+            d1 = &hist[d1r * grid_cols + d1c];
+            d2 = &hist[d2r * grid_cols + d2c];
+            d3 = &hist[d3r * grid_cols + d3c];
+            d4 = &hist[d4r * grid_cols + d4c];
 
-            for (i2 = rect.r; i2 < rect.r + rect.h && i2 < image->height; i2++) {
+            for (i2 = MAX(rect.r, r0); i2 < rect.r + rect.h && i2 < r1; i2++) {
                 u = (float)(i2 - rect.r) / (float)rect.h;
 
-                for (j2 = rect.c; j2 < rect.c + rect.w && j2 < image->width; j2++) {
+                for (j2 = MAX(rect.c, c0); j2 < rect.c + rect.w && j2 < c1; j2++) {
                     v = (float)(j2 - rect.c) / (float)rect.w;
+                    p = &img->ie[i2 - r0][j2 - c0];
 
                     // R
-                    g = image->ie[i2][j2].r;
+                    g = p->r;
                     d = (1.0 - u) * (1.0 - v) * d1->map[g] + (1.0 - u) * v * d2->map[g] + u * (1.0 - v) * d3->map[g] + u * v * d4->map[g];
                     g = (d > 255) ? 255 : (int)d;
-                    image->ie[i2][j2].r = g;
+                    p->r = g;
 
                     // G
-                    g = image->ie[i2][j2].g;
+                    g = p->g;
                     d = (1.0 - u) * (1.0 - v) * d1->map[g] + (1.0 - u) * v * d2->map[g] + u * (1.0 - v) * d3->map[g] + u * v * d4->map[g];
                     g = (d > 255) ? 255 : (int)d;
-                    image->ie[i2][j2].g = g;
+                    p->g = g;
 
                     // B
-                    g = image->ie[i2][j2].b;
+                    g = p->b;
                     d = (1.0 - u) * (1.0 - v) * d1->map[g] + (1.0 - u) * v * d2->map[g] + u * (1.0 - v) * d3->map[g] + u * v * d4->map[g];
                     g = (d > 255) ? 255 : (int)d;
-                    image->ie[i2][j2].b = g;
+                    p->b = g;
                 }
             }
         }
     }
-
-    return RET_OK;
 }
 
-int image_niblack(IMAGE* image, int radius, float scale)
+// Example: image_clahe(image, 4, 4, 4);
+int image_clahe(IMAGE* image, int grid_rows, int grid_cols, float limit)
 {
-    int i, j;
-    MATRIX *mean, *stdv, *temp, *area;
+    int i, j, h, w;
+    RECT rect;
+    HISTOGRAM hist[CLAHE_MAX_ROWS * CLAHE_MAX_COLS], *cell;
 
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
 
-    // Fast count
-    area = matrix_create(image->height, image->width);
-    check_matrix(area);
-    matrix_pattern(area, "one");
+    clahe_grid(image->height, image->width, &grid_rows, &grid_cols, &h, &w, &limit);
 
-    temp = matrix_copy(area);
-    matrix_integrate(temp);
-    matrix_foreach(area, i, j)
-    {
-        area->me[i][j] = matrix_difference(temp, i - radius, j - radius, i + radius, j + radius);
+    for (i = 0; i < grid_rows; i++) {
+        for (j = 0; j < grid_cols; j++) {
+            rect.r = i * h;
+            rect.h = h;
+            rect.c = j * w;
+            rect.w = w;
+            image_rectclamp(image, &rect);
+
+            cell = &hist[i * grid_cols + j];
+            histogram_rect(cell, image, &rect); // Suppose: image is gray
+            histogram_clip(cell, (int)limit);
+            histogram_cdf(cell);
+            histogram_map(cell, 255);
+            // histogram_dump(cell);
+        }
     }
-    matrix_destroy(temp);
 
-    color_togray(image);
-    mean = image_getplane(image, 'R');
-    stdv = matrix_copy(mean);
+    clahe_interpolate(image, 0, 0, image->height, image->width, grid_rows, grid_cols, h, w, hist);
 
-    // mean
-    temp = matrix_copy(mean);
-    matrix_integrate(temp);
-    matrix_foreach(mean, i, j)
-    {
-        mean->me[i][j] = matrix_difference(temp, i - radius, j - radius, i + radius, j + radius);
-        mean->me[i][j] /= area->me[i][j];
-    }
-    matrix_destroy(temp);
+    return RET_OK;
+}
 
-    // stdv
-    matrix_foreach(stdv, i, j) stdv->me[i][j] = stdv->me[i][j] * stdv->me[i][j];
-    temp = matrix_copy(stdv);
-    matrix_integrate(temp);
-    matrix_foreach(stdv, i, j)
-    {
-        stdv->me[i][j] = matrix_difference(temp, i - radius, j - radius, i + radius, j + radius);
-        stdv->me[i][j] /= area->me[i][j];
+int image_niblack(IMAGE* image, int radius, float scale)
+{
+    int i, j, ret;
+    float d;
+    MATRIX *mat, *mean, *stdv;
+
+    check_image(image);
+    check_point(image_writable(image) == RET_OK);
 
-        stdv->me[i][j] -= mean->me[i][j] * mean->me[i][j];
-        stdv->me[i][j] = sqrt(stdv->me[i][j]);
+    color_togray(image);
+    mat = image_getplane(image, 'R');
+    check_matrix(mat);
+    mean = matrix_create(image->height, image->width);
+    check_matrix(mean);
+    stdv = matrix_create(image->height, image->width);
+    check_matrix(stdv);
+
+    // mean, mean of squares in one pass
+    ret = matrix_box_means(mat, radius, mean, stdv);
+    matrix_destroy(mat);
+    if (ret != RET_OK) {
+        matrix_destroy(stdv);
+        matrix_destroy(mean);
+        return RET_ERROR;
     }
-    matrix_destroy(temp);
 
     // Threshold
     matrix_foreach(stdv, i, j)
     {
-        stdv->me[i][j] *= scale;
-        stdv->me[i][j] += mean->me[i][j];
+        d = stdv->me[i][j] - mean->me[i][j] * mean->me[i][j];
+        stdv->me[i][j] = sqrt(MAX(d, 0.0f)) * scale + mean->me[i][j];
     }
 
     image_foreach(image, i, j)
@@ -1859,7 +2259,6 @@ int image_niblack(IMAGE* image, int radius, float scale)
 
     matrix_destroy(mean);
     matrix_destroy(stdv);
-    matrix_destroy(area);
 
     return RET_OK;
 }
@@ -1868,6 +2267,7 @@ int image_negative(IMAGE* image)
 {
     int i, j;
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
 
     image_foreach(image, i, j)
     {
@@ -1896,23 +2296,21 @@ int image_show(IMAGE* image, char* title)
 float image_entropy(IMAGE* img)
 {
 #define COLOR_QUANT_LEVEL 8
-    int i, j;
-    BYTE n;
+    int i, j, n;
     float x, e;
+    RECT rect;
     HISTOGRAM h;
 
     check_image(img);
 
-    histogram_reset(&h);
-    image_foreach(img, i, j)
-    {
-        color_rgb2gray(img->ie[i][j].r, img->ie[i][j].g, img->ie[i][j].b, &n);
-        histogram_add(&h, (int)(n / COLOR_QUANT_LEVEL));
-    }
+    image_rect(&rect, img);
+    histogram_rect(&h, img, &rect);
     // h.total > 1
     e = 0.0f;
     for (i = 0; i < 256 / COLOR_QUANT_LEVEL; i++) {
-        x = (float)h.count[i] / h.total;
+        for (j = 0, n = 0; j < COLOR_QUANT_LEVEL; j++)
+            n += h.count[i * COLOR_QUANT_LEVEL + j];
+        x = (float)n / h.total;
         if (x > MIN_FLOAT_NUMBER)
             e += -x * logf(x);
     }
@@ -1924,289 +2322,70 @@ float image_entropy(IMAGE* img)
 #undef COLOR_QUANT_LEVEL
 }
 
-static void png_read_callback(png_structp png_ptr, png_bytep data, png_size_t length)
+IMAGE* image_loadpng_from_memory(char *data, size_t size)
 {
-    PngSource *s = (PngSource *)png_get_io_ptr(png_ptr);
-
-    if((int)(s->offset + length) <= s->size) {
-        memcpy(data, s->data + s->offset, length);
-        s->offset += length;
-    } else {
-        png_error(png_ptr, "pngReaderCallback failed");
-    }
+    CHECK_POINT(data != NULL && size >= 8 && png_sig_cmp((png_const_bytep)data, 0, 8) == 0);
+    return ireader_image(ireader_open_memory(data, size));
 }
 
-IMAGE* image_loadpng_from_memory(char *data, size_t size)
+IMAGE* image_loadjpeg_from_memory(char *data, size_t size)
 {
-    IMAGE* image = NULL;
-    png_struct* png_ptr = NULL;
-    png_info* info_ptr = NULL;
-    png_byte* png_pixels = NULL;
-    png_byte** row_pointers = NULL;
-
-    // Check PNG header
-    {
-        static const int PNGSIGSIZE = 8;
-        png_byte header[PNGSIGSIZE];
-
-        CHECK_POINT(size >= PNGSIGSIZE);
-        memcpy(header, data, PNGSIGSIZE);
-        CHECK_POINT(png_sig_cmp(header, 0, PNGSIGSIZE) == 0); // png_check_sig(header, 8) != 0
-    }
-
-    /* Create png and info structures */
-    {
-        png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        CHECK_POINT(png_ptr != NULL);
-        info_ptr = png_create_info_struct(png_ptr);
-        if (! info_ptr)
-            png_destroy_read_struct(&png_ptr, NULL, NULL);
-        CHECK_POINT(info_ptr != NULL);
-        CHECK_POINT(setjmp(png_jmpbuf(png_ptr)) == 0);
-    }
-
-    PngSource png_source;
-    {
-        png_source.data = (unsigned char *)data;
-        png_source.size = size;
-        png_source.offset = 0;
-        png_set_read_fn(png_ptr, &png_source, png_read_callback);
-    }
-
-    /* Read the file information */
-    png_read_info(png_ptr, info_ptr);
-
-    /* Get size and bit-depth of the PNG-image */
-    png_uint_32 width, height;
-    int bit_depth, channels, color_type;
-
-    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, NULL, NULL, NULL);
-
-    /* Set-up the transformations */
-    {
-        /* transform paletted images into full-color rgb */
-        if (color_type == PNG_COLOR_TYPE_PALETTE)
-            png_set_expand(png_ptr);
-        /* expand images to bit-depth 8 (only applicable for grayscale images) */
-        if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-            png_set_expand(png_ptr);
-        /* transform transparency maps into full alpha-channel */
-        if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
-            png_set_expand(png_ptr);
-    }
-
-#ifdef NJET
-    /* downgrade 16-bit images to 8 bit */
-    if (bit_depth == 16)
-        png_set_strip_16(png_ptr);
-    /* transform grayscale images into full-color */
-    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(png_ptr);
-    /* only if file has a file gamma, we do a correction */
-    if (png_get_gAMA(png_ptr, info_ptr, &file_gamma))
-        png_set_gamma(png_ptr, (float)2.2, file_gamma);
-#endif
-
-    /* all transformations have been registered; now update info_ptr data,
-   * get rowbytes and channels, and allocate image memory */
-
-    png_read_update_info(png_ptr, info_ptr);
-    /* get the new color-type and bit-depth (after expansion/stripping) */
-    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, NULL, NULL, NULL);
-
-    /* Calculate new number of channels and store alpha-presence */
-    {
-        if (color_type == PNG_COLOR_TYPE_GRAY)
-            channels = 1;
-        else if (color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-            channels = 2;
-        else if (color_type == PNG_COLOR_TYPE_RGB)
-            channels = 3;
-        else if (color_type == PNG_COLOR_TYPE_RGB_ALPHA)
-            channels = 4;
-        else
-            channels = 0; /* should never happen */
-    }
-
-    int alpha_present = (channels - 1) % 2;
-
-    /* row_bytes is the width x number of channels x (bit-depth / 8) */
-    png_uint_32 row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-
-    // Allocate memory for png_pixels and row_pointers
-    {
-        png_pixels = (png_byte *)malloc(row_bytes * height * sizeof(png_byte));
-        if (png_pixels == NULL) {
-            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        }
-        CHECK_POINT(png_pixels != NULL);
-
-        row_pointers = (png_byte **)malloc(height * sizeof(png_bytep));
-        if (row_pointers == NULL) {
-            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-            free(png_pixels);
-        }
-        CHECK_POINT(row_pointers != NULL);
-
-        /* Set the individual row_pointers to point at the correct offsets */
-        for (png_uint_32 i = 0; i < (height); i++)
-            row_pointers[i] = png_pixels + i * row_bytes;
-    }
-
-    // Reead image data ...
-    {
-        /* Go ahead and just read the whole image */
-        png_read_image(png_ptr, row_pointers);
-        /* Read rest and get additional chunks in info_ptr - REQUIRED */
-        png_read_end(png_ptr, info_ptr);
-
-        /* Clean up after the read, and free any memory allocated - REQUIRED */
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-
-        free(row_pointers); // NO need row_points ...
-    }
-
-
-    image = image_create(height, width);
-    if (image == NULL) {
-        free(png_pixels);
-    }
-    CHECK_IMAGE(image);
-
-    png_uint_32 row, col;
-    png_byte *pix_ptr = png_pixels;
-
-    for (row = 0; row < height; row++) {
-        for (col = 0; col < width; col++) {
-            if (bit_depth == 16) {
-                {
-                    image->ie[row][col].r = (BYTE)*pix_ptr++; pix_ptr++; // (((BYTE)*pix_ptr++ << 8) + (BYTE)*pix_ptr++);
-                }
-                if (channels >= 2) {
-                    image->ie[row][col].g = (BYTE)*pix_ptr++; pix_ptr++; // (((BYTE)*pix_ptr++ << 8) + (BYTE)*pix_ptr++);
-                }
-                if (channels >= 3) {
-                    image->ie[row][col].b = (BYTE)*pix_ptr++; pix_ptr++; // (((BYTE)*pix_ptr++ << 8) + (BYTE)*pix_ptr++);
-                }
-                if (channels >= 4) {
-                    if (alpha_present) {
-                        image->ie[row][col].a = (BYTE)*pix_ptr++; pix_ptr++; // (((BYTE)*pix_ptr++ << 8) + (BYTE)*pix_ptr++);
-                    }
-                }
-            } else {
-                image->ie[row][col].r = (BYTE)*pix_ptr++;
-                if (channels >= 2)
-                    image->ie[row][col].g = (BYTE)*pix_ptr++;
-                if (channels >= 3)
-                    image->ie[row][col].b = (BYTE)*pix_ptr++;
-                if (channels >= 4) {
-                    if (alpha_present)
-                        image->ie[row][col].a = (BYTE)*pix_ptr++;
-                }
-            }
-        }
-    }
-
-    // Set missing channels
-    {
-        if (channels < 2) {
-            image_foreach(image, row, col) image->ie[row][col].g = image->ie[row][col].r;
-            image_foreach(image, row, col) image->ie[row][col].b = image->ie[row][col].r;
-        }
-        if (channels < 3) {
-            image_foreach(image, row, col) image->ie[row][col].b = image->ie[row][col].r;
-        }
-    }
-
-    free(png_pixels);
+    BYTE* s = (BYTE*)data;
 
-    return image;
+    CHECK_POINT(data != NULL && size >= 3 && s[0] == 0xff && s[1] == 0xd8 && s[2] == 0xff);
+    return ireader_image(ireader_open_memory(data, size));
 }
 
-static void png_write_callback(png_structp png_ptr, png_bytep data, png_size_t size)
+// png/jpeg/nimg by magic bytes
+IMAGE* image_load_from_memory(char *data, size_t size)
 {
-    PngDestination *png_buff = (PngDestination *)png_get_io_ptr(png_ptr);
-    size_t nsize = png_buff->length + size;
-
-    if (png_buff->data){
-        png_buff->data =(char*) realloc(png_buff->data, nsize);
-    } else {
-        png_buff->data =(char*) malloc(nsize);
-    }
-
-    if (!png_buff->data){
-        png_error(png_ptr, "Write Error");
-    }
-
-    memcpy(png_buff->data + png_buff->length, data, size);
-    png_buff->length += size;  
+    CHECK_POINT(data != NULL);
+    if (size >= sizeof(NImgHead) && ((NImgHead*)data)->magic == NIMG_MAGIC)
+        return __nimg_decode(data, size, 0);
+    if (size >= 4 && memcmp(data, "qoif", 4) == 0)
+        return image_loadqoi_from_memory(data, size);
+    return ireader_image(ireader_open_memory(data, size));
 }
 
 char *image_savepng_to_memory(IMAGE* image, int *size)
 {
-    png_struct* png_ptr = NULL;
-    png_info* info_ptr = NULL;
-
-    CHECK_IMAGE(image);
-    // Save png alpha channel for display
-    {
-        int i, j;
-        if (image->format != IMAGE_MASK && image->K > 0) {
-            image_foreach(image, i, j) image->ie[i][j].a = 255;
-        }
-    }
-    // Allocate memory for png_ptr and info_ptr
-    {
-        png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        CHECK_POINT(png_ptr != NULL);
-
-        info_ptr = png_create_info_struct(png_ptr);
-        if (info_ptr == NULL) {
-            png_destroy_write_struct(&png_ptr, NULL);
-        }
-        CHECK_POINT(info_ptr != NULL);
-        CHECK_POINT(setjmp(png_jmpbuf(png_ptr)) == 0);
-    }
+    return image_png_encode(image, NULL, size);
+}
 
-    png_set_IHDR(png_ptr, info_ptr, image->width, image->height,
-        8 * sizeof(BYTE) /*bit_depth */, PNG_COLOR_TYPE_RGB_ALPHA,
-        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT);
+char *image_savejpeg_to_memory(IMAGE* image, int quality, int *size)
+{
+    IWRITER* writer;
 
-    PngDestination destination;
-    destination.data = NULL;
-    destination.length = 0;
-    destination.offset = 0;
-    {
-        // Writing decoded data into buffer 
-        png_set_write_fn(png_ptr, &destination, png_write_callback, NULL);
-        // png_write_info(png_ptr, info_ptr);
-        // png_set_rows(png_ptr, info_ptr, (png_bytep *)image->ie);
-        // png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    CHECK_IMAGE(image);
+    writer = iwriter_open_memory(STREAM_JPEG, image->height, image->width, quality);
+    CHECK_POINT(writer != NULL);
+    iwriter_write(writer, image->ie, image->height);
 
-        png_write_info(png_ptr, info_ptr);
-        png_write_image(png_ptr, (png_bytep *)image->ie);
-        png_write_end(png_ptr, NULL);
-    }
+    return iwriter_close_memory(writer, size);
+}
 
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+static int __base64_png_write(char* data, size_t n, size_t total, void* arg)
+{
+    BASE64* b = (BASE64*)arg;
 
-    // Save result ...
-    *size = destination.length;
-    return destination.data;
+    if (b->capacity == 0 && base64_reserve(b, total) != RET_OK)
+        return RET_ERROR;
+    return base64_update(b, data, n);
 }
 
+// Png chunks are encoded as they come out, no whole png buffer
 char *image_base64(IMAGE *image)
 {
-    int size;
-    CHECK_IMAGE(image);
+    BASE64 b64;
 
-    char *data = image_savepng_to_memory(image, &size);
-    CHECK_POINT(data != NULL);
-    char *b64_txt = base64_encode(data, size, 0 /*new_line*/);
-    free(data);
+    CHECK_IMAGE(image);
+    base64_begin(&b64, 0 /*new_line*/);
+    if (image_png_write(image, NULL, __base64_png_write, &b64) != RET_OK) {
+        free(b64.text);
+        return NULL;
+    }
 
-    return b64_txt;
+    return base64_end(&b64, NULL);
 }
 
 IMAGE *base64_image(char *b64_txt)
@@ -2217,7 +2396,7 @@ IMAGE *base64_image(char *b64_txt)
     char *b64_bin = base64_decode(b64_txt, strlen(b64_txt), &size, 0 /*new_line*/);
     CHECK_POINT(b64_bin != NULL);
 
-    IMAGE *image = image_loadpng_from_memory(b64_bin, size);
+    IMAGE *image = image_load_from_memory(b64_bin, size);
     free(b64_bin);
 
     return image;
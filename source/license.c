@@ -32,9 +32,6 @@
 #define BEGIN_SIGNATURE "-----BEGIN SIGNATURE-----"
 #define END_SIGNATURE "-----END SIGNATURE-----"
 
-#define BASE64_ENCODE_OUT_SIZE(s) ((unsigned int)((((s) + 2) / 3) * 4 + 1))
-#define BASE64_DECODE_OUT_SIZE(s) ((unsigned int)(((s) / 4) * 3))
-
 static void all_trim(char *str);
 static RSA* load_public_key(char *pkey);
 static int rsa_sign_verify(char *publickey, char *message, char *signature);
@@ -542,55 +539,3 @@ failure:
         free(buff_data);
     return ret;
 }
-
-char *base64_encode(const char *input_data, int input_size, int new_line)
-{
-    BIO *bmem = NULL;
-    BIO *b64 = NULL;
-    BUF_MEM *bptr;
-
-    b64 = BIO_new(BIO_f_base64());
-    CHECK_POINT(b64 != NULL);
-    bmem = BIO_new(BIO_s_mem());
-    CHECK_POINT(bmem != NULL);
-    if (! new_line) {
-        BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-    }
-    b64 = BIO_push(b64, bmem);
-    BIO_write(b64, input_data, input_size);
-    BIO_flush(b64);
-    BIO_get_mem_ptr(b64, &bptr);
-    BIO_set_close(b64, BIO_NOCLOSE);
-
-    char *output_data = (char *)malloc(bptr->length + 1);
-    memcpy(output_data, bptr->data, bptr->length);
-    output_data[bptr->length] = '\0';
-    BIO_free_all(b64);
-
-    return output_data;
-}
-
-
-char *base64_decode(char *input_data, int input_size, int *output_size, int new_line)
-{
-    int outlen;
-    char* output_data;
-
-    *output_size = 0;
-    outlen = BASE64_DECODE_OUT_SIZE(input_size);
-    output_data = (char *)calloc((size_t)(outlen + 1), sizeof(char));
-    CHECK_POINT(output_data != NULL);
-
-    BIO* b64 = BIO_new(BIO_f_base64());
-    BIO* bmem = BIO_new_mem_buf(input_data, input_size);
-    CHECK_POINT(b64 != NULL && bmem != NULL);
-
-    BIO* bio_sign = BIO_push(b64, bmem);
-    if (! new_line)
-        BIO_set_flags(bio_sign, BIO_FLAGS_BASE64_NO_NL); // Do not use newlines to flush buffer
-
-    *output_size = BIO_read(bio_sign, output_data, input_size);
-    BIO_free_all(bio_sign);
-
-    return output_data;
-}
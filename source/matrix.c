@@ -14,11 +14,14 @@
 #include <string.h>
 
 #define MATRIX_MAGIC MAKE_FOURCC('M', 'A', 'T', 'R')
+#define MATRIX_ALIGN 64
 
 static int __matrix_qsort_column = 0;
 
-extern int matrix_memsize(DWORD m, DWORD n);
+extern size_t matrix_memsize(DWORD m, DWORD n);
 extern void matrix_membind(MATRIX* mat, DWORD m, DWORD n);
+extern int plane_resample(float* src, int h, int w, int src_stride, float* dst, int nh, int nw, int dst_stride,
+    int method);
 
 // Euclidean Space square !!!
 static float __euc_distance2(float* a, float* b, int n)
@@ -81,19 +84,25 @@ static int __matrix_cmp(const void* p1, const void* p2)
     return (*d1 < *d2) ? -1 : (*d1 > *d2) ? 1 : 0;
 }
 
-int matrix_memsize(DWORD m, DWORD n)
+// Head + row pointers + data, extra MATRIX_ALIGN for alignment, 0 -- too big
+size_t matrix_memsize(DWORD m, DWORD n)
 {
-    int size;
+    size_t size;
 
+    if (n > 0 && m > (SIZE_MAX / 2) / ((size_t)n * sizeof(float) + sizeof(float*)))
+        return 0;
     size = sizeof(MATRIX);
-    size += m * n * sizeof(float); // Data
-    size += m * sizeof(float*); // me
+    size += (size_t)m * sizeof(float*); // me
+    size += MATRIX_ALIGN;
+    size += (size_t)m * n * sizeof(float); // Data
     return size;
 }
 
+// Row pointers follow head, data is MATRIX_ALIGN aligned
 void matrix_membind(MATRIX* mat, DWORD m, DWORD n)
 {
     DWORD i;
+    uintptr_t data;
     char* base = (char*)mat;
 
     mat->magic = MATRIX_MAGIC;
@@ -101,46 +110,39 @@ void matrix_membind(MATRIX* mat, DWORD m, DWORD n)
     mat->n = n;
     mat->_m = m;
 
-    mat->base = (float*)(base + sizeof(MATRIX)); // Data
-    mat->me = (float**)(base + sizeof(MATRIX) + (m * n) * sizeof(float)); // Skip head and data
+    mat->me = (float**)(base + sizeof(MATRIX)); // Skip head
+    data = (uintptr_t)(base + sizeof(MATRIX) + (size_t)m * sizeof(float*));
+    data = (data + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+    mat->base = (float*)data;
     for (i = 0; i < m; i++)
-        mat->me[i] = &(mat->base[i * n]);
+        mat->me[i] = &(mat->base[(size_t)i * n]);
 }
 
 MATRIX* matrix_create(int m, int n)
 {
-    int i;
+    MATRIX* matrix = matrix_create_uninit(m, n);
+
+    if (matrix)
+        memset(matrix->base, 0, (size_t)m * n * sizeof(float));
+
+    return matrix;
+}
+
+MATRIX* matrix_create_uninit(int m, int n)
+{
+    size_t size;
     MATRIX* matrix;
 
-    if (m < 1 || n < 1) {
-        syslog_error("Create matrix.");
+    if (m < 1 || n < 1 || (size = matrix_memsize(m, n)) == 0) {
+        syslog_error("Create matrix %dx%d.", m, n);
         return NULL;
     }
-    matrix = (MATRIX*)calloc((size_t)1, sizeof(MATRIX));
+    matrix = (MATRIX*)pool_malloc(size);
     if (!matrix) {
         syslog_error("Allocate memeory.");
         return NULL;
     }
-    matrix->magic = MATRIX_MAGIC;
-    matrix->m = m;
-    matrix->n = n;
-    matrix->_m = m;
-
-    matrix->base = (float*)calloc((size_t)(m * n), sizeof(float));
-    if (!matrix->base) {
-        syslog_error("Allocate memeory.");
-        free(matrix);
-        return NULL;
-    }
-    matrix->me = (float**)calloc(m, sizeof(float*));
-    if (!matrix->me) {
-        syslog_error("Allocate memeory.");
-        free(matrix->base);
-        free(matrix);
-        return NULL;
-    }
-    for (i = 0; i < m; i++)
-        matrix->me[i] = &(matrix->base[i * n]);
+    matrix_membind(matrix, m, n);
 
     return matrix;
 }
@@ -148,7 +150,7 @@ MATRIX* matrix_create(int m, int n)
 int matrix_clear(MATRIX* mat)
 {
     check_matrix(mat);
-    memset((BYTE*)mat->base, 0, mat->m * mat->n * sizeof(float));
+    memset((BYTE*)mat->base, 0, (size_t)mat->m * mat->n * sizeof(float));
     return RET_OK;
 }
 
@@ -157,9 +159,8 @@ void matrix_destroy(MATRIX* m)
     if (!matrix_valid(m)) {
         return;
     }
-    free(m->me);
-    free(m->base);
-    free(m);
+    m->magic = 0;
+    pool_free(m);
 }
 
 void matrix_print(MATRIX* m, char* format)
@@ -194,18 +195,16 @@ MATRIX* matrix_copy(MATRIX* src)
     MATRIX* copy;
 
     CHECK_MATRIX(src);
-    copy = matrix_create(src->m, src->n);
+    copy = matrix_create_uninit(src->m, src->n);
     CHECK_MATRIX(copy);
     memcpy((void*)copy->base, (void*)(src->base),
-        src->m * src->n * sizeof(float));
+        (size_t)src->m * src->n * sizeof(float));
 
     return copy;
 }
 
 MATRIX* matrix_zoom(MATRIX* mat, int nm, int nn, int method)
 {
-    int i, j, i2, j2;
-    float di, dj, d1, d2, d3, d4, u, v, d;
     MATRIX* copy;
 
     CHECK_MATRIX(mat);
@@ -213,43 +212,12 @@ MATRIX* matrix_zoom(MATRIX* mat, int nm, int nn, int method)
         return matrix_copy(mat);
 
     // size changed
-    copy = matrix_create(nm, nn);
+    copy = matrix_create_uninit(nm, nn);
     CHECK_MATRIX(copy);
-    di = 1.0 * mat->m / copy->m;
-    dj = 1.0 * mat->n / copy->n;
-
-    if (method == ZOOM_METHOD_BLINE) {
-        /**************************************************************************************
-d1    d2
-   (p)
-d3    d4
-f(i+u,j+v) = (1-u)*(1-v)*f(i,j) + (1-u)*v*f(i,j+1) + u*(1-v)*f(i+1,j) +
-u*v*f(i+1,j+1)
-***************************************************************************************/
-        matrix_foreach(copy, i, j)
-        {
-            i2 = (int)(di * i);
-            u = di * i - i2;
-            j2 = (int)(dj * j);
-            v = dj * j - j2;
-            if (i2 >= (int)mat->m - 1 || j2 >= (int)mat->n - 1) {
-                copy->me[i][j] = mat->me[mat->m - 1][mat->n - 1];
-            } else {
-                d1 = mat->me[i2][j2];
-                d2 = mat->me[i2][j2 + 1];
-                d3 = mat->me[i2 + 1][j2];
-                d4 = mat->me[i2 + 1][j2 + 1];
-                d = (1.0 - u) * (1.0 - v) * d1 + (1.0 - u) * v * d2 + u * (1.0 - v) * d3 + u * v * d4;
-                copy->me[i][j] = d;
-            }
-        }
-    } else {
-        matrix_foreach(copy, i, j)
-        {
-            i2 = (int)(di * i);
-            j2 = (int)(dj * j);
-            copy->me[i][j] = mat->me[i2][j2];
-        }
+
+    if (plane_resample(mat->base, mat->m, mat->n, mat->n, copy->base, nm, nn, nn, method) != RET_OK) {
+        matrix_destroy(copy);
+        return NULL;
     }
 
     return copy;
@@ -285,7 +253,7 @@ int matrix_pattern(MATRIX* M, char* name)
     } else if (strcmp(name, "one") == 0) {
         matrix_foreach(M, i, j) M->me[i][j] = 1.0f;
     } else if (strcmp(name, "zero") == 0) {
-        memset((BYTE*)M->base, 0, M->m * M->n * sizeof(float));
+        memset((BYTE*)M->base, 0, (size_t)M->m * M->n * sizeof(float));
     } else if (strcmp(name, "3x3disc") == 0) {
         matrix_foreach(M, i, j) M->me[i][j] = 1.0f;
         M->me[0][0] = M->me[0][2] = M->me[2][0] = M->me[2][2] = 0.0;
@@ -361,6 +361,9 @@ int object_fast_detect(IMAGE* img)
 int motion_updatebg(IMAGE* A, IMAGE* B, IMAGE* C, IMAGE* bg)
 {
     int i, j, k, a, b, threshold = MOTION_OBJECT_THRESHOLD;
+
+    check_image(bg);
+    check_point(image_writable(bg) == RET_OK);
     image_foreach(bg, i, j)
     {
         k = (A->ie[i][j].r - B->ie[i][j].r) * (A->ie[i][j].r - B->ie[i][j].r) + (A->ie[i][j].g - B->ie[i][j].g) * (A->ie[i][j].g - B->ie[i][j].g) + (A->ie[i][j].b - B->ie[i][j].b) * (A->ie[i][j].b - B->ie[i][j].b);
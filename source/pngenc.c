@@ -0,0 +1,404 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "image.h"
+
+#include <zlib.h>
+
+#define PNG_STRIP_BYTES (256 * 1024) // uncompressed bytes of a strip, output does not depend on threads
+#define PNG_WINDOW 32768 // deflate window, tail of previous strip primes next strip
+#define PNG_CHUNK_HEAD 8 // length + type
+#define PNG_CHUNK_TAIL 4 // crc
+
+// Strip of rows [start, stop) is filtered and deflated alone, pigz style
+typedef struct {
+    int start, stop;
+    BYTE* data; // IDAT chunk, head and crc included
+    size_t size;
+    uLong adler; // of filtered rows
+    size_t raw; // filtered bytes
+} PngStrip;
+
+typedef struct {
+    IMAGE* img;
+    PNG_OPTIONS* opt;
+    int bpp, opaque; // bytes per pixel, force alpha 255
+    size_t rowbytes; // filter byte not included
+    int nstrips;
+    PngStrip* strips;
+    int ret;
+} PngEncoder;
+
+typedef struct {
+    char* data;
+    size_t size;
+} PngMemory;
+
+static void __put32(BYTE* p, uint32_t x)
+{
+    p[0] = (BYTE)(x >> 24);
+    p[1] = (BYTE)(x >> 16);
+    p[2] = (BYTE)(x >> 8);
+    p[3] = (BYTE)x;
+}
+
+// data has PNG_CHUNK_HEAD bytes before and PNG_CHUNK_TAIL bytes after n bytes of chunk data
+static void __chunk_seal(BYTE* chunk, const char* type, size_t n)
+{
+    __put32(chunk, (uint32_t)n);
+    memcpy(chunk + 4, type, 4);
+    __put32(chunk + PNG_CHUNK_HEAD + n, (uint32_t)crc32(0L, chunk + 4, (uInt)(n + 4)));
+}
+
+static void __pack_row(PngEncoder* e, int i, BYTE* line)
+{
+    int j;
+    RGBA_8888* s = e->img->ie[i];
+
+    if (e->bpp == 4) {
+        memcpy(line, s, e->rowbytes);
+        if (e->opaque) {
+            for (j = 0; j < e->img->width; j++)
+                line[4 * j + 3] = 255;
+        }
+        return;
+    }
+    for (j = 0; j < e->img->width; j++) {
+        *line++ = s[j].r;
+        *line++ = s[j].g;
+        *line++ = s[j].b;
+    }
+}
+
+static BYTE __paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = ABS(p - a), pb = ABS(p - b), pc = ABS(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return (BYTE)a;
+    return (BYTE)((pb <= pc) ? b : c);
+}
+
+// First bpp bytes have no left neighbour, a = c = 0
+static void __filter(int type, BYTE* x, BYTE* prev, int bpp, size_t n, BYTE* out)
+{
+    size_t i;
+
+    *out++ = (BYTE)type;
+    switch (type) {
+    case PNG_SAVE_FILTER_SUB:
+        memcpy(out, x, bpp);
+        for (i = bpp; i < n; i++)
+            out[i] = x[i] - x[i - bpp];
+        break;
+    case PNG_SAVE_FILTER_UP:
+        for (i = 0; i < n; i++)
+            out[i] = x[i] - prev[i];
+        break;
+    case PNG_SAVE_FILTER_AVG:
+        for (i = 0; i < (size_t)bpp; i++)
+            out[i] = x[i] - (prev[i] >> 1);
+        for (; i < n; i++)
+            out[i] = x[i] - ((x[i - bpp] + prev[i]) >> 1);
+        break;
+    case PNG_SAVE_FILTER_PAETH:
+        for (i = 0; i < (size_t)bpp; i++)
+            out[i] = x[i] - prev[i];
+        for (; i < n; i++)
+            out[i] = x[i] - __paeth(x[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    default:
+        memcpy(out, x, n);
+        break;
+    }
+}
+
+// Sum of absolute signed bytes, same heuristic as libpng
+static uint64_t __filter_cost(BYTE* out, size_t n)
+{
+    size_t i;
+    uint64_t sum = 0;
+
+    for (i = 1; i <= n; i++)
+        sum += (out[i] < 128) ? out[i] : 256 - out[i];
+    return sum;
+}
+
+// Filter rows [start, stop) into out, every row is (1 + rowbytes) bytes
+static void __filter_rows(PngEncoder* e, int start, int stop, BYTE* lines, BYTE* trial, BYTE* out)
+{
+    int i, k;
+    size_t n = e->rowbytes;
+    uint64_t cost, min;
+    BYTE *prev = lines, *cur = lines + n, *t;
+
+    if (start > 0)
+        __pack_row(e, start - 1, prev);
+    else
+        memset(prev, 0, n);
+
+    for (i = start; i < stop; i++, out += n + 1) {
+        __pack_row(e, i, cur);
+        if (e->opt->filter != PNG_SAVE_FILTER_ADAPTIVE) {
+            __filter(e->opt->filter, cur, prev, e->bpp, n, out);
+        } else {
+            min = UINT64_MAX;
+            for (k = PNG_SAVE_FILTER_NONE; k <= PNG_SAVE_FILTER_PAETH; k++) {
+                __filter(k, cur, prev, e->bpp, n, trial);
+                cost = __filter_cost(trial, n);
+                if (cost < min) {
+                    min = cost;
+                    memcpy(out, trial, n + 1);
+                }
+            }
+        }
+        t = prev;
+        prev = cur;
+        cur = t;
+    }
+}
+
+static int __deflate_strip(PngEncoder* e, PngStrip* s, BYTE* lines, BYTE* trial)
+{
+    int k, first, last, ret = RET_ERROR;
+    size_t line = e->rowbytes + 1, n, dict, bound, head, tail;
+    BYTE *raw = NULL, *out;
+    z_stream z;
+
+    // Rows before strip are filtered again to prime the window
+    k = MIN(s->start, (int)((PNG_WINDOW + line - 1) / line));
+    n = (size_t)(s->stop - s->start + k) * line;
+    raw = (BYTE*)malloc(n);
+    if (!raw) {
+        syslog_error("Allocate memeory.");
+        return RET_ERROR;
+    }
+    __filter_rows(e, s->start - k, s->stop, lines, trial, raw);
+    dict = MIN((size_t)k * line, (size_t)PNG_WINDOW);
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, e->opt->level, Z_DEFLATED, -MAX_WBITS, 8, e->opt->strategy) != Z_OK) {
+        free(raw);
+        syslog_error("Deflate init.");
+        return RET_ERROR;
+    }
+    if (dict > 0)
+        deflateSetDictionary(&z, raw + (size_t)k * line - dict, (uInt)dict);
+
+    // zlib head in first chunk, adler32 of all in last chunk
+    first = (s->start == 0);
+    last = (s->stop == e->img->height);
+    head = PNG_CHUNK_HEAD + (first ? 2 : 0);
+    tail = (last ? 4 : 0) + PNG_CHUNK_TAIL;
+    s->raw = (size_t)(s->stop - s->start) * line;
+    bound = deflateBound(&z, (uLong)s->raw) + 16;
+    s->data = (BYTE*)malloc(head + bound + tail);
+    if (!s->data) {
+        syslog_error("Allocate memeory.");
+        goto deflate_end;
+    }
+
+    out = s->data + head;
+    z.next_in = raw + (size_t)k * line;
+    z.avail_in = (uInt)s->raw;
+    z.next_out = out;
+    z.avail_out = (uInt)bound;
+    if (deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH) != (last ? Z_STREAM_END : Z_OK) || z.avail_in > 0) {
+        syslog_error("Deflate strip.");
+        goto deflate_end;
+    }
+    s->size = head + (bound - z.avail_out) + tail;
+    s->adler = adler32(1L, raw + (size_t)k * line, (uInt)s->raw);
+    ret = RET_OK;
+
+deflate_end:
+    deflateEnd(&z);
+    free(raw);
+    return ret;
+}
+
+static void __deflate_band(void* arg, int start, int stop)
+{
+    int k;
+    BYTE *lines, *trial;
+    PngEncoder* e = (PngEncoder*)arg;
+
+    lines = (BYTE*)malloc(2 * e->rowbytes);
+    trial = (BYTE*)malloc(e->rowbytes + 1);
+    for (k = start; k < stop; k++) {
+        if (!lines || !trial || __deflate_strip(e, &e->strips[k], lines, trial) != RET_OK)
+            e->ret = RET_ERROR;
+    }
+    free(lines);
+    free(trial);
+}
+
+static int __image_opaque(IMAGE* img)
+{
+    int i, j;
+
+    for (i = 0; i < img->height; i++) {
+        for (j = 0; j < img->width; j++) {
+            if (img->ie[i][j].a != 255)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+void png_options_init(PNG_OPTIONS* opt)
+{
+    char* env = getenv("NIMAGE_PNG_LEVEL");
+
+    opt->level = (env) ? CLAMP(atoi(env), 0, 9) : 6;
+    opt->filter = PNG_SAVE_FILTER_ADAPTIVE;
+    opt->strategy = Z_FILTERED;
+    opt->rgb = 1;
+    opt->threads = 0;
+}
+
+// Signature, IHDR, one IDAT chunk a strip and IEND go to func in order, strips are freed once written
+static int __png_emit(PngEncoder* e, png_write_t func, void* arg)
+{
+    int k;
+    size_t total;
+    uLong adler;
+    BYTE head[8 + PNG_CHUNK_HEAD + 13 + PNG_CHUNK_TAIL], tail[PNG_CHUNK_HEAD + PNG_CHUNK_TAIL], *p;
+    PngStrip* s;
+
+    total = sizeof(head) + sizeof(tail);
+    for (k = 0; k < e->nstrips; k++)
+        total += e->strips[k].size;
+
+    // Signature and IHDR
+    memcpy(head, "\x89PNG\r\n\x1a\n", 8);
+    p = head + 8 + PNG_CHUNK_HEAD;
+    __put32(p, e->img->width);
+    __put32(p + 4, e->img->height);
+    p[8] = 8; // bit depth
+    p[9] = (e->bpp == 4) ? 6 : 2; // RGBA or RGB
+    p[10] = p[11] = p[12] = 0; // deflate, adaptive filter, no interlace
+    __chunk_seal(head + 8, "IHDR", 13);
+    if (func((char*)head, sizeof(head), total, arg) != RET_OK)
+        return RET_ERROR;
+
+    adler = 1L;
+    for (k = 0; k < e->nstrips; k++) {
+        s = &e->strips[k];
+        if (k == 0) {
+            // zlib head: deflate 32K window, level hint
+            s->data[PNG_CHUNK_HEAD] = 0x78;
+            s->data[PNG_CHUNK_HEAD + 1] = (e->opt->level < 2) ? 0x01 : (e->opt->level < 6) ? 0x5e : (e->opt->level == 6) ? 0x9c : 0xda;
+        }
+        adler = (k == 0) ? s->adler : adler32_combine(adler, s->adler, (z_off_t)s->raw);
+        if (k == e->nstrips - 1)
+            __put32(s->data + s->size - PNG_CHUNK_TAIL - 4, (uint32_t)adler);
+        __chunk_seal(s->data, "IDAT", s->size - PNG_CHUNK_HEAD - PNG_CHUNK_TAIL);
+        if (func((char*)s->data, s->size, total, arg) != RET_OK)
+            return RET_ERROR;
+        free(s->data);
+        s->data = NULL;
+    }
+
+    __chunk_seal(tail, "IEND", 0);
+    return func((char*)tail, sizeof(tail), total, arg);
+}
+
+// Strips are deflated on threads and stitched into one zlib stream, one IDAT chunk a strip
+int image_png_write(IMAGE* img, PNG_OPTIONS* opt, png_write_t func, void* arg)
+{
+    int k, rows;
+    PNG_OPTIONS def;
+    PngEncoder e;
+
+    check_image(img);
+    check_point(func != NULL);
+    if (!opt) {
+        png_options_init(&def);
+        opt = &def;
+    }
+    if (opt->filter < PNG_SAVE_FILTER_NONE || opt->filter > PNG_SAVE_FILTER_ADAPTIVE
+        || opt->level < 0 || opt->level > 9) {
+        syslog_error("Bad png options.");
+        return RET_ERROR;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.img = img;
+    e.opt = opt;
+    // Save png alpha channel for display
+    e.opaque = (img->format != IMAGE_MASK && img->K > 0);
+    e.bpp = (opt->rgb && (e.opaque || __image_opaque(img))) ? 3 : 4;
+    e.rowbytes = (size_t)img->width * e.bpp;
+    rows = MAX(1, (int)(PNG_STRIP_BYTES / (e.rowbytes + 1)));
+    e.nstrips = (img->height + rows - 1) / rows;
+    e.strips = (PngStrip*)calloc((size_t)e.nstrips, sizeof(PngStrip));
+    check_point(e.strips != NULL);
+    for (k = 0; k < e.nstrips; k++) {
+        e.strips[k].start = k * rows;
+        e.strips[k].stop = MIN(img->height, (k + 1) * rows);
+    }
+
+    e.ret = RET_OK;
+    k = (opt->threads > 0) ? (e.nstrips + opt->threads - 1) / opt->threads : 1;
+    parallel_for(e.nstrips, k, __deflate_band, &e);
+
+    if (e.ret == RET_OK)
+        e.ret = __png_emit(&e, func, arg);
+    else
+        syslog_error("Encode png.");
+
+    for (k = 0; k < e.nstrips; k++)
+        free(e.strips[k].data);
+    free(e.strips);
+
+    return e.ret;
+}
+
+static int __png_memory_write(char* data, size_t n, size_t total, void* arg)
+{
+    PngMemory* m = (PngMemory*)arg;
+
+    if (!m->data) {
+        if (total > INT_MAX || (m->data = (char*)malloc(total)) == NULL) {
+            syslog_error("Allocate memeory.");
+            return RET_ERROR;
+        }
+    }
+    memcpy(m->data + m->size, data, n);
+    m->size += n;
+    return RET_OK;
+}
+
+char* image_png_encode(IMAGE* img, PNG_OPTIONS* opt, int* size)
+{
+    PngMemory m;
+
+    memset(&m, 0, sizeof(m));
+    if (image_png_write(img, opt, __png_memory_write, &m) != RET_OK) {
+        free(m.data);
+        return NULL;
+    }
+    *size = (int)m.size;
+    return m.data;
+}
+
+int image_savepng_opt(IMAGE* img, const char* fname, PNG_OPTIONS* opt)
+{
+    int ret, size;
+    char* data;
+
+    check_image(img);
+    data = image_png_encode(img, opt, &size);
+    check_point(data != NULL);
+    ret = file_save((char*)fname, data, size);
+    free(data);
+
+    return ret;
+}
@@ -0,0 +1,280 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define POOL_MAGIC MAKE_FOURCC('P', 'O', 'O', 'L')
+
+#define POOL_ALIGN 64
+#define POOL_MIN_SHIFT 12 // Blocks less than 4K are not cached
+#define POOL_MIN_SIZE ((size_t)1 << POOL_MIN_SHIFT)
+#define POOL_BUCKETS 160 // 4 buckets for every power of 2
+#define POOL_CACHE_MB 256 // Cached bytes for every thread, env NIMAGE_POOL_MB, 0 -- disable
+#define POOL_POISON_BYTE 0xa5 // make DEFINES=-DNIMAGE_POISON, catch reads before write
+
+typedef struct PoolCache PoolCache;
+
+// Head of every block, user memory starts at POOL_ALIGN after it
+typedef struct PoolBlock {
+    DWORD magic;
+    int bucket; // 0 -- not cached
+    int depth; // scope depth when allocated, 0 -- out of scope
+    size_t size; // bytes of bucket
+    struct PoolBlock *prev, *next; // free list or scope list
+    PoolCache* owner; // thread cache whose scope list holds the block
+} PoolBlock;
+
+struct PoolCache {
+    PoolBlock* bins[POOL_BUCKETS];
+    PoolBlock* scope; // live blocks allocated in scopes, newest first
+    size_t cached;
+    int depth;
+};
+
+static __thread PoolCache* __pool_cache = NULL;
+static pthread_key_t __pool_key;
+static pthread_once_t __pool_once = PTHREAD_ONCE_INIT;
+
+static uint64_t __pool_hits = 0, __pool_misses = 0;
+static size_t __pool_used = 0, __pool_peak = 0, __pool_cached = 0;
+
+static size_t __pool_limit()
+{
+    static long limit = -1;
+    char* env;
+
+    if (limit < 0) {
+        env = getenv("NIMAGE_POOL_MB");
+        limit = (env) ? MAX(atol(env), 0) : POOL_CACHE_MB;
+    }
+    return (size_t)limit << 20;
+}
+
+// Size class, [2^k, 2^(k+1)) is split into 4 buckets, so waste < 25%
+static int __pool_bucket(size_t size, size_t* bytes)
+{
+    int k, q;
+    size_t s;
+
+    if (size <= POOL_MIN_SIZE) {
+        *bytes = size;
+        return 0;
+    }
+    s = size - 1;
+    k = 63 - __builtin_clzll((unsigned long long)s);
+    q = (int)((s >> (k - 2)) & 3);
+    *bytes = (size_t)(5 + q) << (k - 2);
+    k = (k - POOL_MIN_SHIFT) * 4 + q + 1;
+
+    return (k < POOL_BUCKETS) ? k : 0;
+}
+
+static void __pool_release(PoolCache* cache)
+{
+    int k;
+    PoolBlock *b, *next;
+
+    for (k = 0; k < POOL_BUCKETS; k++) {
+        for (b = cache->bins[k]; b; b = next) {
+            next = b->next;
+            __atomic_sub_fetch(&__pool_cached, b->size, __ATOMIC_RELAXED);
+            free(b);
+        }
+        cache->bins[k] = NULL;
+    }
+    cache->cached = 0;
+}
+
+// Thread exit, live scope blocks are left to owner
+static void __pool_destructor(void* p)
+{
+    PoolCache* cache = (PoolCache*)p;
+    PoolBlock* b;
+
+    __pool_release(cache);
+    for (b = cache->scope; b; b = b->next) {
+        b->depth = 0;
+        b->owner = NULL;
+    }
+    free(cache);
+}
+
+static void __pool_key_create()
+{
+    pthread_key_create(&__pool_key, __pool_destructor);
+}
+
+static PoolCache* __pool_thread_cache()
+{
+    if (__pool_cache)
+        return __pool_cache;
+
+    pthread_once(&__pool_once, __pool_key_create);
+    __pool_cache = (PoolCache*)calloc((size_t)1, sizeof(PoolCache));
+    if (__pool_cache)
+        pthread_setspecific(__pool_key, __pool_cache);
+    return __pool_cache;
+}
+
+static void __pool_unlink(PoolCache* cache, PoolBlock* b)
+{
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        cache->scope = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    b->prev = b->next = NULL;
+    b->depth = 0;
+    b->owner = NULL;
+}
+
+// Memory is POOL_ALIGN aligned and NOT cleared
+void* pool_malloc(size_t size)
+{
+    int k;
+    size_t bytes, used, peak;
+    void* p;
+    PoolBlock* b = NULL;
+    PoolCache* cache = __pool_thread_cache();
+
+    k = __pool_bucket(size, &bytes);
+    if (k > 0 && cache && cache->bins[k]) {
+        b = cache->bins[k];
+        cache->bins[k] = b->next;
+        cache->cached -= b->size;
+        __atomic_sub_fetch(&__pool_cached, b->size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&__pool_hits, 1, __ATOMIC_RELAXED);
+    } else {
+        if (posix_memalign(&p, POOL_ALIGN, POOL_ALIGN + bytes) != 0) {
+            syslog_error("Allocate memeory.");
+            return NULL;
+        }
+        b = (PoolBlock*)p;
+        b->magic = POOL_MAGIC;
+        b->bucket = k;
+        b->size = bytes;
+        if (k > 0)
+            __atomic_add_fetch(&__pool_misses, 1, __ATOMIC_RELAXED);
+    }
+    b->prev = b->next = NULL;
+    b->depth = 0;
+    b->owner = NULL;
+
+    // Track in innermost scope
+    if (cache && cache->depth > 0) {
+        b->depth = cache->depth;
+        b->owner = cache;
+        b->next = cache->scope;
+        if (cache->scope)
+            cache->scope->prev = b;
+        cache->scope = b;
+    }
+
+    used = __atomic_add_fetch(&__pool_used, b->size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&__pool_peak, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&__pool_peak, &peak, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+#ifdef NIMAGE_POISON
+    memset((BYTE*)b + POOL_ALIGN, POOL_POISON_BYTE, size);
+#endif
+
+    return (BYTE*)b + POOL_ALIGN;
+}
+
+void* pool_calloc(size_t size)
+{
+    void* p = pool_malloc(size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+// Blocks of scope must be freed on the thread which allocates them, others are left to its scope end
+void pool_free(void* p)
+{
+    PoolBlock* b;
+    PoolCache* cache;
+
+    if (!p)
+        return;
+    b = (PoolBlock*)((BYTE*)p - POOL_ALIGN);
+    if (b->magic != POOL_MAGIC) {
+        syslog_error("Bad pool block.");
+        return;
+    }
+    cache = __pool_thread_cache();
+    if (b->depth > 0) {
+        // Scope list of other thread can not be changed here without a lock
+        if (b->owner != cache) {
+            syslog_error("Free scope block of other thread.");
+            return;
+        }
+        __pool_unlink(cache, b);
+    }
+    __atomic_sub_fetch(&__pool_used, b->size, __ATOMIC_RELAXED);
+
+    if (b->bucket > 0 && cache && cache->cached + b->size <= __pool_limit()) {
+        b->next = cache->bins[b->bucket];
+        cache->bins[b->bucket] = b;
+        cache->cached += b->size;
+        __atomic_add_fetch(&__pool_cached, b->size, __ATOMIC_RELAXED);
+        return;
+    }
+    free(b);
+}
+
+// Blocks allocated by this thread after begin are freed by the matched end
+int pool_scope_begin()
+{
+    PoolCache* cache = __pool_thread_cache();
+
+    if (!cache)
+        return RET_ERROR;
+    return ++cache->depth;
+}
+
+void pool_scope_end()
+{
+    PoolBlock* b;
+    PoolCache* cache = __pool_thread_cache();
+
+    if (!cache || cache->depth < 1)
+        return;
+    while ((b = cache->scope) && b->depth >= cache->depth)
+        pool_free((BYTE*)b + POOL_ALIGN);
+    cache->depth--;
+}
+
+// Give cached blocks of this thread back to system
+void pool_trim()
+{
+    PoolCache* cache = __pool_thread_cache();
+
+    if (cache)
+        __pool_release(cache);
+}
+
+void pool_stats(POOL_STATS* stats)
+{
+    stats->hits = __atomic_load_n(&__pool_hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&__pool_misses, __ATOMIC_RELAXED);
+    stats->used = __atomic_load_n(&__pool_used, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&__pool_peak, __ATOMIC_RELAXED);
+    stats->cached = __atomic_load_n(&__pool_cached, __ATOMIC_RELAXED);
+}
+
+void pool_stats_reset()
+{
+    __atomic_store_n(&__pool_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&__pool_misses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&__pool_peak, __atomic_load_n(&__pool_used, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,244 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "image.h"
+
+#include <limits.h>
+
+// QOI, "Quite OK Image" byte oriented lossless format, see https://qoiformat.org/qoi-specification.pdf
+#define QOI_HEAD_SIZE 14
+#define QOI_TAIL_SIZE 8 // 7 x 0x00, 0x01
+
+#define QOI_OP_INDEX 0x00 // 00xxxxxx
+#define QOI_OP_DIFF 0x40 // 01xxxxxx
+#define QOI_OP_LUMA 0x80 // 10xxxxxx
+#define QOI_OP_RUN 0xc0 // 11xxxxxx
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+#define QOI_HASH(p) (((p).r * 3 + (p).g * 5 + (p).b * 7 + (p).a * 11) & 63)
+
+static const BYTE __qoi_tail[QOI_TAIL_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static inline int __pixel_equal(RGBA_8888 a, RGBA_8888 b)
+{
+    uint32_t x, y;
+
+    memcpy(&x, &a, 4);
+    memcpy(&y, &b, 4);
+    return x == y;
+}
+
+static void __put32(BYTE* p, uint32_t x)
+{
+    p[0] = (BYTE)(x >> 24);
+    p[1] = (BYTE)(x >> 16);
+    p[2] = (BYTE)(x >> 8);
+    p[3] = (BYTE)x;
+}
+
+static uint32_t __get32(BYTE* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Always 4 channels, alpha is kept for masks and blending intermediates
+char* image_saveqoi_to_memory(IMAGE* image, int* size)
+{
+    int i, j, run, h;
+    signed char vr, vg, vb, vg_r, vg_b;
+    size_t max;
+    BYTE *data, *p;
+    RGBA_8888 px, prev, index[64];
+
+    CHECK_IMAGE(image);
+    max = QOI_HEAD_SIZE + (size_t)image->height * image->width * 5 + QOI_TAIL_SIZE;
+    CHECK_POINT(max <= INT_MAX);
+    data = (BYTE*)malloc(max);
+    CHECK_POINT(data != NULL);
+
+    p = data;
+    memcpy(p, "qoif", 4);
+    __put32(p + 4, image->width);
+    __put32(p + 8, image->height);
+    p[12] = 4; // channels
+    p[13] = 0; // sRGB with linear alpha
+    p += QOI_HEAD_SIZE;
+
+    memset(index, 0, sizeof(index));
+    prev.r = prev.g = prev.b = 0;
+    prev.a = 255;
+    run = 0;
+    for (i = 0; i < image->height; i++) {
+        for (j = 0; j < image->width; j++) {
+            px = image->ie[i][j];
+            if (__pixel_equal(px, prev)) {
+                if (++run == 62) {
+                    *p++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            h = QOI_HASH(px);
+            if (__pixel_equal(index[h], px)) {
+                *p++ = QOI_OP_INDEX | h;
+            } else {
+                index[h] = px;
+                if (px.a == prev.a) {
+                    vr = (signed char)(px.r - prev.r);
+                    vg = (signed char)(px.g - prev.g);
+                    vb = (signed char)(px.b - prev.b);
+                    vg_r = vr - vg;
+                    vg_b = vb - vg;
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        *p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                    } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                        *p++ = QOI_OP_LUMA | (vg + 32);
+                        *p++ = (vg_r + 8) << 4 | (vg_b + 8);
+                    } else {
+                        *p++ = QOI_OP_RGB;
+                        *p++ = px.r;
+                        *p++ = px.g;
+                        *p++ = px.b;
+                    }
+                } else {
+                    *p++ = QOI_OP_RGBA;
+                    *p++ = px.r;
+                    *p++ = px.g;
+                    *p++ = px.b;
+                    *p++ = px.a;
+                }
+            }
+            prev = px;
+        }
+    }
+    if (run > 0)
+        *p++ = QOI_OP_RUN | (run - 1);
+    memcpy(p, __qoi_tail, QOI_TAIL_SIZE);
+    p += QOI_TAIL_SIZE;
+
+    *size = (int)(p - data);
+    return (char*)data;
+}
+
+IMAGE* image_loadqoi_from_memory(char* data, size_t size)
+{
+    int i, j, run, height, width;
+    BYTE b1, b2, vg, *p, *end;
+    RGBA_8888 px, index[64];
+    IMAGE* image;
+
+    CHECK_POINT(data != NULL);
+    p = (BYTE*)data;
+    if (size < QOI_HEAD_SIZE + QOI_TAIL_SIZE || memcmp(p, "qoif", 4) != 0) {
+        syslog_error("Bad qoi data.");
+        return NULL;
+    }
+    width = (int)__get32(p + 4);
+    height = (int)__get32(p + 8);
+    if (width <= 0 || height <= 0 || width > 65535 || height > 65535 || p[12] < 3 || p[12] > 4) {
+        syslog_error("Bad qoi head (%d x %d, %d channels).", height, width, p[12]);
+        return NULL;
+    }
+    image = image_create_uninit(height, width);
+    CHECK_IMAGE(image);
+
+    // Ops never read the tail, so a truncated stream stops there
+    end = (BYTE*)data + size - QOI_TAIL_SIZE;
+    p += QOI_HEAD_SIZE;
+    memset(index, 0, sizeof(index));
+    px.r = px.g = px.b = 0;
+    px.a = 255;
+    run = 0;
+    for (i = 0; i < height; i++) {
+        for (j = 0; j < width; j++) {
+            if (run > 0) {
+                run--;
+            } else if (p < end) {
+                b1 = *p++;
+                if (b1 == QOI_OP_RGB) {
+                    if (end - p < 3)
+                        goto bad_data;
+                    px.r = p[0];
+                    px.g = p[1];
+                    px.b = p[2];
+                    p += 3;
+                } else if (b1 == QOI_OP_RGBA) {
+                    if (end - p < 4)
+                        goto bad_data;
+                    px.r = p[0];
+                    px.g = p[1];
+                    px.b = p[2];
+                    px.a = p[3];
+                    p += 4;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                    px = index[b1];
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                    px.r += ((b1 >> 4) & 0x03) - 2;
+                    px.g += ((b1 >> 2) & 0x03) - 2;
+                    px.b += (b1 & 0x03) - 2;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                    if (p >= end)
+                        goto bad_data;
+                    b2 = *p++;
+                    vg = (b1 & 0x3f) - 32;
+                    px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                    px.g += vg;
+                    px.b += vg - 8 + (b2 & 0x0f);
+                } else {
+                    run = (b1 & 0x3f);
+                }
+                index[QOI_HASH(px)] = px;
+            } else {
+                goto bad_data;
+            }
+            image->ie[i][j] = px;
+        }
+    }
+    return image;
+
+bad_data:
+    syslog_error("Truncated qoi data.");
+    image_destroy(image);
+    return NULL;
+}
+
+IMAGE* image_loadqoi(char* fname)
+{
+    size_t size;
+    char* data;
+    IMAGE* image;
+
+    CHECK_POINT(fname != NULL);
+    data = file_map(fname, &size);
+    CHECK_POINT(data != NULL);
+    image = image_loadqoi_from_memory(data, size);
+    file_unmap(data, size);
+
+    return image;
+}
+
+int image_saveqoi(IMAGE* image, const char* fname)
+{
+    int ret, size;
+    char* data;
+
+    check_image(image);
+    data = image_saveqoi_to_memory(image, &size);
+    check_point(data != NULL);
+    ret = file_save((char*)fname, data, size);
+    free(data);
+
+    return ret;
+}
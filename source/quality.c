@@ -0,0 +1,513 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "image.h"
+#include "video.h"
+
+#include <math.h>
+
+// SSIM with box window (integral sweep of filter.c) instead of gaussian, MS-SSIM over 2x2 mean pyramid
+#define QUALITY_RADIUS 3 // 7x7 window
+#define QUALITY_SCALES 5
+#define QUALITY_BAND_ROWS 64
+#define QUALITY_K1 0.01
+#define QUALITY_K2 0.03
+
+extern int matrix_box_sweep(int m, int n, int radius, int count, void (*load)(void* arg, int i, float* rows),
+    void (*save)(void* arg, int i, float* means), void* arg);
+
+static const double __msssim_weights[QUALITY_SCALES] = { 0.0448, 0.2856, 0.3001, 0.2363, 0.1333 };
+
+typedef struct {
+    int m, n, channels;
+    IMAGE* image[2]; // ref, img of 8 bits
+    float* plane[2]; // or planes of channels x m x n, tensor batch or pyramid level
+    double range, c1, c2;
+    double *sse, *ssim, *cs; // row sums, channels x m
+} QualityArgs;
+
+static void __image_channel(RGBA_8888* p, int n, int c, float* x)
+{
+    int j;
+
+    switch (c) {
+    case 0:
+        for (j = 0; j < n; j++)
+            x[j] = p[j].r;
+        break;
+    case 1:
+        for (j = 0; j < n; j++)
+            x[j] = p[j].g;
+        break;
+    default:
+        for (j = 0; j < n; j++)
+            x[j] = p[j].b;
+        break;
+    }
+}
+
+static float* __plane_row(QualityArgs* t, int k, int c, int i)
+{
+    return t->plane[k] + ((size_t)c * t->m + i) * t->n;
+}
+
+static void __quality_psnr_band(void* arg, int start, int stop)
+{
+    int i, j, c, d;
+    double s;
+    float *x, *y;
+    RGBA_8888 *p, *q;
+    QualityArgs* t = (QualityArgs*)arg;
+
+    for (i = start; i < stop; i++) {
+        if (t->image[0]) {
+            p = t->image[0]->ie[i];
+            q = t->image[1]->ie[i];
+            for (c = 0; c < t->channels; c++)
+                t->sse[c * t->m + i] = 0.0;
+            for (j = 0; j < t->n; j++) {
+                d = p[j].r - q[j].r;
+                t->sse[i] += d * d;
+                d = p[j].g - q[j].g;
+                t->sse[t->m + i] += d * d;
+                d = p[j].b - q[j].b;
+                t->sse[2 * t->m + i] += d * d;
+            }
+            continue;
+        }
+        for (c = 0; c < t->channels; c++) {
+            x = __plane_row(t, 0, c, i);
+            y = __plane_row(t, 1, c, i);
+            s = 0.0;
+            for (j = 0; j < t->n; j++)
+                s += (double)(x[j] - y[j]) * (x[j] - y[j]);
+            t->sse[c * t->m + i] = s;
+        }
+    }
+}
+
+// Channel c: x, y, x * x, y * y, x * y
+static void __quality_load(void* arg, int i, float* rows)
+{
+    int j, c, n;
+    float *x, *y, *xx, *yy, *xy;
+    QualityArgs* t = (QualityArgs*)arg;
+
+    n = t->n;
+    for (c = 0; c < t->channels; c++) {
+        x = rows + 5 * c * n;
+        y = x + n;
+        xx = y + n;
+        yy = xx + n;
+        xy = yy + n;
+        if (t->image[0]) {
+            __image_channel(t->image[0]->ie[i], n, c, x);
+            __image_channel(t->image[1]->ie[i], n, c, y);
+        } else {
+            memcpy(x, __plane_row(t, 0, c, i), n * sizeof(float));
+            memcpy(y, __plane_row(t, 1, c, i), n * sizeof(float));
+        }
+        for (j = 0; j < n; j++) {
+            xx[j] = x[j] * x[j];
+            yy[j] = y[j] * y[j];
+            xy[j] = x[j] * y[j];
+        }
+    }
+}
+
+static void __quality_save(void* arg, int i, float* means)
+{
+    int j, c, n;
+    double vx, vy, cov, cs, s_ssim, s_cs;
+    float *mx, *my, *mxx, *myy, *mxy;
+    QualityArgs* t = (QualityArgs*)arg;
+
+    n = t->n;
+    for (c = 0; c < t->channels; c++) {
+        mx = means + 5 * c * n;
+        my = mx + n;
+        mxx = my + n;
+        myy = mxx + n;
+        mxy = myy + n;
+        s_ssim = s_cs = 0.0;
+        for (j = 0; j < n; j++) {
+            vx = (double)mxx[j] - (double)mx[j] * mx[j];
+            vy = (double)myy[j] - (double)my[j] * my[j];
+            cov = (double)mxy[j] - (double)mx[j] * my[j];
+            cs = (2.0 * cov + t->c2) / (vx + vy + t->c2);
+            s_cs += cs;
+            s_ssim += cs * (2.0 * mx[j] * my[j] + t->c1) / ((double)mx[j] * mx[j] + (double)my[j] * my[j] + t->c1);
+        }
+        t->ssim[c * t->m + i] = s_ssim;
+        t->cs[c * t->m + i] = s_cs;
+    }
+}
+
+// Row sums are added in order, results do not depend on threads
+static double __quality_sum(double* rows, int m)
+{
+    int i;
+    double s = 0.0;
+
+    for (i = 0; i < m; i++)
+        s += rows[i];
+    return s;
+}
+
+static int __quality_psnr(QualityArgs* t, QUALITY* q)
+{
+    int c;
+    double mse;
+
+    t->sse = (double*)malloc((size_t)t->channels * t->m * sizeof(double));
+    check_point(t->sse != NULL);
+    parallel_for(t->m, QUALITY_BAND_ROWS, __quality_psnr_band, t);
+
+    for (c = 0; c < t->channels; c++) {
+        mse = __quality_sum(t->sse + c * t->m, t->m) / ((double)t->m * t->n);
+        q->mse[c] = (float)mse;
+    }
+    free(t->sse);
+    t->sse = NULL;
+
+    return RET_OK;
+}
+
+static int __quality_ssim(QualityArgs* t, double* ssim, double* cs)
+{
+    int c, ret;
+
+    t->ssim = (double*)malloc((size_t)t->channels * t->m * sizeof(double));
+    t->cs = (double*)malloc((size_t)t->channels * t->m * sizeof(double));
+    if (t->ssim == NULL || t->cs == NULL) {
+        syslog_error("Allocate memeory.");
+        ret = RET_ERROR;
+        goto exit;
+    }
+    ret = matrix_box_sweep(t->m, t->n, QUALITY_RADIUS, 5 * t->channels, __quality_load, __quality_save, t);
+    for (c = 0; c < t->channels && ret == RET_OK; c++) {
+        ssim[c] = __quality_sum(t->ssim + c * t->m, t->m) / ((double)t->m * t->n);
+        cs[c] = __quality_sum(t->cs + c * t->m, t->m) / ((double)t->m * t->n);
+    }
+
+exit:
+    free(t->cs);
+    free(t->ssim);
+    t->ssim = t->cs = NULL;
+
+    return ret;
+}
+
+// Next pyramid level of source k, 2x2 mean, odd row/column are dropped
+static float* __quality_down(QualityArgs* t, int k)
+{
+    int i, j, c, m, n;
+    float *d, *x, *y, *a, *b;
+    RGBA_8888 *p, *q;
+
+    m = t->m / 2;
+    n = t->n / 2;
+    d = (float*)malloc((size_t)t->channels * m * n * sizeof(float));
+    CHECK_POINT(d != NULL);
+    a = (float*)malloc(2 * (size_t)t->n * sizeof(float));
+    if (a == NULL) {
+        syslog_error("Allocate memeory.");
+        free(d);
+        return NULL;
+    }
+    b = a + t->n;
+
+    for (c = 0; c < t->channels; c++) {
+        for (i = 0; i < m; i++) {
+            if (t->image[k]) {
+                p = t->image[k]->ie[2 * i];
+                q = t->image[k]->ie[2 * i + 1];
+                __image_channel(p, t->n, c, a);
+                __image_channel(q, t->n, c, b);
+                x = a;
+                y = b;
+            } else {
+                x = __plane_row(t, k, c, 2 * i);
+                y = __plane_row(t, k, c, 2 * i + 1);
+            }
+            for (j = 0; j < n; j++)
+                d[((size_t)c * m + i) * n + j] = 0.25f * (x[2 * j] + x[2 * j + 1] + y[2 * j] + y[2 * j + 1]);
+        }
+    }
+    free(a);
+
+    return d;
+}
+
+static int __quality_structure(QualityArgs* t, int flags, QUALITY* q)
+{
+    int c, s, levels, m, n, ret;
+    double w, wsum, ssim[QUALITY_MAX_CHANNELS], cs[QUALITY_MAX_CHANNELS], ms[QUALITY_MAX_CHANNELS];
+    float *down[2], *owned[2];
+
+    levels = 1;
+    if (flags & QUALITY_MSSSIM) {
+        m = t->m;
+        n = t->n;
+        while (levels < QUALITY_SCALES && MIN(m, n) / 2 >= 2 * QUALITY_RADIUS + 1) {
+            m /= 2;
+            n /= 2;
+            levels++;
+        }
+    }
+    wsum = 0.0;
+    for (s = 0; s < levels; s++)
+        wsum += __msssim_weights[s];
+    for (c = 0; c < t->channels; c++)
+        ms[c] = 1.0;
+
+    ret = RET_OK;
+    owned[0] = owned[1] = NULL;
+    for (s = 0; s < levels && ret == RET_OK; s++) {
+        if (s > 0) {
+            down[0] = __quality_down(t, 0);
+            down[1] = __quality_down(t, 1);
+            free(owned[0]);
+            free(owned[1]);
+            owned[0] = t->plane[0] = down[0];
+            owned[1] = t->plane[1] = down[1];
+            t->image[0] = t->image[1] = NULL;
+            t->m /= 2;
+            t->n /= 2;
+            if (down[0] == NULL || down[1] == NULL) {
+                ret = RET_ERROR;
+                break;
+            }
+        }
+        ret = __quality_ssim(t, ssim, cs);
+        w = __msssim_weights[s] / wsum;
+        for (c = 0; c < t->channels && ret == RET_OK; c++) {
+            if (s == 0)
+                q->ssim[c] = (float)ssim[c];
+            // Negative cs of noisy small levels would make pow() undefined
+            ms[c] *= pow(MAX(s < levels - 1 ? cs[c] : ssim[c], 0.0), w);
+        }
+    }
+    free(owned[0]);
+    free(owned[1]);
+
+    if (ret == RET_OK && (flags & QUALITY_MSSSIM)) {
+        for (c = 0; c < t->channels; c++)
+            q->msssim[c] = (float)ms[c];
+    }
+
+    return ret;
+}
+
+static float __psnr(double mse, double range)
+{
+    if (mse <= 0.0)
+        return QUALITY_PSNR_MAX;
+    return MIN((float)(10.0 * log10(range * range / mse)), QUALITY_PSNR_MAX);
+}
+
+// Channel means of mse/ssim/msssim, psnr from mse
+static void __quality_finish(QUALITY* q, int flags, double range)
+{
+    int c;
+
+    q->mse_all = q->ssim_all = q->msssim_all = 0.0f;
+    for (c = 0; c < q->channels; c++) {
+        if (flags & QUALITY_PSNR)
+            q->psnr[c] = __psnr(q->mse[c], range);
+        q->mse_all += q->mse[c] / q->channels;
+        q->ssim_all += q->ssim[c] / q->channels;
+        q->msssim_all += q->msssim[c] / q->channels;
+    }
+    if (flags & QUALITY_PSNR)
+        q->psnr_all = __psnr(q->mse_all, range);
+}
+
+static int __quality_run(QualityArgs* t, int flags, QUALITY* q)
+{
+    t->c1 = (QUALITY_K1 * t->range) * (QUALITY_K1 * t->range);
+    t->c2 = (QUALITY_K2 * t->range) * (QUALITY_K2 * t->range);
+
+    if ((flags & QUALITY_PSNR) && __quality_psnr(t, q) != RET_OK)
+        return RET_ERROR;
+    if ((flags & (QUALITY_SSIM | QUALITY_MSSSIM)) && __quality_structure(t, flags, q) != RET_OK)
+        return RET_ERROR;
+
+    return RET_OK;
+}
+
+static void __quality_add(QUALITY* sum, QUALITY* q)
+{
+    int c;
+
+    for (c = 0; c < q->channels; c++) {
+        sum->mse[c] += q->mse[c];
+        sum->psnr[c] += q->psnr[c];
+        sum->ssim[c] += q->ssim[c];
+        sum->msssim[c] += q->msssim[c];
+    }
+    sum->mse_all += q->mse_all;
+    sum->psnr_all += q->psnr_all;
+    sum->ssim_all += q->ssim_all;
+    sum->msssim_all += q->msssim_all;
+    sum->frames++;
+}
+
+static void __quality_mean(QUALITY* sum)
+{
+    int c;
+    float k;
+
+    if (sum->frames < 1)
+        return;
+    k = 1.0f / sum->frames;
+    for (c = 0; c < sum->channels; c++) {
+        sum->mse[c] *= k;
+        sum->psnr[c] *= k;
+        sum->ssim[c] *= k;
+        sum->msssim[c] *= k;
+    }
+    sum->mse_all *= k;
+    sum->psnr_all *= k;
+    sum->ssim_all *= k;
+    sum->msssim_all *= k;
+}
+
+int image_quality(IMAGE* ref, IMAGE* img, int flags, QUALITY* quality)
+{
+    QualityArgs t;
+
+    check_image(ref);
+    check_image(img);
+    check_point(quality != NULL);
+    if (ref->height != img->height || ref->width != img->width) {
+        syslog_error("Different size between two images.");
+        return RET_ERROR;
+    }
+
+    memset(quality, 0, sizeof(QUALITY));
+    quality->channels = 3;
+    quality->frames = 1;
+
+    memset(&t, 0, sizeof(t));
+    t.m = ref->height;
+    t.n = ref->width;
+    t.channels = 3;
+    t.image[0] = ref;
+    t.image[1] = img;
+    t.range = 255.0;
+    check_point(__quality_run(&t, flags, quality) == RET_OK);
+    __quality_finish(quality, flags, t.range);
+
+    return RET_OK;
+}
+
+// Batches are averaged, psnr is from mean mse of batches
+int tensor_quality(TENSOR* ref, TENSOR* tensor, float range, int flags, QUALITY* quality)
+{
+    int b;
+    QUALITY q;
+    QualityArgs t;
+
+    check_tensor(ref);
+    check_tensor(tensor);
+    check_point(quality != NULL);
+    if (ref->batch != tensor->batch || ref->chan != tensor->chan || ref->height != tensor->height
+        || ref->width != tensor->width) {
+        syslog_error("Different size between two tensors.");
+        return RET_ERROR;
+    }
+    if (ref->batch < 1 || ref->chan < 1 || ref->chan > QUALITY_MAX_CHANNELS || ref->height < 1 || ref->width < 1) {
+        syslog_error("Bad tensor size (%d x %d x %d x %d).", ref->batch, ref->chan, ref->height, ref->width);
+        return RET_ERROR;
+    }
+
+    memset(quality, 0, sizeof(QUALITY));
+    quality->channels = ref->chan;
+    for (b = 0; b < ref->batch; b++) {
+        memset(&q, 0, sizeof(q));
+        q.channels = ref->chan;
+
+        memset(&t, 0, sizeof(t));
+        t.m = ref->height;
+        t.n = ref->width;
+        t.channels = ref->chan;
+        t.plane[0] = tensor_start_batch(ref, b);
+        t.plane[1] = tensor_start_batch(tensor, b);
+        t.range = (range > 0.0f) ? range : 1.0;
+        check_point(__quality_run(&t, flags, &q) == RET_OK);
+        __quality_finish(&q, flags, t.range);
+        __quality_add(quality, &q);
+    }
+    __quality_mean(quality);
+    __quality_finish(quality, flags, (range > 0.0f) ? range : 1.0);
+
+    return RET_OK;
+}
+
+// Only one image per stream besides the decoder ring, psnr is mean of frames as usual for videos
+int video_quality(char* ref_file, char* filename, int flags, QUALITY* quality)
+{
+    int ret;
+    FRAME *f1, *f2;
+    QUALITY q;
+    VIDEO *v1, *v2;
+    IMAGE *a, *b;
+
+    check_point(ref_file != NULL && filename != NULL && quality != NULL);
+    memset(quality, 0, sizeof(QUALITY));
+    quality->channels = 3;
+
+    ret = RET_ERROR;
+    a = b = NULL;
+    v1 = video_open(ref_file, 0);
+    v2 = video_open(filename, 0);
+    if (!video_valid(v1) || !video_valid(v2))
+        goto exit;
+    if (v1->height != v2->height || v1->width != v2->width) {
+        syslog_error("Different size between two videos.");
+        goto exit;
+    }
+    a = image_create(v1->height, v1->width);
+    b = image_create(v2->height, v2->width);
+    if (!image_valid(a) || !image_valid(b))
+        goto exit;
+
+    ret = RET_OK;
+    while (ret == RET_OK && (f1 = video_read(v1)) != NULL && (f2 = video_read(v2)) != NULL) {
+        ret = frame_toimage(f1, a);
+        if (ret == RET_OK)
+            ret = frame_toimage(f2, b);
+        if (ret == RET_OK)
+            ret = image_quality(a, b, flags, &q);
+        if (ret == RET_OK)
+            __quality_add(quality, &q);
+    }
+    __quality_mean(quality);
+
+exit:
+    image_destroy(b);
+    image_destroy(a);
+    video_close(v2);
+    video_close(v1);
+
+    return ret;
+}
+
+void quality_dump(char* title, QUALITY* quality)
+{
+    int c;
+
+    printf("%s (%d channels, %d frames):\n", title ? title : "Quality", quality->channels, quality->frames);
+    for (c = 0; c < quality->channels; c++) {
+        printf("  channel %d: mse %10.4f, psnr %8.4f dB, ssim %.6f, ms-ssim %.6f\n", c, quality->mse[c],
+            quality->psnr[c], quality->ssim[c], quality->msssim[c]);
+    }
+    printf("  all      : mse %10.4f, psnr %8.4f dB, ssim %.6f, ms-ssim %.6f\n", quality->mse_all, quality->psnr_all,
+        quality->ssim_all, quality->msssim_all);
+}
@@ -0,0 +1,547 @@
+/************************************************************************************
+***
+***	Copyright 2026 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat 17 Oct 2026 10:12:36 AM CST
+***
+************************************************************************************/
+
+// Separable resampler shared by image_zoom, matrix_zoom, tensor_zoom and timage_zoom
+
+#include "tiled.h"
+
+#define RESAMPLE_COEF_BITS 12
+#define RESAMPLE_COEF_ONE (1 << RESAMPLE_COEF_BITS)
+#define RESAMPLE_HBITS 4 // horizontal pass keeps (COEF_BITS - HBITS) fraction bits
+#define RESAMPLE_VBITS (2 * RESAMPLE_COEF_BITS - RESAMPLE_HBITS)
+#define RESAMPLE_LANCZOS_A 3
+#define RESAMPLE_BAND_ROWS 16
+#define RESAMPLE_RECT_PIXELS (1 << 22) // source rect of tiled zoom, 16M bytes per thread
+
+typedef struct {
+    int n, taps; // output size, taps for every output
+    int* start; // first source index, start[i] + taps <= source size
+    int* icoef; // n x taps, fixed point, sum == RESAMPLE_COEF_ONE
+    float* fcoef; // n x taps, sum == 1.0
+} ResampleTable;
+
+typedef struct {
+    int method;
+    ResampleTable *vt, *ht;
+
+    // RGBA_8888 source/destion
+    RGBA_8888 **src_ie, **dst_ie;
+
+    // float plane source/destion
+    float *fsrc, *fdst;
+    int fsrc_stride, fdst_stride;
+
+    int ret; // RET_ERROR if any band failed
+} ResampleArgs;
+
+typedef struct {
+    ResampleArgs z; // tables of whole zoom
+    TIMAGE *src, *dst;
+    int ret;
+} ResampleTiles;
+
+static float __lanczos(float x)
+{
+    x = ABS(x);
+    if (x < MIN_FLOAT_NUMBER)
+        return 1.0f;
+    if (x >= RESAMPLE_LANCZOS_A)
+        return 0.0f;
+    x *= MATH_PI;
+    return RESAMPLE_LANCZOS_A * sinf(x) * sinf(x / RESAMPLE_LANCZOS_A) / (x * x);
+}
+
+static int __table_maxtaps(int size, int n, int method)
+{
+    float scale = 1.0f * size / n;
+
+    switch (method) {
+    case ZOOM_METHOD_COPY:
+        return 1;
+    case ZOOM_METHOD_AREA:
+        return (scale > 1.0f) ? (int)ceilf(scale) + 1 : 2;
+    case ZOOM_METHOD_LANCZOS:
+        return 2 * (int)ceilf(RESAMPLE_LANCZOS_A * MAX(scale, 1.0f)) + 1;
+    default: // ZOOM_METHOD_BLINE
+        break;
+    }
+    return 2;
+}
+
+// Source index/weight list for output i, return count
+static int __table_weights(int size, int n, int method, int i, int* idx, float* w)
+{
+    int k, k1, k2, count;
+    float scale, x, x0, x1, support, fscale;
+
+    scale = 1.0f * size / n;
+    count = 0;
+
+    if (method == ZOOM_METHOD_AREA && scale <= 1.0f)
+        method = ZOOM_METHOD_BLINE; // Zoom in, area is same as bline
+
+    switch (method) {
+    case ZOOM_METHOD_COPY:
+        idx[0] = (int)(scale * i);
+        w[0] = 1.0f;
+        count = 1;
+        break;
+    case ZOOM_METHOD_AREA:
+        x0 = scale * i;
+        x1 = scale * (i + 1);
+        k1 = (int)x0;
+        k2 = (int)ceilf(x1);
+        for (k = k1; k < k2; k++) {
+            x = MIN(x1, k + 1.0f) - MAX(x0, (float)k);
+            if (x <= 0.0f)
+                continue;
+            idx[count] = k;
+            w[count] = x / scale;
+            count++;
+        }
+        break;
+    case ZOOM_METHOD_LANCZOS:
+        fscale = MAX(scale, 1.0f);
+        support = RESAMPLE_LANCZOS_A * fscale;
+        x = (i + 0.5f) * scale - 0.5f; // pixel center
+        k1 = (int)floorf(x - support) + 1;
+        k2 = (int)floorf(x + support);
+        for (k = k1; k <= k2; k++) {
+            idx[count] = k;
+            w[count] = __lanczos((k - x) / fscale);
+            count++;
+        }
+        break;
+    default: // ZOOM_METHOD_BLINE
+        x = scale * i;
+        k = (int)x;
+        idx[0] = k;
+        w[0] = 1.0f - (x - k);
+        idx[1] = k + 1;
+        w[1] = x - k;
+        count = 2;
+        break;
+    }
+
+    return count;
+}
+
+static void __table_destroy(ResampleTable* t)
+{
+    if (t) {
+        free(t->start);
+        free(t->icoef);
+        free(t->fcoef);
+        free(t);
+    }
+}
+
+static ResampleTable* __table_create(int size, int n, int method)
+{
+    int i, k, c, count, maxtaps, kmax;
+    int *idx, *ic;
+    float sum, *w, *fc;
+    ResampleTable* t;
+
+    t = (ResampleTable*)calloc((size_t)1, sizeof(ResampleTable));
+    CHECK_POINT(t != NULL);
+
+    maxtaps = __table_maxtaps(size, n, method);
+    t->n = n;
+    t->taps = MIN(maxtaps, size);
+    t->start = (int*)calloc((size_t)n, sizeof(int));
+    t->icoef = (int*)calloc((size_t)n * t->taps, sizeof(int));
+    t->fcoef = (float*)calloc((size_t)n * t->taps, sizeof(float));
+    idx = (int*)calloc((size_t)maxtaps + 1, sizeof(int));
+    w = (float*)calloc((size_t)maxtaps + 1, sizeof(float));
+    if (!t->start || !t->icoef || !t->fcoef || !idx || !w) {
+        syslog_error("Allocate memeory.");
+        free(idx);
+        free(w);
+        __table_destroy(t);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        count = __table_weights(size, n, method, i, idx, w);
+
+        // Clamp to border, span of clamped index is less than taps
+        for (k = 0; k < count; k++)
+            idx[k] = CLAMP(idx[k], 0, size - 1);
+        t->start[i] = (count > 0) ? MIN(idx[0], size - t->taps) : 0;
+
+        fc = t->fcoef + i * t->taps;
+        sum = 0.0f;
+        for (k = 0; k < count; k++) {
+            fc[idx[k] - t->start[i]] += w[k];
+            sum += w[k];
+        }
+        if (ABS(sum) < MIN_FLOAT_NUMBER) {
+            fc[0] = sum = 1.0f;
+        }
+
+        ic = t->icoef + i * t->taps;
+        c = 0;
+        kmax = 0;
+        for (k = 0; k < t->taps; k++) {
+            fc[k] /= sum;
+            ic[k] = (int)lrintf(fc[k] * RESAMPLE_COEF_ONE);
+            c += ic[k];
+            if (ABS(fc[k]) > ABS(fc[kmax]))
+                kmax = k;
+        }
+        ic[kmax] += RESAMPLE_COEF_ONE - c; // rounding error goes to the biggest tap
+    }
+
+    free(idx);
+    free(w);
+
+    return t;
+}
+
+// Horizontal pass for one RGBA row, output is (value << (COEF_BITS - HBITS)) per channel
+static void __hrow_rgba(RGBA_8888* src, ResampleTable* t, int* out)
+{
+    int j, k, c, acc[4];
+    BYTE* s;
+    int* coef;
+
+    for (j = 0; j < t->n; j++) {
+        s = (BYTE*)(src + t->start[j]);
+        coef = t->icoef + j * t->taps;
+        for (c = 0; c < 4; c++)
+            acc[c] = 1 << (RESAMPLE_HBITS - 1);
+        for (k = 0; k < t->taps; k++) {
+            for (c = 0; c < 4; c++)
+                acc[c] += coef[k] * s[4 * k + c];
+        }
+        for (c = 0; c < 4; c++)
+            out[4 * j + c] = acc[c] >> RESAMPLE_HBITS;
+    }
+}
+
+// Vertical pass, rows[k] are horizontal results
+static void __vrow_rgba(int** rows, int* coef, int taps, int n4, int* acc, BYTE* dst)
+{
+    int k, x, v;
+    int *row, c;
+
+    row = rows[0];
+    c = coef[0];
+    for (x = 0; x < n4; x++)
+        acc[x] = row[x] * c + (1 << (RESAMPLE_VBITS - 1));
+    for (k = 1; k < taps; k++) {
+        row = rows[k];
+        c = coef[k];
+        for (x = 0; x < n4; x++)
+            acc[x] += row[x] * c;
+    }
+    for (x = 0; x < n4; x++) {
+        v = acc[x] >> RESAMPLE_VBITS;
+        dst[x] = (BYTE)CLAMP(v, 0, 255);
+    }
+}
+
+static void __hrow_plane(float* src, ResampleTable* t, float* out)
+{
+    int j, k;
+    float d, *s, *coef;
+
+    for (j = 0; j < t->n; j++) {
+        s = src + t->start[j];
+        coef = t->fcoef + j * t->taps;
+        d = 0.0f;
+        for (k = 0; k < t->taps; k++)
+            d += coef[k] * s[k];
+        out[j] = d;
+    }
+}
+
+static void __vrow_plane(float** rows, float* coef, int taps, int n, float* dst)
+{
+    int k, x;
+    float *row, c;
+
+    row = rows[0];
+    c = coef[0];
+    for (x = 0; x < n; x++)
+        dst[x] = row[x] * c;
+    for (k = 1; k < taps; k++) {
+        row = rows[k];
+        c = coef[k];
+        for (x = 0; x < n; x++)
+            dst[x] += row[x] * c;
+    }
+}
+
+static void __resample_rgba_band(void* arg, int start, int stop)
+{
+    int i, j, k, r, slot, n4, taps;
+    int *buf, *acc, *cached, **rows;
+    ResampleArgs* z = (ResampleArgs*)arg;
+
+    if (z->method == ZOOM_METHOD_COPY) {
+        for (i = start; i < stop; i++) {
+            RGBA_8888* s = z->src_ie[z->vt->start[i]];
+            RGBA_8888* d = z->dst_ie[i];
+            for (j = 0; j < z->ht->n; j++)
+                d[j] = s[z->ht->start[j]];
+        }
+        return;
+    }
+
+    taps = z->vt->taps;
+    n4 = 4 * z->ht->n;
+    buf = (int*)malloc((size_t)(taps + 1) * n4 * sizeof(int));
+    cached = (int*)malloc((size_t)taps * sizeof(int));
+    rows = (int**)malloc((size_t)taps * sizeof(int*));
+    if (!buf || !cached || !rows) {
+        syslog_error("Allocate memeory.");
+        z->ret = RET_ERROR;
+        goto band_fail;
+    }
+    acc = buf + taps * n4;
+    for (k = 0; k < taps; k++)
+        cached[k] = -1;
+
+    // Source rows start is monotone, so a ring of taps rows is enough
+    for (i = start; i < stop; i++) {
+        for (k = 0; k < taps; k++) {
+            r = z->vt->start[i] + k;
+            slot = r % taps;
+            if (cached[slot] != r) {
+                __hrow_rgba(z->src_ie[r], z->ht, buf + slot * n4);
+                cached[slot] = r;
+            }
+            rows[k] = buf + slot * n4;
+        }
+        __vrow_rgba(rows, z->vt->icoef + i * taps, taps, n4, acc, (BYTE*)z->dst_ie[i]);
+    }
+
+band_fail:
+    free(rows);
+    free(cached);
+    free(buf);
+}
+
+static void __resample_plane_band(void* arg, int start, int stop)
+{
+    int i, j, k, r, slot, n, taps;
+    int* cached;
+    float *buf, **rows, *s, *d;
+    ResampleArgs* z = (ResampleArgs*)arg;
+
+    n = z->ht->n;
+    if (z->method == ZOOM_METHOD_COPY) {
+        for (i = start; i < stop; i++) {
+            s = z->fsrc + (size_t)z->vt->start[i] * z->fsrc_stride;
+            d = z->fdst + (size_t)i * z->fdst_stride;
+            for (j = 0; j < n; j++)
+                d[j] = s[z->ht->start[j]];
+        }
+        return;
+    }
+
+    taps = z->vt->taps;
+    buf = (float*)malloc((size_t)taps * n * sizeof(float));
+    cached = (int*)malloc((size_t)taps * sizeof(int));
+    rows = (float**)malloc((size_t)taps * sizeof(float*));
+    if (!buf || !cached || !rows) {
+        syslog_error("Allocate memeory.");
+        z->ret = RET_ERROR;
+        goto band_fail;
+    }
+    for (k = 0; k < taps; k++)
+        cached[k] = -1;
+
+    for (i = start; i < stop; i++) {
+        for (k = 0; k < taps; k++) {
+            r = z->vt->start[i] + k;
+            slot = r % taps;
+            if (cached[slot] != r) {
+                __hrow_plane(z->fsrc + (size_t)r * z->fsrc_stride, z->ht, buf + slot * n);
+                cached[slot] = r;
+            }
+            rows[k] = buf + slot * n;
+        }
+        __vrow_plane(rows, z->vt->fcoef + i * taps, taps, n, z->fdst + (size_t)i * z->fdst_stride);
+    }
+
+band_fail:
+    free(rows);
+    free(cached);
+    free(buf);
+}
+
+static int __resample_prepare(ResampleArgs* z, int h, int w, int nh, int nw, int method)
+{
+    if (h < 1 || w < 1 || nh < 1 || nw < 1) {
+        syslog_error("Bad resample size %dx%d -> %dx%d.", h, w, nh, nw);
+        return RET_ERROR;
+    }
+    if (method < ZOOM_METHOD_COPY || method > ZOOM_METHOD_LANCZOS)
+        method = ZOOM_METHOD_BLINE;
+
+    memset(z, 0, sizeof(ResampleArgs));
+    z->method = method;
+    z->ret = RET_OK;
+    z->vt = __table_create(h, nh, method);
+    z->ht = __table_create(w, nw, method);
+    if (!z->vt || !z->ht) {
+        __table_destroy(z->vt);
+        __table_destroy(z->ht);
+        return RET_ERROR;
+    }
+
+    return RET_OK;
+}
+
+// dst size is target size
+int image_resample(IMAGE* src, IMAGE* dst, int method)
+{
+    ResampleArgs z;
+
+    check_image(src);
+    check_image(dst);
+
+    check_point(__resample_prepare(&z, src->height, src->width, dst->height, dst->width, method) == RET_OK);
+    z.src_ie = src->ie;
+    z.dst_ie = dst->ie;
+    parallel_for(dst->height, RESAMPLE_BAND_ROWS, __resample_rgba_band, &z);
+
+    __table_destroy(z.vt);
+    __table_destroy(z.ht);
+
+    return z.ret;
+}
+
+// Float plane with row stride, for matrix and tensor channel
+int plane_resample(float* src, int h, int w, int src_stride, float* dst, int nh, int nw, int dst_stride,
+    int method)
+{
+    ResampleArgs z;
+
+    check_point(src != NULL && dst != NULL);
+
+    check_point(__resample_prepare(&z, h, w, nh, nw, method) == RET_OK);
+    z.fsrc = src;
+    z.fsrc_stride = src_stride;
+    z.fdst = dst;
+    z.fdst_stride = dst_stride;
+    parallel_for(nh, RESAMPLE_BAND_ROWS, __resample_plane_band, &z);
+
+    __table_destroy(z.vt);
+    __table_destroy(z.ht);
+
+    return z.ret;
+}
+
+// Outputs [k, k + n) of t, start is relative to first source index
+static void __table_part(ResampleTable* t, int k, int n, ResampleTable* part, int* start)
+{
+    int i;
+
+    part->n = n;
+    part->taps = t->taps;
+    part->start = start;
+    part->icoef = t->icoef + k * t->taps;
+    part->fcoef = t->fcoef + k * t->taps;
+    for (i = 0; i < n; i++)
+        start[i] = t->start[k + i] - t->start[k];
+}
+
+// Source of drect is read as one IMAGE, drect is split until the source fits RESAMPLE_RECT_PIXELS (and IMAGE)
+static int __resample_rect(ResampleTiles* a, RECT* drect)
+{
+    int ret, big, vstart[TIMAGE_TILE], hstart[TIMAGE_TILE];
+    RECT srect, half;
+    IMAGE *src, *dst;
+    ResampleTable vt, ht;
+    ResampleArgs z;
+
+    srect.r = a->z.vt->start[drect->r];
+    srect.h = a->z.vt->start[drect->r + drect->h - 1] + a->z.vt->taps - srect.r;
+    srect.c = a->z.ht->start[drect->c];
+    srect.w = a->z.ht->start[drect->c + drect->w - 1] + a->z.ht->taps - srect.c;
+
+    big = (srect.h > 65535 || srect.w > 65535 || (int64_t)srect.h * srect.w > RESAMPLE_RECT_PIXELS);
+    if (big && (drect->h > 1 || drect->w > 1)) {
+        half = *drect;
+        if (drect->w == 1 || (drect->h > 1 && srect.h >= srect.w)) {
+            half.h = drect->h / 2;
+            ret = __resample_rect(a, &half);
+            half.r += half.h;
+            half.h = drect->h - half.h;
+        } else {
+            half.w = drect->w / 2;
+            ret = __resample_rect(a, &half);
+            half.c += half.w;
+            half.w = drect->w - half.w;
+        }
+        return (ret == RET_OK) ? __resample_rect(a, &half) : ret;
+    }
+
+    src = timage_read_rect(a->src, &srect);
+    check_image(src);
+    dst = image_create_uninit(drect->h, drect->w);
+    if (!dst) {
+        image_destroy(src);
+        return RET_ERROR;
+    }
+
+    __table_part(a->z.vt, drect->r, drect->h, &vt, vstart);
+    __table_part(a->z.ht, drect->c, drect->w, &ht, hstart);
+    z = a->z;
+    z.vt = &vt;
+    z.ht = &ht;
+    z.src_ie = src->ie;
+    z.dst_ie = dst->ie;
+    __resample_rgba_band(&z, 0, drect->h);
+    ret = (z.ret == RET_OK) ? timage_write_rect(a->dst, drect, dst, 0, 0) : RET_ERROR;
+
+    image_destroy(dst);
+    image_destroy(src);
+
+    return ret;
+}
+
+static void __resample_tile_band(void* arg, int start, int stop)
+{
+    int k;
+    RECT drect;
+    ResampleTiles* a = (ResampleTiles*)arg;
+
+    for (k = start; k < stop && a->ret == RET_OK; k++) {
+        if (timage_tile_rect(a->dst, k, &drect) != RET_OK || __resample_rect(a, &drect) != RET_OK)
+            a->ret = RET_ERROR;
+    }
+}
+
+// Every destion tile reads its source rect, result is same as image_zoom
+TIMAGE* timage_zoom(TIMAGE* t, int nh, int nw, int method)
+{
+    ResampleTiles a;
+
+    CHECK_TIMAGE(t);
+
+    a.src = t;
+    a.ret = RET_OK;
+    CHECK_POINT(__resample_prepare(&a.z, t->height, t->width, nh, nw, method) == RET_OK);
+    a.dst = timage_create(nh, nw, 0);
+    if (a.dst)
+        parallel_for(a.dst->rows * a.dst->cols, 1, __resample_tile_band, &a);
+
+    __table_destroy(a.z.vt);
+    __table_destroy(a.z.ht);
+
+    if (a.dst && a.ret != RET_OK) {
+        timage_destroy(a.dst);
+        a.dst = NULL;
+    }
+    return a.dst;
+}
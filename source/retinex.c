@@ -13,26 +13,6 @@
 
 extern int matrix_gauss_filter(MATRIX* mat, float sigma);
 
-// Single Scale
-// R  (x,y) = log(I (x,y)) - log(I (x,y) * F(x,y))
-static int __single_scale(MATRIX* mat, float sigma)
-{
-    int i, j;
-    MATRIX* g;
-
-    check_matrix(mat);
-    g = matrix_copy(mat);
-    check_matrix(g);
-    matrix_gauss_filter(g, sigma);
-    matrix_foreach(mat, i, j)
-    {
-        mat->me[i][j] = log(mat->me[i][j] + 1.0f) - log(g->me[i][j] + 1.0f);
-    }
-    matrix_destroy(g);
-
-    return RET_OK;
-}
-
 // Multi Scale
 static int __multi_scale(MATRIX* mat, int nscale, float* scales)
 {
@@ -43,24 +23,26 @@ static int __multi_scale(MATRIX* mat, int nscale, float* scales)
     check_matrix(mat);
     out = matrix_create(mat->m, mat->n);
     check_matrix(out);
+    g = matrix_create(mat->m, mat->n);
+    check_matrix(g);
 
     weight = 1.0f / nscale;
 
+    // Single Scale: R(x,y) = log(I(x,y)) - log(I(x,y) * F(x,y))
     for (k = 0; k < nscale; k++) {
-        g = matrix_copy(mat);
-        check_matrix(g);
-        __single_scale(g, scales[k]);
-
-        matrix_foreach(out, i, j) out->me[i][j] += weight * g->me[i][j];
-        matrix_destroy(g);
+        memcpy(g->base, mat->base, mat->m * mat->n * sizeof(float));
+        matrix_gauss_filter(g, scales[k]);
+        matrix_foreach(out, i, j) out->me[i][j] += weight * (log(mat->me[i][j] + 1.0f) - log(g->me[i][j] + 1.0f));
     }
     memcpy(mat->base, out->base, out->m * out->n * sizeof(float));
+    matrix_destroy(g);
     matrix_destroy(out);
 
     return RET_OK;
 }
 
-static int __color_restore(MATRIX* dst, MATRIX* src, MATRIX* gray)
+// offset -- source channel byte offset in RGBA_8888
+static int __color_restore(MATRIX* dst, IMAGE* image, int offset, MATRIX* gray)
 {
     int i, j;
     float gain;
@@ -70,7 +52,7 @@ static int __color_restore(MATRIX* dst, MATRIX* src, MATRIX* gray)
 
     matrix_foreach(dst, i, j)
     {
-        gain = log(125.0f * (src->me[i][j] + 1.0f)) - log(3.0f * gray->me[i][j]);
+        gain = log(125.0f * (((BYTE*)&image->ie[i][j])[offset] + 1.0f)) - log(3.0f * gray->me[i][j]);
         dst->me[i][j] *= gain;
     }
 
@@ -89,57 +71,36 @@ static int __gain_offset(MATRIX* mat, float gain, float offset)
 
 int image_retinex(IMAGE* image, int nscale)
 {
-    int i, j;
+    int i, j, k;
     float scales[3] = { 15, 80, 250 };
 
-    MATRIX *rmat, *gmat, *bmat, *gray, *src;
+    MATRIX *mat[3], *gray;
 
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
 
-    rmat = image_getplane(image, 'R');
-    check_matrix(rmat);
-    gmat = image_getplane(image, 'G');
-    check_matrix(gmat);
-    bmat = image_getplane(image, 'B');
-    check_matrix(bmat);
+    if (image_getplanes(image, "RGB", mat) != RET_OK)
+        return RET_ERROR;
 
     gray = matrix_create(image->height, image->width);
     check_matrix(gray);
-    matrix_foreach(rmat, i, j)
+    matrix_foreach(gray, i, j)
     {
-        gray->me[i][j] = 1.0f + (rmat->me[i][j] + gmat->me[i][j] + bmat->me[i][j]) / 3.0f;
+        gray->me[i][j] = 1.0f + (mat[0]->me[i][j] + mat[1]->me[i][j] + mat[2]->me[i][j]) / 3.0f;
     }
-    __multi_scale(rmat, nscale, scales);
-    __multi_scale(gmat, nscale, scales);
-    __multi_scale(bmat, nscale, scales);
-
-    src = image_getplane(image, 'R');
-    check_matrix(rmat);
-    __color_restore(rmat, src, gray);
-    matrix_destroy(src);
-
-    src = image_getplane(image, 'G');
-    check_matrix(rmat);
-    __color_restore(gmat, src, gray);
-    matrix_destroy(src);
 
-    src = image_getplane(image, 'B');
-    check_matrix(rmat);
-    __color_restore(bmat, src, gray);
-    matrix_destroy(src);
-
-    __gain_offset(rmat, 30, -6);
-    __gain_offset(gmat, 30, -6);
-    __gain_offset(bmat, 30, -6);
+    // R, G, B: offset k in RGBA_8888
+    for (k = 0; k < 3; k++) {
+        __multi_scale(mat[k], nscale, scales);
+        __color_restore(mat[k], image, k, gray);
+        __gain_offset(mat[k], 30, -6);
+    }
 
-    image_setplane(image, 'R', rmat);
-    image_setplane(image, 'G', gmat);
-    image_setplane(image, 'B', bmat);
+    image_setplanes(image, "RGB", mat);
 
     matrix_destroy(gray);
-    matrix_destroy(bmat);
-    matrix_destroy(gmat);
-    matrix_destroy(rmat);
+    for (k = 0; k < 3; k++)
+        matrix_destroy(mat[k]);
 
     return RET_OK;
 }
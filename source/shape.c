@@ -348,7 +348,8 @@ VECTOR* shape_vector(IMAGE* img, RECT* rect, int ndim)
         sum_arc[j] = 0;
 
     if (rect) {
-        sub = image_subimg(img, rect);
+        // Pixels are copied only when shape_bestedge writes
+        sub = image_share(img, rect);
         CHECK_IMAGE(sub);
         shape_bestedge(sub, 0.4, 0.8);
         image_mcenter(sub, 'A', &crow, &ccol);
@@ -436,6 +437,7 @@ int image_contour(IMAGE* img)
     MATRIX* mat;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     mat = matrix_create(img->height, img->width);
     check_matrix(mat);
 
@@ -508,6 +510,7 @@ int image_skeleton(IMAGE* image)
     int i, j;
 
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
 
     // Save bitmap to channel A ...
     image_foreach(image, i, j) {
@@ -538,6 +541,7 @@ int shape_midedge(IMAGE* img)
     MATRIX* mat;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     mat = matrix_create(img->height, img->width);
     check_matrix(mat);
     mid_thr = color_midval(img, 'A');
@@ -569,6 +573,7 @@ int shape_bestedge(IMAGE* img, float lr, float hr)
     int i, j, ret;
 
     check_image(img);
+    check_point(image_writable(img) == RET_OK);
     image_foreach(img, i, j) img->ie[i][j].r = image_getvalue(img, 'A', i, j);
 
     img->format = IMAGE_GRAY;
@@ -0,0 +1,948 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "stream.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+
+#include <jerror.h>
+#include <jpeglib.h>
+#include <png.h>
+
+#define IREADER_MAGIC MAKE_FOURCC('I', 'R', 'E', 'D')
+#define IWRITER_MAGIC MAKE_FOURCC('I', 'W', 'R', 'T')
+
+#define STREAM_JPEG_MAX 65500 // libjpeg limit
+
+typedef struct {
+    BYTE* data;
+    size_t size, offset;
+} StreamSource;
+
+// Errors of libjpeg jump back to the caller like png_jmpbuf, instead of exit()
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+} JpegError;
+
+typedef struct {
+    int type;
+    FILE* fp; // NULL -- from memory
+    StreamSource src;
+    int max_h, max_w; // jpeg DCT scaling, 0 -- full size
+    struct jpeg_decompress_struct jpeg;
+    JpegError jerr;
+    png_struct* png;
+    png_info* info;
+    BYTE* whole; // interlaced png, decoded at open
+    BYTE** whole_rows;
+} ReaderCodec;
+
+typedef struct {
+    int type;
+    FILE* fp;
+    struct jpeg_compress_struct jpeg;
+    JpegError jerr;
+    png_struct* png;
+    png_info* info;
+    BYTE* mem; // memory destination, malloc
+    size_t memsize, memcap;
+    unsigned long memsize_jpeg;
+} WriterCodec;
+
+// Two bands, decoder fills one while the other is processed
+typedef struct {
+    IREADER* reader;
+    RGBA_8888** rows[2];
+    int count[2]; // rows in band, 0 -- end, < 0 -- error
+    int full[2];
+    int band, stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} StreamArgs;
+
+static int __jpeg_fastdct = -1; // env NIMAGE_JPEG_FASTDCT
+
+static void __jpeg_errexit(j_common_ptr cinfo)
+{
+    cinfo->err->output_message(cinfo);
+    longjmp(((JpegError*)cinfo->err)->jmp, 1);
+}
+
+static void __png_read(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    StreamSource* s = (StreamSource*)png_get_io_ptr(png_ptr);
+
+    if (s->offset + length > s->size)
+        png_error(png_ptr, "Read over end of data");
+    memcpy(data, s->data + s->offset, length);
+    s->offset += length;
+}
+
+static int __stream_type(char* fname)
+{
+    char* extname = strrchr(fname, '.');
+
+    if (extname) {
+        if (strcasecmp(extname, ".jpg") == 0 || strcasecmp(extname, ".jpeg") == 0)
+            return STREAM_JPEG;
+        if (strcasecmp(extname, ".png") == 0)
+            return STREAM_PNG;
+    }
+    return 0;
+}
+
+static J_DCT_METHOD __jpeg_dct()
+{
+    if (__jpeg_fastdct < 0)
+        __jpeg_fastdct = (getenv("NIMAGE_JPEG_FASTDCT") && atoi(getenv("NIMAGE_JPEG_FASTDCT")) > 0);
+    return __jpeg_fastdct ? JDCT_IFAST : JDCT_ISLOW;
+}
+
+// Fast integer DCT for jpeg load/save, a little less accurate
+void image_jpeg_fastdct(int fast)
+{
+    __jpeg_fastdct = (fast) ? 1 : 0;
+}
+
+static int __stream_band()
+{
+    static int band = -1;
+    char* env;
+
+    if (band < 0) {
+        env = getenv("NIMAGE_STREAM_BAND");
+        band = (env && atoi(env) > 0) ? atoi(env) : STREAM_BAND;
+    }
+    return band;
+}
+
+// Smallest M/8 scale whose output still covers the fit of image in max_h x max_w
+static void __jpeg_scale(struct jpeg_decompress_struct* cinfo, int max_h, int max_w)
+{
+    float s = MIN((float)max_h / cinfo->image_height, (float)max_w / cinfo->image_width);
+
+    cinfo->scale_num = CLAMP((int)ceilf(8.0f * s), 1, 8);
+    cinfo->scale_denom = 8;
+}
+
+static int __jpeg_open(IREADER* r, ReaderCodec* c)
+{
+    c->jpeg.err = jpeg_std_error(&c->jerr.mgr);
+    c->jerr.mgr.error_exit = __jpeg_errexit;
+    if (setjmp(c->jerr.jmp)) {
+        syslog_error("Jpeg decode header.");
+        return RET_ERROR;
+    }
+    jpeg_create_decompress(&c->jpeg);
+    if (c->fp)
+        jpeg_stdio_src(&c->jpeg, c->fp);
+    else
+        jpeg_mem_src(&c->jpeg, c->src.data, (unsigned long)c->src.size);
+    jpeg_read_header(&c->jpeg, TRUE);
+    c->jpeg.do_fancy_upsampling = 0;
+    c->jpeg.do_block_smoothing = 0;
+    c->jpeg.dct_method = __jpeg_dct();
+    if (c->max_h > 0 && c->max_w > 0)
+        __jpeg_scale(&c->jpeg, c->max_h, c->max_w);
+
+    // Decode to RGBA directly, libjpeg sets alpha 255 as blank pixels of image_create(), CMYK is left as it is
+    if (c->jpeg.jpeg_color_space == JCS_GRAYSCALE || c->jpeg.jpeg_color_space == JCS_YCbCr
+        || c->jpeg.jpeg_color_space == JCS_RGB)
+        c->jpeg.out_color_space = JCS_EXT_RGBA;
+    r->format = (c->jpeg.jpeg_color_space == JCS_GRAYSCALE) ? IMAGE_GRAY : IMAGE_RGBA;
+    jpeg_start_decompress(&c->jpeg);
+
+    if (c->jpeg.output_components != 4) {
+        syslog_error("Color channels is %d (1 or 3).", c->jpeg.output_components);
+        return RET_ERROR;
+    }
+    r->height = c->jpeg.output_height;
+    r->width = c->jpeg.output_width;
+
+    return RET_OK;
+}
+
+// Always 8 bits RGBA
+static int __png_open(IREADER* r, ReaderCodec* c)
+{
+    int i, passes, bit_depth, color_type;
+    png_uint_32 width, height;
+
+    c->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (c->png)
+        c->info = png_create_info_struct(c->png);
+    if (!c->png || !c->info) {
+        syslog_error("Png create read struct");
+        return RET_ERROR;
+    }
+    if (setjmp(png_jmpbuf(c->png))) {
+        syslog_error("Png jmpbuf");
+        return RET_ERROR;
+    }
+    if (c->fp)
+        png_init_io(c->png, c->fp);
+    else
+        png_set_read_fn(c->png, &c->src, __png_read);
+    png_read_info(c->png, c->info);
+    png_get_IHDR(c->png, c->info, &width, &height, &bit_depth, &color_type, NULL, NULL, NULL);
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE || (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        || png_get_valid(c->png, c->info, PNG_INFO_tRNS))
+        png_set_expand(c->png);
+    if (bit_depth == 16)
+        png_set_strip_16(c->png);
+    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(c->png);
+    png_set_filler(c->png, 0xff, PNG_FILLER_AFTER);
+    passes = png_set_interlace_handling(c->png);
+    png_read_update_info(c->png, c->info);
+
+    r->format = IMAGE_RGBA;
+    r->height = (int)height;
+    r->width = (int)width;
+
+    // Interlaced rows are complete only after last pass, so decode all here
+    if (passes > 1) {
+        c->whole = (BYTE*)pool_malloc((size_t)r->height * r->width * sizeof(RGBA_8888));
+        c->whole_rows = (BYTE**)malloc(r->height * sizeof(BYTE*));
+        if (!c->whole || !c->whole_rows) {
+            syslog_error("Allocate memeory.");
+            return RET_ERROR;
+        }
+        for (i = 0; i < r->height; i++)
+            c->whole_rows[i] = c->whole + (size_t)i * r->width * sizeof(RGBA_8888);
+        png_read_image(c->png, c->whole_rows);
+    }
+
+    return RET_OK;
+}
+
+static IREADER* __ireader_create(int type, FILE* fp, char* data, size_t size, int max_h, int max_w)
+{
+    int ret;
+    IREADER* r;
+    ReaderCodec* c;
+
+    r = (IREADER*)calloc((size_t)1, sizeof(IREADER));
+    c = (ReaderCodec*)calloc((size_t)1, sizeof(ReaderCodec));
+    if (!r || !c) {
+        syslog_error("Allocate memeory.");
+        free(r);
+        free(c);
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+    r->magic = IREADER_MAGIC;
+    r->_codec = c;
+    c->type = type;
+    c->fp = fp;
+    c->src.data = (BYTE*)data;
+    c->src.size = size;
+    c->max_h = max_h;
+    c->max_w = max_w;
+
+    ret = (type == STREAM_JPEG) ? __jpeg_open(r, c) : __png_open(r, c);
+    if (ret != RET_OK || r->height < 1 || r->width < 1) {
+        ireader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+IREADER* ireader_open(char* fname)
+{
+    return ireader_open_scaled(fname, 0, 0);
+}
+
+IREADER* ireader_open_scaled(char* fname, int max_h, int max_w)
+{
+    int type;
+    FILE* fp;
+
+    if ((type = __stream_type(fname)) == 0) {
+        syslog_error("Only support jpg/jpeg/png loading.");
+        return NULL;
+    }
+    if ((fp = fopen(fname, "rb")) == NULL) {
+        syslog_error("Open file %s.", fname);
+        return NULL;
+    }
+    return __ireader_create(type, fp, NULL, 0, max_h, max_w);
+}
+
+IREADER* ireader_open_memory(char* data, size_t size)
+{
+    BYTE* s = (BYTE*)data;
+
+    if (data && size >= 8 && png_sig_cmp(s, 0, 8) == 0)
+        return __ireader_create(STREAM_PNG, NULL, data, size, 0, 0);
+    if (data && size >= 3 && s[0] == 0xff && s[1] == 0xd8 && s[2] == 0xff)
+        return __ireader_create(STREAM_JPEG, NULL, data, size, 0, 0);
+
+    syslog_error("Only support jpg/jpeg/png data.");
+    return NULL;
+}
+
+int ireader_valid(IREADER* r)
+{
+    return (!r || r->magic != IREADER_MAGIC || !r->_codec) ? 0 : 1;
+}
+
+static int __jpeg_read_rows(ReaderCodec* c, RGBA_8888** rows, int n)
+{
+    int i, k;
+
+    if (setjmp(c->jerr.jmp)) {
+        syslog_error("Jpeg decode.");
+        return RET_ERROR;
+    }
+    for (i = 0; i < n; i += k) {
+        k = jpeg_read_scanlines(&c->jpeg, (JSAMPARRAY)(rows + i), n - i);
+        if (k <= 0)
+            return RET_ERROR;
+    }
+    return RET_OK;
+}
+
+static int __jpeg_skip_rows(ReaderCodec* c, int n)
+{
+    if (setjmp(c->jerr.jmp)) {
+        syslog_error("Jpeg decode.");
+        return RET_ERROR;
+    }
+    return (int)jpeg_skip_scanlines(&c->jpeg, n);
+}
+
+static int __jpeg_crop(ReaderCodec* c, JDIMENSION* x, JDIMENSION* n)
+{
+    if (setjmp(c->jerr.jmp)) {
+        syslog_error("Jpeg crop.");
+        return RET_ERROR;
+    }
+    jpeg_crop_scanline(&c->jpeg, x, n);
+    return RET_OK;
+}
+
+static int __png_read_rows(ReaderCodec* c, RGBA_8888** rows, int n)
+{
+    if (setjmp(png_jmpbuf(c->png))) {
+        syslog_error("Png jmpbuf");
+        return RET_ERROR;
+    }
+    png_read_rows(c->png, (png_bytepp)rows, NULL, n);
+    return RET_OK;
+}
+
+int ireader_read(IREADER* r, RGBA_8888** rows, int n)
+{
+    int i;
+    ReaderCodec* c;
+
+    check_ireader(r);
+    c = (ReaderCodec*)r->_codec;
+    n = MIN(n, r->height - r->row);
+    if (n <= 0)
+        return 0;
+
+    if (c->type == STREAM_JPEG) {
+        if (__jpeg_read_rows(c, rows, n) != RET_OK)
+            return RET_ERROR;
+    } else if (c->whole) {
+        for (i = 0; i < n; i++)
+            memcpy(rows[i], c->whole_rows[r->row + i], r->width * sizeof(RGBA_8888));
+    } else if (__png_read_rows(c, rows, n) != RET_OK) {
+        return RET_ERROR;
+    }
+    r->row += n;
+
+    return n;
+}
+
+// Png rows are decoded and dropped, jpeg skips IDCT of them
+int ireader_skip(IREADER* r, int n)
+{
+    int i;
+    RGBA_8888* buf;
+    ReaderCodec* c;
+
+    check_ireader(r);
+    c = (ReaderCodec*)r->_codec;
+    n = MIN(n, r->height - r->row);
+    if (n <= 0)
+        return 0;
+
+    if (c->type == STREAM_JPEG) {
+        if ((n = __jpeg_skip_rows(c, n)) < 0)
+            return RET_ERROR;
+    } else if (!c->whole) {
+        buf = (RGBA_8888*)malloc(r->width * sizeof(RGBA_8888));
+        check_point(buf != NULL);
+        for (i = 0; i < n; i++) {
+            if (__png_read_rows(c, &buf, 1) != RET_OK)
+                break;
+        }
+        free(buf);
+        n = i;
+    }
+    r->row += n;
+
+    return n;
+}
+
+// Jpeg decodes only columns [*c, *c + *w) widened to iMCU boundary, others return all columns
+int ireader_crop(IREADER* r, int* c, int* w)
+{
+    JDIMENSION x, n;
+    ReaderCodec* codec;
+
+    check_ireader(r);
+    codec = (ReaderCodec*)r->_codec;
+    if (r->row > 0 || *c < 0 || *w < 1 || *c + *w > r->width) {
+        syslog_error("Bad crop [%d, %d) of %d at row %d.", *c, *c + *w, r->width, r->row);
+        return RET_ERROR;
+    }
+
+    if (codec->type == STREAM_JPEG) {
+        x = *c;
+        n = *w;
+        if (__jpeg_crop(codec, &x, &n) != RET_OK)
+            return RET_ERROR;
+        *c = (int)x;
+        *w = (int)n;
+        r->width = (int)codec->jpeg.output_width;
+    } else {
+        *c = 0;
+        *w = r->width;
+    }
+
+    return RET_OK;
+}
+
+void ireader_close(IREADER* r)
+{
+    ReaderCodec* c;
+
+    if (!ireader_valid(r))
+        return;
+    c = (ReaderCodec*)r->_codec;
+    if (c->type == STREAM_JPEG)
+        jpeg_destroy_decompress(&c->jpeg);
+    else
+        png_destroy_read_struct(&c->png, &c->info, NULL);
+    if (c->fp)
+        fclose(c->fp);
+    pool_free(c->whole);
+    free(c->whole_rows);
+    free(c);
+    r->magic = 0;
+    free(r);
+}
+
+// Rest rows to image, reader is closed
+IMAGE* ireader_image(IREADER* reader)
+{
+    int h;
+    IMAGE* img;
+
+    CHECK_POINT(reader != NULL);
+    h = reader->height - reader->row;
+    if (h < 1 || h > 65535 || reader->width > 65535) {
+        syslog_error("Bad image size %dx%d.", h, reader->width);
+        ireader_close(reader);
+        return NULL;
+    }
+    if ((img = image_create_uninit(h, reader->width)) != NULL) {
+        img->format = reader->format;
+        if (ireader_read(reader, img->ie, img->height) != img->height) {
+            syslog_error("Decode image.");
+            image_destroy(img);
+            img = NULL;
+        }
+    }
+    ireader_close(reader);
+
+    return img;
+}
+
+static void __png_write(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    BYTE* mem;
+    size_t cap;
+    WriterCodec* c = (WriterCodec*)png_get_io_ptr(png_ptr);
+
+    if (c->memsize + length > c->memcap) {
+        cap = MAX(c->memcap * 2, c->memsize + length);
+        cap = MAX(cap, (size_t)4096);
+        if ((mem = (BYTE*)realloc(c->mem, cap)) == NULL)
+            png_error(png_ptr, "Write Error");
+        c->mem = mem;
+        c->memcap = cap;
+    }
+    memcpy(c->mem + c->memsize, data, length);
+    c->memsize += length;
+}
+
+static int __png_create(IWRITER* w, WriterCodec* c)
+{
+    c->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (c->png)
+        c->info = png_create_info_struct(c->png);
+    if (!c->png || !c->info) {
+        syslog_error("Png create write struct");
+        return RET_ERROR;
+    }
+    if (setjmp(png_jmpbuf(c->png))) {
+        syslog_error("Png jmpbuf");
+        return RET_ERROR;
+    }
+    if (c->fp)
+        png_init_io(c->png, c->fp);
+    else
+        png_set_write_fn(c->png, c, __png_write, NULL);
+    png_set_IHDR(c->png, c->info, w->width, w->height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(c->png, c->info);
+
+    return RET_OK;
+}
+
+static int __jpeg_create(IWRITER* w, WriterCodec* c, int quality)
+{
+    c->jpeg.err = jpeg_std_error(&c->jerr.mgr);
+    c->jerr.mgr.error_exit = __jpeg_errexit;
+    if (setjmp(c->jerr.jmp)) {
+        syslog_error("Jpeg create compress.");
+        return RET_ERROR;
+    }
+    jpeg_create_compress(&c->jpeg);
+    if (c->fp)
+        jpeg_stdio_dest(&c->jpeg, c->fp);
+    else
+        jpeg_mem_dest(&c->jpeg, &c->mem, &c->memsize_jpeg);
+    c->jpeg.image_width = w->width;
+    c->jpeg.image_height = w->height;
+    c->jpeg.input_components = 4;
+    c->jpeg.in_color_space = JCS_EXT_RGBA;
+    jpeg_set_defaults(&c->jpeg);
+    jpeg_set_quality(&c->jpeg, quality, TRUE);
+    c->jpeg.dct_method = __jpeg_dct();
+    jpeg_start_compress(&c->jpeg, TRUE);
+
+    return RET_OK;
+}
+
+static IWRITER* __iwriter_create(int type, FILE* fp, int height, int width, int quality)
+{
+    int ret;
+    IWRITER* w;
+    WriterCodec* c;
+
+    w = (IWRITER*)calloc((size_t)1, sizeof(IWRITER));
+    c = (WriterCodec*)calloc((size_t)1, sizeof(WriterCodec));
+    if (!w || !c) {
+        syslog_error("Allocate memeory.");
+        free(w);
+        free(c);
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+    w->magic = IWRITER_MAGIC;
+    w->height = height;
+    w->width = width;
+    w->_codec = c;
+    c->type = type;
+    c->fp = fp;
+
+    ret = (type == STREAM_JPEG) ? __jpeg_create(w, c, quality) : __png_create(w, c);
+    if (ret != RET_OK) {
+        iwriter_close(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+static int __iwriter_check(int type, int height, int width)
+{
+    if (type != STREAM_JPEG && type != STREAM_PNG) {
+        syslog_error("ONLY Support jpg/jpeg/png image saving.");
+        return RET_ERROR;
+    }
+    if (height < 1 || width < 1
+        || (type == STREAM_JPEG && (height > STREAM_JPEG_MAX || width > STREAM_JPEG_MAX))) {
+        syslog_error("Bad image size %dx%d.", height, width);
+        return RET_ERROR;
+    }
+    return RET_OK;
+}
+
+IWRITER* iwriter_open(char* fname, int height, int width, int quality)
+{
+    int type;
+    FILE* fp;
+
+    type = __stream_type(fname);
+    if (__iwriter_check(type, height, width) != RET_OK)
+        return NULL;
+    if ((fp = fopen(fname, "wb")) == NULL) {
+        syslog_error("Create file (%s).", fname);
+        return NULL;
+    }
+    return __iwriter_create(type, fp, height, width, quality);
+}
+
+IWRITER* iwriter_open_memory(int type, int height, int width, int quality)
+{
+    if (__iwriter_check(type, height, width) != RET_OK)
+        return NULL;
+    return __iwriter_create(type, NULL, height, width, quality);
+}
+
+int iwriter_valid(IWRITER* w)
+{
+    return (!w || w->magic != IWRITER_MAGIC || !w->_codec) ? 0 : 1;
+}
+
+static int __jpeg_write_rows(WriterCodec* c, RGBA_8888** rows, int n)
+{
+    int i, k;
+
+    if (setjmp(c->jerr.jmp)) {
+        syslog_error("Jpeg encode.");
+        return RET_ERROR;
+    }
+    for (i = 0; i < n; i += k) {
+        k = jpeg_write_scanlines(&c->jpeg, (JSAMPARRAY)(rows + i), n - i);
+        if (k <= 0)
+            return RET_ERROR;
+    }
+    return RET_OK;
+}
+
+static int __png_write_rows(WriterCodec* c, RGBA_8888** rows, int n)
+{
+    if (setjmp(png_jmpbuf(c->png))) {
+        syslog_error("Png jmpbuf");
+        return RET_ERROR;
+    }
+    png_write_rows(c->png, (png_bytepp)rows, n);
+    return RET_OK;
+}
+
+int iwriter_write(IWRITER* w, RGBA_8888** rows, int n)
+{
+    WriterCodec* c;
+
+    check_iwriter(w);
+    c = (WriterCodec*)w->_codec;
+    n = MIN(n, w->height - w->row);
+    if (n <= 0)
+        return 0;
+
+    if (c->type == STREAM_JPEG) {
+        if (__jpeg_write_rows(c, rows, n) != RET_OK)
+            return RET_ERROR;
+    } else if (__png_write_rows(c, rows, n) != RET_OK) {
+        return RET_ERROR;
+    }
+    w->row += n;
+
+    return n;
+}
+
+static int __jpeg_finish(WriterCodec* c)
+{
+    if (setjmp(c->jerr.jmp)) {
+        syslog_error("Jpeg finish compress.");
+        return RET_ERROR;
+    }
+    jpeg_finish_compress(&c->jpeg);
+    return RET_OK;
+}
+
+static int __png_finish(WriterCodec* c)
+{
+    if (setjmp(png_jmpbuf(c->png))) {
+        syslog_error("Png jmpbuf");
+        return RET_ERROR;
+    }
+    png_write_end(c->png, NULL);
+    return RET_OK;
+}
+
+// Finish codec and free writer, encoded memory is left in *mem
+static int __iwriter_finish(IWRITER* w, BYTE** mem, size_t* size)
+{
+    int ret;
+    WriterCodec* c = (WriterCodec*)w->_codec;
+
+    ret = (w->row == w->height) ? RET_OK : RET_ERROR;
+    if (c->type == STREAM_JPEG) {
+        if (ret == RET_OK)
+            ret = __jpeg_finish(c);
+        jpeg_destroy_compress(&c->jpeg);
+        c->memsize = c->memsize_jpeg;
+    } else {
+        if (ret == RET_OK)
+            ret = __png_finish(c);
+        png_destroy_write_struct(&c->png, &c->info);
+    }
+    if (c->fp && fclose(c->fp) != 0)
+        ret = RET_ERROR;
+    if (ret != RET_OK)
+        syslog_error("Write image, %d of %d rows.", w->row, w->height);
+
+    *mem = c->mem;
+    *size = c->memsize;
+    free(c);
+    w->magic = 0;
+    free(w);
+
+    return ret;
+}
+
+int iwriter_close(IWRITER* w)
+{
+    int ret;
+    BYTE* mem;
+    size_t size;
+
+    check_iwriter(w);
+    ret = __iwriter_finish(w, &mem, &size);
+    free(mem);
+
+    return ret;
+}
+
+char* iwriter_close_memory(IWRITER* w, int* size)
+{
+    BYTE* mem;
+    size_t n;
+
+    if (!iwriter_valid(w)) {
+        syslog_error("Bad image writer.");
+        return NULL;
+    }
+    if (__iwriter_finish(w, &mem, &n) != RET_OK || n > INT_MAX) {
+        free(mem);
+        return NULL;
+    }
+    *size = (int)n;
+
+    return (char*)mem;
+}
+
+static void* __stream_decode(void* arg)
+{
+    int b, n, stop;
+    StreamArgs* s = (StreamArgs*)arg;
+
+    for (b = 0;; b = 1 - b) {
+        pthread_mutex_lock(&s->lock);
+        while (s->full[b] && !s->stop)
+            pthread_cond_wait(&s->cond, &s->lock);
+        stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+            break;
+
+        n = ireader_read(s->reader, s->rows[b], s->band);
+
+        pthread_mutex_lock(&s->lock);
+        s->count[b] = n;
+        s->full[b] = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (n <= 0)
+            break;
+    }
+
+    return NULL;
+}
+
+static RGBA_8888** __band_create(int band, int width)
+{
+    int i;
+    size_t head, stride;
+    RGBA_8888** rows;
+
+    head = (band * sizeof(RGBA_8888*) + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    stride = ((size_t)width * sizeof(RGBA_8888) + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    rows = (RGBA_8888**)pool_malloc(head + band * stride);
+    if (!rows) {
+        syslog_error("Allocate memeory.");
+        return NULL;
+    }
+    for (i = 0; i < band; i++)
+        rows[i] = (RGBA_8888*)((BYTE*)rows + head + i * stride);
+    return rows;
+}
+
+int image_stream(char* ifname, char* ofname, int band, stream_func_t func, void* arg)
+{
+    int b, n, r0, ret = RET_ERROR;
+    pthread_t thread;
+    IWRITER* writer = NULL;
+    StreamArgs s;
+
+    memset(&s, 0, sizeof(s));
+    s.band = (band > 0) ? band : __stream_band();
+    s.reader = ireader_open(ifname);
+    check_point(s.reader != NULL);
+    if (ofname)
+        writer = iwriter_open(ofname, s.reader->height, s.reader->width, 100);
+    s.rows[0] = __band_create(s.band, s.reader->width);
+    s.rows[1] = __band_create(s.band, s.reader->width);
+    if ((ofname && !writer) || !s.rows[0] || !s.rows[1])
+        goto stream_fail;
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    if (pthread_create(&thread, NULL, __stream_decode, &s) != 0) {
+        syslog_error("Create thread.");
+        goto thread_fail;
+    }
+
+    for (b = 0, r0 = 0;; b = 1 - b) {
+        pthread_mutex_lock(&s.lock);
+        while (!s.full[b])
+            pthread_cond_wait(&s.cond, &s.lock);
+        n = s.count[b];
+        pthread_mutex_unlock(&s.lock);
+        if (n <= 0) {
+            ret = (n == 0) ? RET_OK : RET_ERROR;
+            break;
+        }
+        if (func && func(r0, n, s.reader->width, s.rows[b], arg) != RET_OK)
+            break;
+        if (writer && iwriter_write(writer, s.rows[b], n) != n)
+            break;
+        r0 += n;
+
+        pthread_mutex_lock(&s.lock);
+        s.full[b] = 0;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+    }
+
+    pthread_mutex_lock(&s.lock);
+    s.stop = 1;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+    pthread_join(thread, NULL);
+
+thread_fail:
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+
+stream_fail:
+    if (writer && iwriter_close(writer) != RET_OK)
+        ret = RET_ERROR;
+    pool_free(s.rows[0]);
+    pool_free(s.rows[1]);
+    ireader_close(s.reader);
+
+    return ret;
+}
+
+static int __is_nimg(char* fname)
+{
+    char* extname = strrchr(fname, '.');
+    return (extname && strcasecmp(extname, ".nimg") == 0);
+}
+
+// Fit in max_h x max_w with aspect kept, never zoom in, jpeg is scaled down in DCT first
+IMAGE* image_load_scaled(char* fname, int max_h, int max_w)
+{
+    int nh, nw;
+    float s;
+    IMAGE *img, *zoom;
+
+    CHECK_POINT(max_h > 0 && max_w > 0);
+    img = __is_nimg(fname) ? image_load(fname) : ireader_image(ireader_open_scaled(fname, max_h, max_w));
+    CHECK_IMAGE(img);
+
+    s = MIN((float)max_h / img->height, (float)max_w / img->width);
+    if (s >= 1.0f)
+        return img;
+    nh = CLAMP((int)(s * img->height + 0.5f), 1, max_h);
+    nw = CLAMP((int)(s * img->width + 0.5f), 1, max_w);
+    zoom = image_zoom(img, nh, nw, ZOOM_METHOD_AREA);
+    if (zoom)
+        zoom->format = img->format;
+    image_destroy(img);
+
+    return zoom;
+}
+
+// Rows above rect are skipped, rows below are never decoded, jpeg decodes only columns around rect
+IMAGE* image_load_rect(char* fname, RECT* rect)
+{
+    int i, j, n, c, w;
+    IMAGE *img = NULL, *sub;
+    IREADER* reader;
+    RGBA_8888** rows = NULL;
+
+    CHECK_POINT(rect != NULL);
+    if (__is_nimg(fname)) {
+        img = image_load(fname);
+        CHECK_IMAGE(img);
+        image_rectclamp(img, rect);
+        sub = image_subimg(img, rect);
+        image_destroy(img);
+        return sub;
+    }
+
+    reader = ireader_open(fname);
+    CHECK_POINT(reader != NULL);
+    rect->r = CLAMP(rect->r, 0, reader->height - 1);
+    rect->h = CLAMP(rect->h, 0, MIN(reader->height - rect->r, 65535));
+    rect->c = CLAMP(rect->c, 0, reader->width - 1);
+    rect->w = CLAMP(rect->w, 0, MIN(reader->width - rect->c, 65535));
+    c = rect->c;
+    w = rect->w;
+    if (rect->h < 1 || rect->w < 1 || ireader_crop(reader, &c, &w) != RET_OK
+        || ireader_skip(reader, rect->r) != rect->r)
+        goto read_fail;
+    if ((img = image_create_uninit(rect->h, rect->w)) == NULL)
+        goto read_fail;
+    img->format = reader->format;
+
+    // Decode into image rows when no columns are around rect
+    if (c == rect->c && w == rect->w) {
+        if (ireader_read(reader, img->ie, img->height) != img->height)
+            goto read_fail;
+    } else {
+        rows = __band_create(STREAM_BAND, reader->width);
+        if (!rows)
+            goto read_fail;
+        for (i = 0; i < img->height; i += n) {
+            n = ireader_read(reader, rows, MIN(STREAM_BAND, img->height - i));
+            if (n <= 0)
+                goto read_fail;
+            for (j = 0; j < n; j++)
+                memcpy(img->ie[i + j], rows[j] + rect->c - c, img->width * sizeof(RGBA_8888));
+        }
+        pool_free(rows);
+    }
+    ireader_close(reader);
+
+    return img;
+
+read_fail:
+    syslog_error("Load rect of %s.", fname);
+    pool_free(rows);
+    image_destroy(img);
+    ireader_close(reader);
+    return NULL;
+}
@@ -13,6 +13,9 @@
 #define GRID_MAX_BLOCKS 16
 #define TENSOR_MAGIC MAKE_FOURCC('T', 'E', 'N', 'S')
 
+extern int plane_resample(float* src, int h, int w, int src_stride, float* dst, int nh, int nw, int dst_stride,
+    int method);
+
 int tensor_valid(TENSOR* tensor)
 {
     return (!tensor || tensor->batch < 0 || tensor->chan < 0 || tensor->height < 0 || tensor->width < 0 
@@ -20,6 +23,16 @@ int tensor_valid(TENSOR* tensor)
 }
 
 TENSOR* tensor_create(int b, int c, int h, int w)
+{
+    TENSOR* t = tensor_create_uninit(b, c, h, w);
+
+    if (t)
+        memset(t->data, 0, (size_t) b*c*h*w * sizeof(float));
+
+    return t;
+}
+
+TENSOR* tensor_create_uninit(int b, int c, int h, int w)
 {
     TENSOR* t;
 
@@ -28,9 +41,10 @@ TENSOR* tensor_create(int b, int c, int h, int w)
         syslog_error("Allocate memeory.");
         return NULL;
     }
-    t->data = (float *)calloc((size_t) b*c*h*w, sizeof(float));
+    t->data = (float *)pool_malloc((size_t) b*c*h*w * sizeof(float));
     if (t->data == NULL) {
         syslog_error("Allocate memeory.");
+        free(t);
         return NULL;
     }
     t->magic = TENSOR_MAGIC;
@@ -121,8 +135,8 @@ void tensor_destroy(TENSOR* tensor)
     if (!tensor_valid(tensor))
         return;
 
-    if (tensor->data)
-        free(tensor->data);
+    pool_free(tensor->data);
+    tensor->magic = 0;
 
     free(tensor);
 }
@@ -248,29 +262,24 @@ float* tensor_start_batch(TENSOR* tensor, int b)
 TENSOR* tensor_zoom(TENSOR* source, int nh, int nw)
 {
     int b, c;
-    MATRIX *s_mat, *d_mat;
     float *s_data, *d_data;
     TENSOR* zoom = NULL;
 
     CHECK_TENSOR(source);
-    zoom = tensor_create(source->batch, source->chan, nh, nw);
+    zoom = tensor_create_uninit(source->batch, source->chan, nh, nw);
     CHECK_TENSOR(zoom);
 
-    s_mat = matrix_create(source->height, source->width);
-    CHECK_MATRIX(s_mat);
     for (b = 0; b < source->batch; b++) {
         for (c = 0; c < source->chan; c++) {
             s_data = tensor_start_chan(source, b, c);
-            memcpy(s_mat->base, s_data, s_mat->m * s_mat->n * sizeof(float));
-            d_mat = matrix_zoom(s_mat, nh, nw, ZOOM_METHOD_BLINE);
-            if (matrix_valid(d_mat)) {
-                d_data = tensor_start_chan(zoom, b, c);
-                memcpy(d_data, d_mat->base, nh * nw * sizeof(float));
-                matrix_destroy(d_mat);
+            d_data = tensor_start_chan(zoom, b, c);
+            if (plane_resample(s_data, source->height, source->width, source->width, d_data, nh, nw, nw,
+                    ZOOM_METHOD_BLINE) != RET_OK) {
+                tensor_destroy(zoom);
+                return NULL;
             }
         }
     }
-    matrix_destroy(s_mat);
 
     return zoom;
 }
@@ -284,7 +293,7 @@ int tensor_zoom_(TENSOR* x, int nh, int nw)
     TENSOR* destion = tensor_zoom(x, nh, nw);
     check_tensor(destion);
 
-    free(x->data);
+    pool_free(x->data);
     x->data = destion->data;
     x->height = nh;
     x->width = nw;
@@ -400,7 +409,7 @@ int tensor_border_pad_(TENSOR* x, int left_pad, int right_pad, int top_pad, int
             } // c
         } // b
     }
-    free(x->data);
+    pool_free(x->data);
     x->data = destion->data;
     x->height = nh;
     x->width = nw;
@@ -1177,7 +1186,7 @@ int tensor_resizepad_(TENSOR *x, int max_h, int max_w, int max_times)
     TENSOR *t = tensor_zoom(x, nh, nw);
     check_tensor(t);
 
-    free(x->data);
+    pool_free(x->data);
     x->data = t->data;
     x->height = nh;
     x->width = nw;
@@ -1195,7 +1204,7 @@ int tensor_zeropad_(TENSOR* x, int nh, int nw)
     TENSOR* destion = tensor_zeropad(x, nh, nw);
     check_tensor(destion);
 
-    free(x->data);
+    pool_free(x->data);
     x->data = destion->data;
     x->height = nh;
     x->width = nw;
@@ -4133,6 +4133,7 @@ int text_puts(IMAGE* image, int r, int c, char* text, int color)
     BYTE r2, g2, b2;
 
     check_image(image);
+    check_point(image_writable(image) == RET_OK);
     r2 = RGB_R(color);
     g2 = RGB_G(color);
     b2 = RGB_B(color);
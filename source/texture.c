@@ -48,8 +48,9 @@ VECTOR* texture_vector(IMAGE* img, RECT* rect, int ndim)
 
     vec = vector_create(ndim);
     CHECK_VECTOR(vec);
+    memset(count, 0, sizeof(count));
     if (rect) {
-        sub = image_subimg(img, rect);
+        sub = image_view(img, rect);
         CHECK_IMAGE(sub);
         image_foreach(sub, i, j) count[texture_tlbp8('A', sub, i, j, 1)]++;
         image_destroy(sub);
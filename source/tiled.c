@@ -0,0 +1,692 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "tiled.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define TIMAGE_MAGIC MAKE_FOURCC('T', 'I', 'M', 'G')
+
+#define TIMAGE_TILE_BYTES ((size_t)TIMAGE_TILE * TIMAGE_TILE * sizeof(RGBA_8888))
+#define TIMAGE_MIN_SLOTS 16
+
+// Mapped tile
+typedef struct {
+    int tile; // -1: free
+    int pins;
+    uint64_t tick;
+    RGBA_8888* data; // TIMAGE_TILE x TIMAGE_TILE, full size even for border tiles
+} TileSlot;
+
+typedef struct {
+    int fd; // scratch file, unlinked after open
+    int budget_mb;
+    int nslots, maxslots; // nslots > maxslots only when all slots are pinned
+    TileSlot* slots;
+    int* slot_of; // tile -> slot, -1: not mapped
+    BYTE* inited; // tile has been blanked
+    uint64_t tick;
+    pthread_mutex_t lock;
+} TileCache;
+
+typedef struct {
+    TIMAGE *src, *dst;
+    int halo, ret;
+    timage_func_t func;
+    void* arg;
+} TileArgs;
+
+typedef struct {
+    TIMAGE* t;
+    int grid_rows, grid_cols, h, w;
+    int* counts; // grid_rows * grid_cols * HISTOGRAM_MAX_COUNT
+    HISTOGRAM* hist;
+    pthread_mutex_t lock;
+    int ret; // RET_ERROR if any band failed
+} ClaheArgs;
+
+extern void clahe_grid(int height, int width, int* grid_rows, int* grid_cols, int* h, int* w, float* limit);
+extern void clahe_interpolate(IMAGE* img, int r0, int c0, int height, int width, int grid_rows, int grid_cols,
+    int h, int w, HISTOGRAM* hist);
+
+static int __scratch_file(size_t size)
+{
+    int fd;
+    char *dir, fname[256];
+
+    dir = getenv("NIMAGE_TMPDIR");
+    snprintf(fname, sizeof(fname), "%s/nimage-XXXXXX", (dir) ? dir : "/tmp");
+    fd = mkstemp(fname);
+    if (fd < 0) {
+        syslog_error("Create scratch file %s, errno: %d.", fname, errno);
+        return -1;
+    }
+    unlink(fname);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        syslog_error("Resize scratch file, errno: %d.", errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Pin tile k, map it when it is not in cache, LRU slot is reused
+static RGBA_8888* __tile_lock(TIMAGE* t, int k)
+{
+    int i, s;
+    void* p;
+    TileSlot* slots;
+    TileCache* cache = (TileCache*)t->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->tick++;
+    s = cache->slot_of[k];
+    if (s >= 0) {
+        cache->slots[s].pins++;
+        cache->slots[s].tick = cache->tick;
+        pthread_mutex_unlock(&cache->lock);
+        return cache->slots[s].data;
+    }
+
+    // Free slot, or unpinned LRU slot, or a new slot when all are pinned
+    s = -1;
+    for (i = 0; i < cache->nslots; i++) {
+        if (cache->slots[i].tile < 0) {
+            s = i;
+            break;
+        }
+        if (cache->slots[i].pins == 0 && (s < 0 || cache->slots[i].tick < cache->slots[s].tick))
+            s = i;
+    }
+    if (s < 0 || (cache->slots[s].tile >= 0 && cache->nslots < cache->maxslots)) {
+        slots = (TileSlot*)realloc(cache->slots, (cache->nslots + 1) * sizeof(TileSlot));
+        if (!slots) {
+            pthread_mutex_unlock(&cache->lock);
+            syslog_error("Allocate memeory.");
+            return NULL;
+        }
+        cache->slots = slots;
+        s = cache->nslots++;
+        cache->slots[s].tile = -1;
+    }
+    if (cache->slots[s].tile >= 0) {
+        munmap(cache->slots[s].data, TIMAGE_TILE_BYTES);
+        cache->slot_of[cache->slots[s].tile] = -1;
+        cache->slots[s].tile = -1;
+    }
+
+    p = mmap(NULL, TIMAGE_TILE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, (off_t)k * TIMAGE_TILE_BYTES);
+    if (p == MAP_FAILED) {
+        pthread_mutex_unlock(&cache->lock);
+        syslog_error("Map tile %d, errno: %d.", k, errno);
+        return NULL;
+    }
+    // Blank image, same as image_create
+    if (!cache->inited[k]) {
+        memset(p, 255, TIMAGE_TILE_BYTES);
+        cache->inited[k] = 1;
+    }
+    cache->slots[s].tile = k;
+    cache->slots[s].pins = 1;
+    cache->slots[s].tick = cache->tick;
+    cache->slots[s].data = (RGBA_8888*)p;
+    cache->slot_of[k] = s;
+    pthread_mutex_unlock(&cache->lock);
+
+    return (RGBA_8888*)p;
+}
+
+static void __tile_unlock(TIMAGE* t, int k)
+{
+    int s;
+    TileCache* cache = (TileCache*)t->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    s = cache->slot_of[k];
+    if (s >= 0 && cache->slots[s].pins > 0)
+        cache->slots[s].pins--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void __cache_destroy(TileCache* cache)
+{
+    int i;
+
+    if (!cache)
+        return;
+    for (i = 0; i < cache->nslots; i++) {
+        if (cache->slots[i].tile >= 0)
+            munmap(cache->slots[i].data, TIMAGE_TILE_BYTES);
+    }
+    if (cache->fd >= 0)
+        close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache->slot_of);
+    free(cache->inited);
+    free(cache);
+}
+
+// Copy between rect (inside image) and rows[i] + col, every tile is pinned once
+static int __timage_block(TIMAGE* t, RECT* rect, RGBA_8888** rows, int col, int write)
+{
+    int tr, tc, i, i0, i1, j0, j1;
+    RGBA_8888 *data, *tp, *bp;
+
+    for (tr = rect->r / TIMAGE_TILE; tr * TIMAGE_TILE < rect->r + rect->h; tr++) {
+        for (tc = rect->c / TIMAGE_TILE; tc * TIMAGE_TILE < rect->c + rect->w; tc++) {
+            data = __tile_lock(t, tr * t->cols + tc);
+            if (!data)
+                return RET_ERROR;
+            i0 = MAX(rect->r, tr * TIMAGE_TILE);
+            i1 = MIN(rect->r + rect->h, (tr + 1) * TIMAGE_TILE);
+            j0 = MAX(rect->c, tc * TIMAGE_TILE);
+            j1 = MIN(rect->c + rect->w, (tc + 1) * TIMAGE_TILE);
+            for (i = i0; i < i1; i++) {
+                tp = data + (size_t)(i - tr * TIMAGE_TILE) * TIMAGE_TILE + (j0 - tc * TIMAGE_TILE);
+                bp = rows[i - rect->r] + col + (j0 - rect->c);
+                if (write)
+                    memcpy(tp, bp, (j1 - j0) * sizeof(RGBA_8888));
+                else
+                    memcpy(bp, tp, (j1 - j0) * sizeof(RGBA_8888));
+            }
+            __tile_unlock(t, tr * t->cols + tc);
+        }
+    }
+    return RET_OK;
+}
+
+// Intersection of rect and image, return 0 if empty
+static int __timage_clip(TIMAGE* t, RECT* rect, RECT* inner)
+{
+    inner->r = MAX(rect->r, 0);
+    inner->c = MAX(rect->c, 0);
+    inner->h = MIN(rect->r + rect->h, t->height) - inner->r;
+    inner->w = MIN(rect->c + rect->w, t->width) - inner->c;
+
+    return (inner->h > 0 && inner->w > 0);
+}
+
+TIMAGE* timage_create(int h, int w, int budget_mb)
+{
+    int n;
+    char* env;
+    TIMAGE* t;
+    TileCache* cache;
+
+    if (h < 1 || w < 1) {
+        syslog_error("Create tiled image.");
+        return NULL;
+    }
+    if (budget_mb <= 0) {
+        env = getenv("NIMAGE_TILE_MB");
+        budget_mb = (env) ? atoi(env) : TIMAGE_BUDGET_MB;
+    }
+
+    t = (TIMAGE*)calloc((size_t)1, sizeof(TIMAGE));
+    cache = (TileCache*)calloc((size_t)1, sizeof(TileCache));
+    if (!t || !cache) {
+        syslog_error("Allocate memeory.");
+        free(t);
+        free(cache);
+        return NULL;
+    }
+    t->height = h;
+    t->width = w;
+    t->rows = (h + TIMAGE_TILE - 1) / TIMAGE_TILE;
+    t->cols = (w + TIMAGE_TILE - 1) / TIMAGE_TILE;
+    t->cache = cache;
+
+    n = t->rows * t->cols;
+    cache->budget_mb = budget_mb;
+    cache->maxslots = MAX(TIMAGE_MIN_SLOTS, (int)(((size_t)budget_mb << 20) / TIMAGE_TILE_BYTES));
+    cache->slot_of = (int*)malloc(n * sizeof(int));
+    cache->inited = (BYTE*)calloc((size_t)n, sizeof(BYTE));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->fd = __scratch_file((size_t)n * TIMAGE_TILE_BYTES);
+    if (!cache->slot_of || !cache->inited || cache->fd < 0) {
+        syslog_error("Create tiled image.");
+        __cache_destroy(cache);
+        free(t);
+        return NULL;
+    }
+    memset(cache->slot_of, 0xff, n * sizeof(int)); // -1
+    t->magic = TIMAGE_MAGIC;
+
+    return t;
+}
+
+int timage_valid(TIMAGE* t)
+{
+    return (!t || t->height < 1 || t->width < 1 || !t->cache || t->magic != TIMAGE_MAGIC) ? 0 : 1;
+}
+
+void timage_destroy(TIMAGE* t)
+{
+    if (!timage_valid(t))
+        return;
+    __cache_destroy((TileCache*)t->cache);
+    t->magic = 0;
+    free(t);
+}
+
+int timage_getrow(TIMAGE* t, int i, int c, int n, RGBA_8888* buf)
+{
+    RECT rect;
+
+    check_timage(t);
+    check_point(i >= 0 && i < t->height && c >= 0 && n > 0 && c + n <= t->width);
+
+    rect.r = i;
+    rect.c = c;
+    rect.h = 1;
+    rect.w = n;
+    return __timage_block(t, &rect, &buf, 0, 0);
+}
+
+int timage_setrow(TIMAGE* t, int i, int c, int n, RGBA_8888* buf)
+{
+    RECT rect;
+
+    check_timage(t);
+    check_point(i >= 0 && i < t->height && c >= 0 && n > 0 && c + n <= t->width);
+
+    rect.r = i;
+    rect.c = c;
+    rect.h = 1;
+    rect.w = n;
+    return __timage_block(t, &rect, &buf, 0, 1);
+}
+
+IMAGE* timage_read_rect(TIMAGE* t, RECT* rect)
+{
+    int i, j, r, c;
+    RECT inner;
+    IMAGE* img;
+
+    CHECK_TIMAGE(t);
+    CHECK_POINT(rect->h > 0 && rect->w > 0 && rect->h <= 65535 && rect->w <= 65535);
+    CHECK_POINT(__timage_clip(t, rect, &inner));
+
+    img = image_create_uninit(rect->h, rect->w);
+    CHECK_IMAGE(img);
+
+    r = inner.r - rect->r;
+    c = inner.c - rect->c;
+    if (__timage_block(t, &inner, img->ie + r, c, 0) != RET_OK) {
+        image_destroy(img);
+        return NULL;
+    }
+
+    // Replicate border
+    for (i = r; i < r + inner.h; i++) {
+        for (j = 0; j < c; j++)
+            img->ie[i][j] = img->ie[i][c];
+        for (j = c + inner.w; j < img->width; j++)
+            img->ie[i][j] = img->ie[i][c + inner.w - 1];
+    }
+    for (i = 0; i < r; i++)
+        memcpy(img->ie[i], img->ie[r], img->width * sizeof(RGBA_8888));
+    for (i = r + inner.h; i < img->height; i++)
+        memcpy(img->ie[i], img->ie[r + inner.h - 1], img->width * sizeof(RGBA_8888));
+
+    return img;
+}
+
+int timage_write_rect(TIMAGE* t, RECT* rect, IMAGE* img, int r, int c)
+{
+    RECT inner;
+
+    check_timage(t);
+    check_image(img);
+    if (!__timage_clip(t, rect, &inner))
+        return RET_OK;
+
+    r += inner.r - rect->r;
+    c += inner.c - rect->c;
+    check_point(r >= 0 && c >= 0 && r + inner.h <= img->height && c + inner.w <= img->width);
+
+    return __timage_block(t, &inner, img->ie + r, c, 1);
+}
+
+int timage_tile_rect(TIMAGE* t, int k, RECT* rect)
+{
+    check_timage(t);
+    check_point(k >= 0 && k < t->rows * t->cols);
+
+    rect->r = (k / t->cols) * TIMAGE_TILE;
+    rect->c = (k % t->cols) * TIMAGE_TILE;
+    rect->h = MIN(TIMAGE_TILE, t->height - rect->r);
+    rect->w = MIN(TIMAGE_TILE, t->width - rect->c);
+
+    return RET_OK;
+}
+
+int timage_tile_load(TIMAGE* t, int k, int halo, TILE* tile)
+{
+    RECT rect, inner;
+
+    check_point(tile != NULL);
+    check_point(timage_tile_rect(t, k, &tile->rect) == RET_OK);
+
+    halo = MAX(halo, 0);
+    rect.r = tile->rect.r - halo;
+    rect.c = tile->rect.c - halo;
+    rect.h = tile->rect.h + 2 * halo;
+    rect.w = tile->rect.w + 2 * halo;
+    __timage_clip(t, &rect, &inner);
+
+    tile->index = k;
+    tile->r = tile->rect.r - inner.r;
+    tile->c = tile->rect.c - inner.c;
+    tile->img = timage_read_rect(t, &inner);
+    check_image(tile->img);
+
+    return RET_OK;
+}
+
+int timage_tile_save(TIMAGE* t, TILE* tile)
+{
+    check_point(tile != NULL);
+
+    return timage_write_rect(t, &tile->rect, tile->img, tile->r, tile->c);
+}
+
+void timage_tile_free(TILE* tile)
+{
+    if (tile && tile->img) {
+        image_destroy(tile->img);
+        tile->img = NULL;
+    }
+}
+
+static void __apply_band(void* arg, int start, int stop)
+{
+    int k;
+    TILE tile;
+    TileArgs* a = (TileArgs*)arg;
+
+    for (k = start; k < stop && a->ret == RET_OK; k++) {
+        if (timage_tile_load(a->src, k, a->halo, &tile) != RET_OK) {
+            a->ret = RET_ERROR;
+            break;
+        }
+        if (a->func(&tile, a->arg) != RET_OK || timage_tile_save(a->dst, &tile) != RET_OK)
+            a->ret = RET_ERROR;
+        timage_tile_free(&tile);
+    }
+}
+
+// func(tile, arg) for every tile of src, interior of tile is saved to dst,
+// src == dst only when halo == 0, or tiles would see neighbours already done
+int timage_apply(TIMAGE* src, TIMAGE* dst, int halo, timage_func_t func, void* arg)
+{
+    TileArgs a;
+
+    check_timage(src);
+    check_timage(dst);
+    check_point(func != NULL);
+    check_point(src->height == dst->height && src->width == dst->width);
+    check_point(src != dst || halo == 0);
+
+    a.src = src;
+    a.dst = dst;
+    a.halo = halo;
+    a.func = func;
+    a.arg = arg;
+    a.ret = RET_OK;
+    parallel_for(src->rows * src->cols, 1, __apply_band, &a);
+
+    return a.ret;
+}
+
+static int __gauss_tile(TILE* tile, void* arg)
+{
+    return image_gauss_filter(tile->img, *(float*)arg);
+}
+
+// Halo is 4 sigma, IIR gauss has infinite support, so result is only approximately same as whole image filter
+int timage_gauss_filter(TIMAGE* t, float sigma)
+{
+    int halo;
+    void* cache;
+    TIMAGE* dst;
+
+    check_timage(t);
+
+    halo = (int)ceilf(4.0f * sigma) + 1;
+    dst = timage_create(t->height, t->width, ((TileCache*)t->cache)->budget_mb);
+    check_timage(dst);
+    if (timage_apply(t, dst, halo, __gauss_tile, &sigma) != RET_OK) {
+        timage_destroy(dst);
+        return RET_ERROR;
+    }
+
+    // Swap pixels, old one is destroyed with dst
+    cache = t->cache;
+    t->cache = dst->cache;
+    dst->cache = cache;
+    timage_destroy(dst);
+
+    return RET_OK;
+}
+
+static void __clahe_count_band(void* arg, int start, int stop)
+{
+    int k, i, j, n, *counts, *cell;
+    BYTE y;
+    RECT rect;
+    RGBA_8888 *data, *p;
+    ClaheArgs* a = (ClaheArgs*)arg;
+
+    n = a->grid_rows * a->grid_cols * HISTOGRAM_MAX_COUNT;
+    counts = (int*)calloc((size_t)n, sizeof(int));
+    if (!counts) {
+        syslog_error("Allocate memeory.");
+        a->ret = RET_ERROR;
+        return;
+    }
+    for (k = start; k < stop; k++) {
+        timage_tile_rect(a->t, k, &rect);
+        data = __tile_lock(a->t, k);
+        if (!data) {
+            a->ret = RET_ERROR;
+            continue;
+        }
+        for (i = 0; i < rect.h; i++) {
+            p = data + (size_t)i * TIMAGE_TILE;
+            cell = counts + ((rect.r + i) / a->h) * a->grid_cols * HISTOGRAM_MAX_COUNT;
+            for (j = 0; j < rect.w; j++) {
+                color_rgb2gray(p[j].r, p[j].g, p[j].b, &y);
+                cell[((rect.c + j) / a->w) * HISTOGRAM_MAX_COUNT + y]++;
+            }
+        }
+        __tile_unlock(a->t, k);
+    }
+
+    pthread_mutex_lock(&a->lock);
+    for (k = 0; k < n; k++)
+        a->counts[k] += counts[k];
+    pthread_mutex_unlock(&a->lock);
+    free(counts);
+}
+
+static int __clahe_tile(TILE* tile, void* arg)
+{
+    ClaheArgs* a = (ClaheArgs*)arg;
+
+    clahe_interpolate(tile->img, tile->rect.r - tile->r, tile->rect.c - tile->c, a->t->height, a->t->width, a->grid_rows, a->grid_cols,
+        a->h, a->w, a->hist);
+    return RET_OK;
+}
+
+// Same result as image_clahe, cell histograms are counted tile by tile
+int timage_clahe(TIMAGE* t, int grid_rows, int grid_cols, float limit)
+{
+    int i, k;
+    HISTOGRAM* cell;
+    ClaheArgs a;
+
+    check_timage(t);
+
+    clahe_grid(t->height, t->width, &grid_rows, &grid_cols, &a.h, &a.w, &limit);
+    a.t = t;
+    a.grid_rows = grid_rows;
+    a.grid_cols = grid_cols;
+    a.counts = (int*)calloc((size_t)grid_rows * grid_cols * HISTOGRAM_MAX_COUNT, sizeof(int));
+    a.hist = (HISTOGRAM*)calloc((size_t)grid_rows * grid_cols, sizeof(HISTOGRAM));
+    if (!a.counts || !a.hist) {
+        syslog_error("Allocate memeory.");
+        free(a.counts);
+        free(a.hist);
+        return RET_ERROR;
+    }
+    pthread_mutex_init(&a.lock, NULL);
+    a.ret = RET_OK;
+    parallel_for(t->rows * t->cols, 1, __clahe_count_band, &a);
+    if (a.ret != RET_OK)
+        goto exit;
+
+    for (i = 0; i < grid_rows * grid_cols; i++) {
+        cell = &a.hist[i];
+        histogram_reset(cell);
+        for (k = 0; k < HISTOGRAM_MAX_COUNT; k++) {
+            cell->count[k] = a.counts[i * HISTOGRAM_MAX_COUNT + k];
+            cell->total += cell->count[k];
+        }
+        histogram_clip(cell, (int)limit);
+        histogram_cdf(cell);
+        histogram_map(cell, 255);
+    }
+
+    a.ret = timage_apply(t, t, 0, __clahe_tile, &a);
+
+exit:
+    pthread_mutex_destroy(&a.lock);
+    free(a.counts);
+    free(a.hist);
+
+    return a.ret;
+}
+
+// Rows of a strip, TIMAGE_TILE rows at most, so every tile is pinned once per strip
+static RGBA_8888** __strip_create(int w, RGBA_8888** buf)
+{
+    int i;
+    RGBA_8888** rows;
+
+    *buf = (RGBA_8888*)malloc((size_t)TIMAGE_TILE * w * sizeof(RGBA_8888));
+    rows = (RGBA_8888**)malloc(TIMAGE_TILE * sizeof(RGBA_8888*));
+    if (!*buf || !rows) {
+        syslog_error("Allocate memeory.");
+        free(*buf);
+        free(rows);
+        return NULL;
+    }
+    for (i = 0; i < TIMAGE_TILE; i++)
+        rows[i] = *buf + (size_t)i * w;
+    return rows;
+}
+
+static int __strip_io(TIMAGE* t, int r, int h, RGBA_8888** rows, int write)
+{
+    RECT rect;
+
+    rect.r = r;
+    rect.c = 0;
+    rect.h = h;
+    rect.w = t->width;
+    return __timage_block(t, &rect, rows, 0, write);
+}
+
+// Rows are decoded by strips of TIMAGE_TILE rows (interlaced png is decoded whole by reader)
+static TIMAGE* __timage_read(IREADER* reader, int budget_mb)
+{
+    int i, h;
+    RGBA_8888 *buf = NULL, **rows = NULL;
+    TIMAGE* t = NULL;
+
+    if (!reader)
+        return NULL;
+    t = timage_create(reader->height, reader->width, budget_mb);
+    if (t)
+        rows = __strip_create(t->width, &buf);
+    if (!rows)
+        goto read_fail;
+
+    for (i = 0; i < t->height; i += h) {
+        h = MIN(TIMAGE_TILE, t->height - i);
+        if (ireader_read(reader, rows, h) != h || __strip_io(t, i, h, rows, 1) != RET_OK)
+            goto read_fail;
+    }
+    ireader_close(reader);
+    free(rows);
+    free(buf);
+
+    return t;
+
+read_fail:
+    ireader_close(reader);
+    free(rows);
+    free(buf);
+    timage_destroy(t);
+    return NULL;
+}
+
+TIMAGE* timage_load(char* fname, int budget_mb)
+{
+    char* extname = strrchr(fname, '.');
+    if (extname) {
+        if (strcasecmp(extname, ".jpg") == 0 || strcasecmp(extname, ".jpeg") == 0
+            || strcasecmp(extname, ".png") == 0)
+            return __timage_read(ireader_open(fname), budget_mb);
+    }
+
+    syslog_error("Only support jpg/jpeg/png loading.");
+    return NULL;
+}
+
+static int __timage_write(TIMAGE* t, IWRITER* writer)
+{
+    int i, h, ret;
+    RGBA_8888 *buf = NULL, **rows = NULL;
+
+    if (!writer)
+        return RET_ERROR;
+    rows = __strip_create(t->width, &buf);
+    for (i = 0; rows && i < t->height; i += h) {
+        h = MIN(TIMAGE_TILE, t->height - i);
+        if (__strip_io(t, i, h, rows, 0) != RET_OK || iwriter_write(writer, rows, h) != h)
+            break;
+    }
+    // Writer fails on missing rows
+    ret = iwriter_close(writer);
+    free(rows);
+    free(buf);
+
+    return ret;
+}
+
+int timage_save(TIMAGE* t, char* fname)
+{
+    char* extname = strrchr(fname, '.');
+    check_timage(t);
+
+    if (extname) {
+        if (strcasecmp(extname, ".jpg") == 0 || strcasecmp(extname, ".jpeg") == 0
+            || strcasecmp(extname, ".png") == 0)
+            return __timage_write(t, iwriter_open(fname, t->height, t->width, 100));
+    }
+
+    syslog_error("ONLY Support jpg/jpeg/png image saving.");
+    return RET_ERROR;
+}
@@ -0,0 +1,106 @@
+/************************************************************************************
+***
+***	Copyright 2010-2020 Dell Du(18588220928@163.com), All Rights Reserved.
+***
+***	File Author: Dell, Sat Jul 31 14:19:59 HKT 2010
+***
+************************************************************************************/
+
+#include "image.h"
+
+#define SNAPSHOTS 4
+
+static void __fill(IMAGE* img, BYTE v)
+{
+    int i, j;
+
+    image_writable(img);
+    image_foreach(img, i, j)
+    {
+        img->ie[i][j].r = img->ie[i][j].g = img->ie[i][j].b = v;
+    }
+}
+
+static int __check(IMAGE* img, BYTE v, char* name)
+{
+    int i, j;
+
+    image_foreach(img, i, j)
+    {
+        if (img->ie[i][j].r != v || img->ie[i][j].b != v) {
+            printf("%s: (%d, %d) is %d, expect %d\n", name, i, j, img->ie[i][j].r, v);
+            return RET_ERROR;
+        }
+    }
+    return RET_OK;
+}
+
+// Frame snapshots: fill 1, share, fill 2, share, ... every share keeps its own frame
+int main()
+{
+    int k, ret;
+    RECT rect;
+    IMAGE *img, *view, *src, *copy, *share[SNAPSHOTS];
+    char name[64];
+
+    img = image_create(16, 24);
+    check_image(img);
+    for (k = 0; k < SNAPSHOTS; k++) {
+        __fill(img, k + 1);
+        share[k] = image_share(img, NULL);
+        check_image(share[k]);
+    }
+    __fill(img, 100);
+
+    ret = __check(img, 100, "source");
+    for (k = 0; k < SNAPSHOTS && ret == RET_OK; k++) {
+        snprintf(name, sizeof(name), "share %d", k);
+        ret = __check(share[k], k + 1, name);
+    }
+
+    // Writing one share must not change others or the source
+    __fill(share[1], 200);
+    if (ret == RET_OK)
+        ret = __check(share[2], 3, "share 2 after write");
+    if (ret == RET_OK)
+        ret = __check(img, 100, "source after write");
+
+    // Views write through to the source
+    rect.r = 2;
+    rect.c = 3;
+    rect.h = 4;
+    rect.w = 5;
+    view = image_view(img, &rect);
+    check_image(view);
+    __fill(view, 50);
+    if (ret == RET_OK && img->ie[3][4].r != 50) {
+        printf("view: write does not go through\n");
+        ret = RET_ERROR;
+    }
+
+    // In-place filter on the source must leave earlier shares alone
+    src = image_create(16, 24);
+    check_image(src);
+    __fill(src, 80);
+    copy = image_share(src, NULL);
+    check_image(copy);
+    image_drawrect(src, &rect, 0x000000, 1);
+    image_rect(&rect, src);
+    image_gauss3x3_filter(src, &rect);
+    if (ret == RET_OK)
+        ret = __check(copy, 80, "share after filter");
+    if (ret == RET_OK && src->ie[3][4].r != 0) {
+        printf("filter: source is not drawn\n");
+        ret = RET_ERROR;
+    }
+
+    image_destroy(copy);
+    image_destroy(src);
+    image_destroy(view);
+    for (k = 0; k < SNAPSHOTS; k++)
+        image_destroy(share[k]);
+    image_destroy(img);
+
+    printf("share: %s\n", ret == RET_OK ? "OK" : "FAILED");
+    return (ret == RET_OK) ? 0 : 1;
+}
@@ -20,6 +20,7 @@ int play_video_with_image(char* input_filename, int start, int n,
 {
     IMAGE* image;
     VIDEO* video;
+    PNG_OPTIONS png_options;
     char output_file_name[256];
 
     video = video_open(input_filename, start);
@@ -27,6 +28,11 @@ int play_video_with_image(char* input_filename, int start, int n,
 
     video_info(video);
 
+    // Lossless frame dumps, fast deflate
+    png_options_init(&png_options);
+    png_options.level = 1;
+    png_options.filter = PNG_SAVE_FILTER_SUB;
+
     image = image_create(video->height, video->width);
     check_image(image);
 
@@ -38,7 +44,7 @@ int play_video_with_image(char* input_filename, int start, int n,
         frame_toimage(video_read(video), image);
         snprintf(output_file_name, sizeof(output_file_name), "%s/%06d.png",
             output_dir, start++);
-        image_save(image, output_file_name);
+        image_savepng_opt(image, output_file_name, &png_options);
         n--;
     }
     time_spend((char*)"Playing");
@@ -93,6 +99,62 @@ int play_video_with_tensor(char* input_filename, int start, int n,
     return RET_OK;
 }
 
+// Encode/decode every frame in memory, compare png (default, fast) with qoi
+int bench_frame_codecs(char* input_filename, int start, int n)
+{
+    int i, k, size;
+    char* data;
+    const char* names[3] = { "png", "png fast", "qoi" };
+    double mb, enc_ms[3] = { 0 }, dec_ms[3] = { 0 }, bytes[3] = { 0 };
+    TIME t;
+    IMAGE *image, *copy;
+    VIDEO* video;
+    PNG_OPTIONS fast;
+
+    video = video_open(input_filename, start);
+    check_video(video);
+
+    image = image_create(video->height, video->width);
+    check_image(image);
+
+    png_options_init(&fast);
+    fast.level = 1;
+    fast.filter = PNG_SAVE_FILTER_SUB;
+
+    for (i = 0; i < n && !video_eof(video); i++) {
+        frame_toimage(video_read(video), image);
+        for (k = 0; k < 3; k++) {
+            t = time_now();
+            if (k == 2)
+                data = image_saveqoi_to_memory(image, &size);
+            else
+                data = image_png_encode(image, (k == 1) ? &fast : NULL, &size);
+            enc_ms[k] += time_now() - t;
+            if (!data)
+                continue;
+            bytes[k] += size;
+
+            t = time_now();
+            copy = image_load_from_memory(data, size);
+            dec_ms[k] += time_now() - t;
+            image_destroy(copy);
+            free(data);
+        }
+    }
+    mb = (double)i * image->height * image->width * sizeof(RGBA_8888) / (1024.0 * 1024.0);
+    printf("%d frames, %.1f MB pixels\n", i, mb);
+    for (k = 0; k < 3; k++) {
+        printf("%-10s ratio %5.2f, encode %8.1f MB/s, decode %8.1f MB/s\n", names[k],
+            bytes[k] / (mb * 1024.0 * 1024.0 + 1.0), mb * 1000.0 / MAX(enc_ms[k], 1.0),
+            mb * 1000.0 / MAX(dec_ms[k], 1.0));
+    }
+
+    image_destroy(image);
+    video_close(video);
+
+    return RET_OK;
+}
+
 void help(char* cmd)
 {
     printf("This is an example for video play with nimage\n");
@@ -103,6 +165,7 @@ void help(char* cmd)
     printf("    -n, --number                 Output frames (default: 1).\n");
     printf("    -o, --output <dir>           Output diretory (default: output).\n");
     printf("    -t, --tensor                 Test with tensor.\n");
+    printf("    -b, --bench                  Benchmark png/qoi frame codecs.\n");
 
     exit(1);
 }
@@ -114,17 +177,18 @@ int main(int argc, char** argv)
     int start = 0;
     int number = 1;
     int tensor = 0;
+    int bench = 0;
     char* output_dir = (char*)"output";
 
     struct option long_opts[] = {
         { "help", 0, 0, 'h' }, { "start", 0, 0, 's' },
         { "end", 1, 0, 'e' }, { "output", 1, 0, 'o' },
-        { "tensor", 0, 0, 't' }, { 0, 0, 0, 0 } };
+        { "tensor", 0, 0, 't' }, { "bench", 0, 0, 'b' }, { 0, 0, 0, 0 } };
 
     if (argc <= 1)
         help(argv[0]);
 
-    while ((optc = getopt_long(argc, argv, "h s: n: o: t", long_opts,
+    while ((optc = getopt_long(argc, argv, "h s: n: o: t b", long_opts,
                 &option_index))
         != EOF) {
         switch (optc) {
@@ -140,6 +204,9 @@ int main(int argc, char** argv)
         case 't': // tensor
             tensor = 1;
             break;
+        case 'b': // bench
+            bench = 1;
+            break;
         case 'h': // help
         default:
             help(argv[0]);
@@ -148,6 +215,8 @@ int main(int argc, char** argv)
     }
 
     if (argc > optind) {
+        if (bench)
+            return bench_frame_codecs(argv[optind], start, number);
         return (tensor == 0)
             ? play_video_with_image(argv[optind], start, number, output_dir)
             : play_video_with_tensor(argv[optind], start, number,